@@ -0,0 +1,46 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Size-classed pool of I/O buffers for connections that only need one while
+// they have data in flight. Buffers are carved from 2 MB arenas (hugepages on
+// request) and kept on per-class LIFO free lists, so the buffer leased next is
+// the one most recently returned and most likely still in cache. Arenas are
+// never given back; the pool stays at its high-water mark.
+//
+// Not thread safe: a pool belongs to one event loop.
+#define BUFPOOL_MIN_SHIFT       6           /* smallest class: 64 bytes */
+#define BUFPOOL_CLASS_SHIFT     2           /* each class 4x the previous */
+#define BUFPOOL_CLASSES         6           /* 64 B .. 64 KB */
+#define BUFPOOL_ARENA_SIZE      (2u << 20)
+#define BUFPOOL_MAX_SIZE        ((size_t)1 << (BUFPOOL_MIN_SHIFT + BUFPOOL_CLASS_SHIFT * (BUFPOOL_CLASSES - 1)))
+
+typedef struct bufpool_free {
+    struct bufpool_free* next;
+} bufpool_free_t;
+
+typedef struct {
+    bufpool_free_t* free[BUFPOOL_CLASSES];
+    uint8_t* carve[BUFPOOL_CLASSES];        /* untouched rest of the class' current arena */
+    uint8_t* carve_end[BUFPOOL_CLASSES];
+    bool hugepages;
+    size_t reserved_bytes;                  /* mapped arenas */
+    size_t leased_bytes;                    /* handed out and not returned */
+} buffer_pool_t;
+
+// Prepares an empty pool. With hugepages, arenas are mapped with MAP_HUGETLB
+// when the system has hugepages reserved, else transparent hugepages are
+// requested for them.
+void bufpool_init(buffer_pool_t* pool, bool hugepages);
+
+// Leases a buffer of at least size bytes (at most BUFPOOL_MAX_SIZE); its
+// actual capacity is stored in *capacity. Dies if memory is exhausted.
+void* bufpool_get(buffer_pool_t* pool, size_t size, size_t* capacity);
+
+// Returns a buffer; capacity is the value bufpool_get reported for it.
+void bufpool_put(buffer_pool_t* pool, void* buf, size_t capacity);
+
+#endif /* BUFFER_POOL_H */
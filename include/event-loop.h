@@ -0,0 +1,27 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "options.h"
+
+// The event loop behind select-server and epoll-server. Accepting on every
+// endpoint, pausing the listeners while saturated, timeouts, the I/O budget
+// queue, closing and hot restart are the same for every backend; a backend
+// only keeps the kernel's view of what each fd waits for and reports
+// readiness:
+//
+//   select     fd bitmaps grown past FD_SETSIZE, ready words scanned with ctz
+//   poll       a dense pollfd array, slots moved on close
+//   epoll      level-triggered, epoll_ctl only when a peer's interest changes
+//   epoll-et   edge-triggered, every peer registered once for both directions
+//
+// The backend is picked once per turn, so dispatching an event costs the same
+// as in a loop written for that backend alone.
+
+// Runs the server described by argv; --backend overrides default_backend.
+// Only returns by exiting.
+int event_loop_main(int argc, char** argv, event_backend_t default_backend);
+
+// "select", "poll", "epoll" or "epoll-et"
+const char* event_backend_name(event_backend_t backend);
+
+#endif /* EVENT_LOOP_H */
@@ -0,0 +1,25 @@
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stdint.h>
+
+// Binary framing, the alternative to ^...$ messages. A client picks it by
+// making FRAME_MAGIC the first byte it sends after the server's '*' ack; any
+// other first byte starts the text protocol. From then on every message, in
+// both directions, is a frame_header_t followed by len payload bytes. The
+// reply to a FRAME_DATA frame is a FRAME_DATA frame of the same length with
+// every payload byte incremented. Payloads may contain any byte value and
+// may span any number of recv calls.
+#define FRAME_MAGIC         0xfb
+#define FRAME_DATA          1
+#define FRAME_MAX_LEN       (1u << 30)      /* longer frames are a protocol error */
+
+typedef struct {
+    uint32_t len;                           /* payload bytes, network byte order */
+    uint8_t type;                           /* FRAME_* */
+    uint8_t reserved[3];                    /* zero */
+} frame_header_t;
+
+_Static_assert(sizeof(frame_header_t) == 8, "frame_header_t is part of the wire format");
+
+#endif /* FRAMING_H */
@@ -0,0 +1,46 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdbool.h>
+
+#include "server.h"
+
+// Hot restart of the event-loop servers. On SIGUSR2 the running process
+// re-executes its binary with the same arguments and passes it, over a
+// SOCK_SEQPACKET socketpair with SCM_RIGHTS:
+//
+//   HELLO                       -> new process checks the peer_state_t layout
+//                               <- 'A' take peers too / 'L' listeners only
+//   LISTENER + listening socket (once per listener)
+//   PEER + fd + peer_state_t    (once per open peer, only after 'A')
+//   END                         <- 'K' everything is registered
+//
+// After 'K' the old process exits if it handed over its peers, or else stops
+// accepting and drains: it keeps serving the peers it has and exits once the
+// last one is closed. If the new process fails at any point the old one
+// carries on as if nothing happened.
+#define HANDOFF_ENV         "CONCURRENT_SERVER_HANDOFF_FD"
+
+// Remembers argv for the re-exec and installs the SIGUSR2 handler. Returns an
+// fd that becomes readable on SIGUSR2; the loop watches it for reading and
+// then calls handoff_requested.
+int handoff_init(char** argv);
+
+// Consumes the pending SIGUSR2 notifications; true if there were any.
+bool handoff_requested(void);
+
+// Old process: starts the new binary and hands it the nlisteners listening
+// sockets and, if *with_peers, every open peer. Returns true once the new
+// process has taken them over; *with_peers is cleared if it only took the
+// listeners.
+bool handoff_to_new_process(const int* listeners, int nlisteners, bool* with_peers);
+
+// New process: stores the listeners received from the previous process in
+// listeners, which has room for max_listeners, and returns how many there
+// are, or -1 if this process was not started by a hot restart. attach is
+// called with the events each adopted peer waits for so the loop can
+// register it.
+int handoff_from_old_process(int* listeners, int max_listeners,
+                             void (*attach)(int sockfd, fd_status_t status, void* ctx), void* ctx);
+
+#endif /* HANDOFF_H */
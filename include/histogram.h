@@ -0,0 +1,80 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Log-linear (HDR-style) latency histogram over nanoseconds. Values below
+// 2^HIST_SUB_BITS get a bucket each; above that every power of two is split
+// into 2^(HIST_SUB_BITS-1) equal buckets, so any recorded value is off by at
+// most 1/16 of itself. Values above 2^HIST_MAX_BITS ns (~18 min) are clamped.
+#define HIST_SUB_BITS       5
+#define HIST_SUB_COUNT      (1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT     (HIST_SUB_COUNT / 2)
+#define HIST_MAX_BITS       40
+#define HIST_BUCKETS        (HIST_SUB_COUNT + (HIST_MAX_BITS - HIST_SUB_BITS) * HIST_HALF_COUNT)
+
+// A histogram has a single writer. Readers (other threads or other processes
+// through the metrics segment) merge it on demand with histogram_merge.
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[HIST_BUCKETS];
+} histogram_t;
+
+// Monotonic timestamp for latency measurements. CLOCK_MONOTONIC_RAW is served
+// from the vDSO, so this makes no syscall.
+static inline uint64_t hist_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline int hist_bucket_index(uint64_t value) {
+    if (value < HIST_SUB_COUNT) {
+        return (int)value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    if (msb >= HIST_MAX_BITS) {
+        return HIST_BUCKETS - 1;
+    }
+    int shift = msb - HIST_SUB_BITS + 1;
+    return HIST_SUB_COUNT + (shift - 1) * HIST_HALF_COUNT + (int)(value >> shift) - HIST_HALF_COUNT;
+}
+
+// Records one value. Plain relaxed stores: only the owning thread writes.
+static inline void histogram_record(histogram_t* h, uint64_t value) {
+    int idx = hist_bucket_index(value);
+    __atomic_store_n(&h->buckets[idx], h->buckets[idx] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum_ns, h->sum_ns + value, __ATOMIC_RELAXED);
+    if (value > h->max_ns) {
+        __atomic_store_n(&h->max_ns, value, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+}
+
+// Same as histogram_record for a histogram written by several threads.
+static inline void histogram_record_atomic(histogram_t* h, uint64_t value) {
+    __atomic_fetch_add(&h->buckets[hist_bucket_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_ns, value, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+    while (value > max &&
+           !__atomic_compare_exchange_n(&h->max_ns, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+// Highest value that falls into the same bucket as index.
+uint64_t histogram_bucket_value(int index);
+
+// Adds src into dst. src may be written concurrently.
+void histogram_merge(histogram_t* dst, const histogram_t* src);
+
+// dst = a - b, for computing the histogram of an interval from two snapshots.
+void histogram_diff(histogram_t* dst, const histogram_t* a, const histogram_t* b);
+
+// Value at quantile q (0.0 - 1.0); 0 for an empty histogram.
+uint64_t histogram_percentile(const histogram_t* h, double q);
+
+#endif /* HISTOGRAM_H */
@@ -0,0 +1,68 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+// Log levels. Calls below LOG_LEVEL_MIN are removed at compile time, so a
+// disabled LOG_DEBUG costs nothing on the hot path.
+#define LOG_LEVEL_DEBUG     0
+#define LOG_LEVEL_INFO      1
+#define LOG_LEVEL_WARN      2
+#define LOG_LEVEL_ERROR     3
+#define LOG_LEVEL_NONE      4
+
+#ifndef LOG_LEVEL_MIN
+#define LOG_LEVEL_MIN       LOG_LEVEL_INFO
+#endif
+
+#define LOG_RING_SIZE       1024            /* records per thread, power of two */
+#define LOG_MSG_SIZE        112             /* keeps a record at two cache lines */
+
+// A single log record. Records live in per-thread rings and are only turned
+// into text lines by the flusher thread.
+typedef struct {
+    uint64_t timestamp_ns;                  /* CLOCK_REALTIME when the record was made */
+    uint32_t thread_id;                     /* kernel tid of the producer */
+    uint16_t level;                         /* one of LOG_LEVEL_* */
+    uint16_t len;                           /* valid bytes in msg */
+    char msg[LOG_MSG_SIZE];                 /* message body, not NUL terminated */
+} log_record_t;
+
+// Starts the background flusher thread. Until this is called log_write prints
+// synchronously to stdout, so tools that never call it still see their output.
+// Registers log_shutdown with atexit.
+void log_init(void);
+
+// Stops the flusher and writes out every pending record.
+void log_shutdown(void);
+
+// Formats a record into the calling thread's ring. Never blocks, takes no lock
+// and makes no syscall once the thread's ring exists; if the ring is full the
+// record is dropped and counted.
+void log_write(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#if LOG_LEVEL_MIN <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...)      log_write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...)      do {} while (0)
+#endif
+
+#if LOG_LEVEL_MIN <= LOG_LEVEL_INFO
+#define LOG_INFO(...)       log_write(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...)       do {} while (0)
+#endif
+
+#if LOG_LEVEL_MIN <= LOG_LEVEL_WARN
+#define LOG_WARN(...)       log_write(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...)       do {} while (0)
+#endif
+
+#if LOG_LEVEL_MIN <= LOG_LEVEL_ERROR
+#define LOG_ERROR(...)      log_write(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...)      do {} while (0)
+#endif
+
+#endif /* LOG_H */
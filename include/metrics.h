@@ -0,0 +1,167 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "histogram.h"
+
+// Live counters published in a POSIX shared-memory segment named
+// METRICS_SHM_PREFIX<pid>, read by bin/server-stat. The layout below is the
+// contract with readers: append new counters at the end of METRICS_COUNTERS
+// and bump METRICS_VERSION when the layout changes.
+#define METRICS_SHM_PREFIX      "/concurrent-server."
+#define METRICS_MAGIC           0x5343495254454dull     /* "METRICS" */
+#define METRICS_VERSION         12
+#define METRICS_MAX_SLOTS       256
+
+// Every counter is monotonic and owned by one thread, so increments are plain
+// stores: no lock, no atomic read-modify-write, no syscall.
+#define METRICS_COUNTERS(X)                                                     \
+    X(conn_accepted)            /* connections handed to the server code */     \
+    X(conn_closed)              /* connections closed by the server */          \
+    X(bytes_in)                 /* payload bytes returned by recv */            \
+    X(bytes_out)                /* bytes accepted by send */                    \
+    X(recv_calls)                                                               \
+    X(send_calls)                                                               \
+    X(eagain)                   /* recv/send/accept that returned EAGAIN */     \
+    X(loop_wakeups)             /* select/epoll_wait returns */                 \
+    X(loop_events)              /* ready fds reported across all wakeups */     \
+    X(pool_jobs_queued)                                                         \
+    X(pool_jobs_done)                                                           \
+    X(conn_timed_out)           /* closed by an idle/header/write timeout */   \
+    X(conn_rejected)            /* accepted and closed again: over a limit */   \
+    X(accept_errors)            /* accept failures other than EAGAIN */         \
+    X(listener_paused)          /* times the loop stopped accepting */         \
+    X(conn_reset)               /* connections lost to ECONNRESET */            \
+    X(conn_epipe)               /* connections lost to EPIPE */                 \
+    X(conn_io_errors)           /* connections lost to any other I/O error */   \
+    X(zerocopy_sends)           /* sendmsg calls made with MSG_ZEROCOPY */      \
+    X(zerocopy_copied)          /* ... for which the kernel copied after all */ \
+    X(conn_protocol_errors)     /* connections closed for a malformed frame */ \
+    X(thread_cache_created)     /* connection threads started */                \
+    X(thread_cache_reused)      /* connections handed to a parked thread */     \
+    X(thread_cache_waits)       /* accepts held back at the thread limit */    \
+    X(pool_submit_blocked)      /* submissions that waited for queue room */    \
+    X(pool_jobs_rejected)       /* submissions refused by a full queue */       \
+    X(pool_caller_runs)         /* jobs a full queue left to the submitter */
+
+// Latency histograms, recorded per thread like the counters.
+#define METRICS_HISTOGRAMS(X)                                                   \
+    X(msg_latency)              /* '^' received to last reply byte sent */      \
+    X(pool_queue_wait)          /* job queued to job started */                 \
+    X(pool_run_time)            /* job started to job finished */
+
+#define METRICS_DECLARE_FIELD(name) uint64_t name;
+#define METRICS_DECLARE_HIST(name) METRICS_HIST_##name,
+
+typedef struct {
+    METRICS_COUNTERS(METRICS_DECLARE_FIELD)
+} metrics_counters_t;
+
+enum {
+    METRICS_HISTOGRAMS(METRICS_DECLARE_HIST)
+    METRICS_HIST_COUNT
+};
+
+// One slot per thread, padded to whole cache lines so two threads never write
+// the same line.
+typedef struct {
+    metrics_counters_t c;
+    int32_t owner_tid;                      /* 0 when the slot is free */
+    int32_t shared;                         /* overflow slot, updated atomically */
+    histogram_t hist[METRICS_HIST_COUNT];
+} __attribute__((aligned(64))) metrics_slot_t;
+
+// Gauges are last-value-wins and may be written by any thread.
+typedef struct {
+    int64_t pool_queue_depth;               /* jobs waiting in the thread pool */
+    int64_t bufpool_leased_bytes;           /* I/O buffers held by connections */
+    int64_t bufpool_reserved_bytes;         /* memory mapped for I/O buffers */
+    int64_t zerocopy_orphan_bytes;          /* ... held for MSG_ZEROCOPY sends on closed sockets */
+} metrics_gauges_t;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t header_size;                   /* offset of slots[0] */
+    uint32_t slot_size;
+    uint32_t max_slots;
+    uint32_t slots_used;                    /* high-water mark of claimed slots */
+    int32_t pid;
+    uint64_t start_time_ns;                 /* CLOCK_REALTIME at metrics_init */
+    char program[32];
+    metrics_gauges_t gauges;
+} __attribute__((aligned(64))) metrics_header_t;
+
+typedef struct {
+    metrics_header_t header;
+    metrics_slot_t slots[METRICS_MAX_SLOTS];
+} metrics_shm_t;
+
+// Creates and maps the shared-memory segment for this process and arranges for
+// it to be unlinked at exit. If shared memory is unavailable the counters are
+// kept in private memory so instrumentation keeps working.
+void metrics_init(const char* program);
+
+// Claims a slot for the calling thread. Called once per thread through
+// metrics_local(); the slot is released when the thread exits.
+metrics_counters_t* metrics_claim_slot(void);
+
+// Maps the segment of a running server read-only. Returns NULL if it does not
+// exist or has an unexpected layout.
+const metrics_shm_t* metrics_attach(pid_t pid);
+
+// Sums every slot of a mapped segment into out.
+void metrics_sum(const metrics_shm_t* shm, metrics_counters_t* out);
+
+// Merges histogram id (METRICS_HIST_*) of every slot into out.
+void metrics_sum_hist(const metrics_shm_t* shm, int id, histogram_t* out);
+
+// Names of the histograms, indexed by METRICS_HIST_*.
+extern const char* const metrics_hist_names[METRICS_HIST_COUNT];
+
+extern __thread metrics_counters_t* metrics_tl;
+extern __thread int metrics_tl_shared;
+extern metrics_shm_t* metrics_shm;
+
+static inline metrics_counters_t* metrics_local(void) {
+    metrics_counters_t* c = metrics_tl;
+    if (__builtin_expect(c == NULL, 0)) {
+        c = metrics_claim_slot();
+    }
+    return c;
+}
+
+#define METRIC_ADD(field, n)                                                    \
+    do {                                                                        \
+        metrics_counters_t* mc_ = metrics_local();                              \
+        if (__builtin_expect(metrics_tl_shared, 0)) {                           \
+            __atomic_fetch_add(&mc_->field, (n), __ATOMIC_RELAXED);             \
+        } else {                                                                \
+            __atomic_store_n(&mc_->field, mc_->field + (n), __ATOMIC_RELAXED);  \
+        }                                                                       \
+    } while (0)
+
+#define METRIC_INC(field)           METRIC_ADD(field, 1)
+
+// The slot holding the calling thread's counters also holds its histograms.
+#define METRIC_HIST_RECORD(name, ns)                                            \
+    do {                                                                        \
+        metrics_slot_t* ms_ = (metrics_slot_t*)metrics_local();                 \
+        if (__builtin_expect(metrics_tl_shared, 0)) {                           \
+            histogram_record_atomic(&ms_->hist[METRICS_HIST_##name], (ns));     \
+        } else {                                                                \
+            histogram_record(&ms_->hist[METRICS_HIST_##name], (ns));            \
+        }                                                                       \
+    } while (0)
+
+#define METRIC_GAUGE_SET(field, v)                                              \
+    do {                                                                        \
+        if (metrics_shm) {                                                      \
+            __atomic_store_n(&metrics_shm->header.gauges.field, (v), __ATOMIC_RELAXED); \
+        }                                                                       \
+    } while (0)
+
+#endif /* METRICS_H */
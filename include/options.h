@@ -0,0 +1,50 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <stdbool.h>
+
+#include "sockopts.h"
+
+// How the event-loop servers wait for readiness, see event-loop.h
+typedef enum {
+    BACKEND_DEFAULT,                        /* the one the binary is named after */
+    BACKEND_SELECT,
+    BACKEND_POLL,
+    BACKEND_EPOLL,
+    BACKEND_EPOLL_ET,
+} event_backend_t;
+
+// Most endpoints one server listens on
+#define OPTIONS_MAX_LISTEN  16
+
+// A listening endpoint (listen_endpoint in utils.h) and its socket profile
+typedef struct {
+    const char* endpoint;
+    const sock_profile_t* profile;
+} listen_spec_t;
+
+// Command line of the event-loop servers:
+//
+//   server [options] [port]
+//
+// The port is one more endpoint next to those given with --listen; without
+// either the server listens on IPv4 port 9090. Long options are listed in
+// src/options.c. Unknown options print the usage and exit.
+typedef struct {
+    listen_spec_t listen[OPTIONS_MAX_LISTEN];
+    int nlisten;
+    int max_conns;                          /* open peers admitted at once; 0 = table size */
+    int idle_timeout_ms;                    /* no traffic at all; 0 disables */
+    int header_timeout_ms;                  /* a started message must end within this */
+    int write_timeout_ms;                   /* queued output makes no progress */
+    bool handoff_peers;                     /* hot restart hands over connections too */
+    bool hugepages;                         /* back the I/O buffer pool with hugepages */
+    int zerocopy_min;                       /* send at least this many bytes with MSG_ZEROCOPY; 0 = never */
+    event_backend_t backend;
+    const sock_profile_t* sock_profile;     /* for endpoints not naming their own */
+    const char* capture_path;               /* trace inbound traffic here; NULL = off */
+} server_options_t;
+
+void parse_server_options(int argc, char** argv, server_options_t* opts);
+
+#endif /* OPTIONS_H */
@@ -0,0 +1,55 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// USDT (statically defined tracing) probes, provider "concurrent_server".
+// With <sys/sdt.h> (systemtap-sdt-dev) each probe is a single nop plus an ELF
+// note naming it and where its arguments live, so bpftrace or perf can attach
+// to a running server:
+//
+//   bpftrace -e 'usdt:bin/epoll-server:concurrent_server:ready__exit
+//                { @in = hist(arg2); }' -p PID
+//
+// Without the header, or built with make PROBES=0, every probe compiles to
+// nothing. Arguments are never evaluated by the fallback, so they must not
+// have side effects.
+//
+//   conn__accept        (fd)                        accept_peer returned fd
+//   conn__close         (fd)                        the server is done with fd
+//   connected__entry    (fd)                        on_peer_connected
+//   connected__exit     (fd)
+//   ready__entry        (fd, readable)              on_peer_ready
+//   ready__exit         (fd, bytes_in, bytes_out, want_read, want_write)
+//   closed__entry       (fd)                        on_peer_closed
+//   closed__exit        (fd)
+//   state__change       (peer_state_t*, old, new)   ProcessingState values
+//   job__enqueue        (job*, queue_len)           thread pool
+//   job__start          (job*, queue_wait_ns)
+//   job__end            (job*, run_ns)
+//   job__overflow       (capacity, policy)          a full queue refused a job
+#define PROBES_PROVIDER     concurrent_server
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBES_ENABLED      1
+#endif
+#endif
+
+#ifdef PROBES_ENABLED
+#define PROBE1(name, a)             DTRACE_PROBE1(PROBES_PROVIDER, name, a)
+#define PROBE2(name, a, b)          DTRACE_PROBE2(PROBES_PROVIDER, name, a, b)
+#define PROBE3(name, a, b, c)       DTRACE_PROBE3(PROBES_PROVIDER, name, a, b, c)
+#define PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(PROBES_PROVIDER, name, a, b, c, d, e)
+#else
+// sizeof keeps variables only a probe reads from looking unused
+#define PROBE1(name, a)             do { (void)sizeof(a); } while (0)
+#define PROBE2(name, a, b)          do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define PROBE3(name, a, b, c)       do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#define PROBE5(name, a, b, c, d, e)                                             \
+    do {                                                                        \
+        (void)sizeof(a); (void)sizeof(b); (void)sizeof(c);                      \
+        (void)sizeof(d); (void)sizeof(e);                                       \
+    } while (0)
+#endif
+
+#endif /* PROBES_H */
@@ -11,22 +11,126 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <signal.h>
 
 #include "utils.h"
+#include "log.h"
+#include "metrics.h"
+#include "options.h"
+#include "timer-wheel.h"
+#include "buffer-pool.h"
+#include "framing.h"
 
 
-// Max FDS on linux is 1024
-#define MAXFDS              1000
-#define SENDBUF_SIZE        1024
+// The per-fd tables are sized from RLIMIT_NOFILE, up to this many entries
+#define PEER_TABLE_MAX      (1 << 20)
+#define PEER_RECV_LEASE     16384           /* buffer leased for a recv; replies are built in place */
+#define PEER_RECV_HEADROOM  sizeof(frame_header_t) /* data before the received bytes, see parse_input */
+#define PEER_PENDING_MSGS   16              /* messages tracked for latency per peer */
+#define PEER_SEND_SEGS      32              /* reply runs per sendbuf before they are compacted */
+#define PEER_IO_BUDGET      65536           /* bytes a peer may move per loop turn */
+#define PEER_TIMER_TICK_MS  10              /* resolution of the connection timeouts */
 
-typedef enum {INITIAL_ACK, WAIT_FOR_MSG, IN_MSG } ProcessingState;
+// WAIT_FOR_MODE: the ack is sent and the client's first byte picks the
+// protocol: ^...$ messages (WAIT_FOR_MSG, IN_MSG) or frames (framing.h;
+// WAIT_FOR_FRAME, IN_FRAME_HEADER, IN_FRAME).
+typedef enum {
+    INITIAL_ACK,
+    WAIT_FOR_MSG,
+    IN_MSG,
+    WAIT_FOR_MODE,
+    WAIT_FOR_FRAME,
+    IN_FRAME_HEADER,
+    IN_FRAME,
+} ProcessingState;
 
+// A complete message whose reply is still (partly) in sendbuf
 typedef struct {
+    int end;                                /* Reply bytes queued up to its last one */
+    uint64_t start_ns;                      /* When its '^' was received */
+} pending_msg_t;
+
+// A run of reply bytes in sendbuf data; the framing around it is never copied
+typedef struct {
+    int start;                              /* Offset of the next byte to send */
+    int end;                                /* Offset just past its last byte */
+} send_seg_t;
+
+// Output queued for a peer. Leased from the buffer pool for a recv, which
+// lands in data; replies are transformed in place and queued as segments
+// that skip the framing, then sent with one sendmsg per wakeup. Returned as
+// soon as everything is sent, or once the kernel is done reading it when it
+// was sent with MSG_ZEROCOPY.
+typedef struct sendbuf {
+    int size;                               /* Capacity of data */
+    int used;                               /* Bytes of data holding received input */
+    int end;                                /* Reply bytes queued, over all segments */
+    int ptr;                                /* Reply bytes handed to send() */
+    int nsegs;                              /* Valid entries in segs */
+    int seg;                                /* First segment with bytes left to send */
+    int npending;                           /* Valid entries in pending */
+    bool zc_used;                           /* sent with MSG_ZEROCOPY at least once */
+    uint32_t zc_seq;                        /* ... and the last of those sends */
+    struct sendbuf* next;                   /* in peer_info_t.zc_parked */
+    send_seg_t segs[PEER_SEND_SEGS];
+    pending_msg_t pending[PEER_PENDING_MSGS];
+    uint8_t data[];                         /* Received input and, in place, the reply */
+} sendbuf_t;
+
+#define PEER_WANT_READ      0x1
+#define PEER_WANT_WRITE     0x2
+
+// State an event touches, one cache line per peer in a dense table indexed
+// by fd: a wakeup for a peer costs one line, not a walk past its buffers.
+// Everything else lives in peer_info_t or the leased sendbuf.
+typedef struct {
+    bool open;                              /* fd is a connected peer of this process */
+    uint8_t interest;                       /* PEER_WANT_* the loop has registered */
+    bool deferred;                          /* in the deferred queue */
     ProcessingState state;
-    uint8_t sendbuf[SENDBUF_SIZE];          /* Contains data the server has to send back to client */
-    int sendbuf_end;                        /* Point to last valid byte in buffer */
-    int sendptr;                            /* Point to next byte to send */
-} peer_state_t;
+    sendbuf_t* sendbuf;                     /* NULL while nothing is queued */
+    uint64_t msg_start_ns;                  /* When the message being received started */
+    uint64_t last_activity_ns;              /* Last recv or send that moved bytes */
+    uint64_t last_send_ns;                  /* Last send progress while output was queued */
+    tw_timer_t timer;                       /* Earliest of the peer's timeouts */
+} __attribute__((aligned(64))) peer_state_t;
+
+_Static_assert(sizeof(peer_state_t) == 64, "peer_state_t must stay one cache line");
+
+// Cold per-peer details, only used when a peer connects, times out or is
+// handed over, and by the frame parser.
+typedef struct {
+    struct sockaddr_storage addr;           /* as returned by accept */
+    socklen_t addr_len;
+    uint64_t connected_ns;
+    uint32_t zc_sent;                       /* MSG_ZEROCOPY sends made on the socket */
+    uint32_t zc_done;                       /* ... of which the kernel reported completion */
+    sendbuf_t* zc_parked;                   /* released buffers the kernel may still read */
+    uint32_t frame_left;                    /* IN_FRAME: payload bytes still to come */
+    bool zc_enabled;                        /* SO_ZEROCOPY is on; never for Unix sockets */
+    uint8_t header_len;                     /* IN_FRAME_HEADER: bytes of header received */
+    frame_header_t header;                  /* ... and the bytes themselves */
+    uint32_t trace_conn;                    /* connection id in the capture; 0 = not captured */
+} peer_info_t;
+
+// each peer is identified by the file descriptor
+extern peer_state_t* global_state;
+extern peer_info_t* peer_info;
+extern int peer_table_size;                 /* entries in both tables */
+
+// Allocates the peer tables for fds below size, or below RLIMIT_NOFILE when
+// size is 0 (capped at PEER_TABLE_MAX). Pages are only touched once an fd is
+// used. Returns the table size.
+int peer_table_init(int size);
+
+// Peers that used up their I/O budget with work left, served round-robin
+// after the events of the next turn. While any are queued the loops poll
+// without blocking. A peer is queued at most once.
+void peers_defer(int sockfd);
+bool peers_deferred(void);
+// Gives every peer queued before the call one more turn with serve (which
+// may defer it again); closed peers are skipped.
+void peers_run_deferred(void (*serve)(int sockfd, void* ctx), void* ctx);
 
 // Callback return this status to main loop
 typedef struct {
@@ -36,9 +140,61 @@ typedef struct {
 
 
 
+// Admission control for the accept paths. max_conns bounds the open peers and
+// fd_limit the accepted fd numbers (for servers indexing a table by fd); 0
+// means no limit. Also reserves the spare fd used to shed connections when
+// the process runs out of fds.
+void admission_init(int max_conns, int fd_limit);
+
+// Ignores SIGPIPE for the whole process; every server main calls it at startup.
+void ignore_sigpipe(void);
+
+// Accepts one connection. Returns its fd, or -1 when there was nothing to
+// accept, accept failed, or the connection was over a limit and has been
+// closed again. Never kills the server. The socket gets the options of the
+// listener's profile that it does not inherit (sock_profile_accepted).
+int accept_peer(int listener_sockfd, struct sockaddr_storage* peer_addr, socklen_t* peer_addr_len);
+
+// True while no further peer can be admitted; event loops stop watching the
+// listener until a peer is closed.
+bool peers_saturated(void);
+
 void serve_connection(int sockfd);
-fd_status_t on_peer_ready_recv(int sockfd);
-fd_status_t on_peer_ready_send(int sockfd);
-fd_status_t on_peer_connected(int sockfd, const struct sockaddr_in* peer_addr, socklen_t peer_addr_len);
+// Serves a peer the poller reported ready: sends what is queued and, if it
+// was readable, reads and answers requests, for up to PEER_IO_BUDGET bytes.
+// Sets *exhausted if the budget ran out with work left; the loop then
+// defers the peer (peers_defer) so the others get their turn first.
+fd_status_t on_peer_ready(int sockfd, bool readable, bool* exhausted);
+fd_status_t on_peer_connected(int sockfd, const struct sockaddr* peer_addr, socklen_t peer_addr_len);
+// Called by an event loop when the poller reports an error on sockfd. Returns
+// true if it was only MSG_ZEROCOPY completions, which are collected; otherwise
+// counts the socket's pending error and the loop closes the peer.
+bool on_peer_error(int sockfd);
+// Must be called by the main loop once it has closed a peer's socket
+void on_peer_closed(int sockfd);
+// Installs a peer taken over from another process (see handoff.h) with the
+// state, details and queued output (NULL if none) it had there; returns what
+// it waits for.
+fd_status_t on_peer_adopted(int sockfd, const peer_state_t* state, const peer_info_t* info,
+                            const sendbuf_t* sendbuf);
+
+// Sets up the buffer pool the peers lease their buffers from.
+void peer_buffers_init(const server_options_t* opts);
+
+// With opts->capture_path, records every connection accepted from now on and
+// the bytes it sends into a trace (trace.h) until the process exits. Peers
+// adopted in a hot restart are not captured.
+void peer_capture_init(const server_options_t* opts);
+
+// Number of open peers.
+int peers_count(void);
+
+// Connection timeouts of the event-loop servers. peer_timers_init takes the
+// limits from opts (0 disables one); the main loop then waits at most
+// peer_timers_next_ms() (-1: forever) and calls peer_timers_expire, which
+// hands every timed out peer to close_peer.
+void peer_timers_init(const server_options_t* opts);
+int peer_timers_next_ms(void);
+void peer_timers_expire(void (*close_peer)(int sockfd, void* ctx), void* ctx);
 
 #endif /* SERVER_H */
\ No newline at end of file
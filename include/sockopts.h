@@ -0,0 +1,53 @@
+#ifndef SOCKOPTS_H
+#define SOCKOPTS_H
+
+#include <stdbool.h>
+
+// Named sets of socket options for a listener and the connections accepted
+// from it. Linux copies TCP_NODELAY, buffer sizes, busy polling and keepalive
+// from a listener into the sockets it accepts, so those are set once on the
+// listener; TCP_QUICKACK, which the kernel does not keep, is set on every
+// accepted socket by accept_peer.
+//
+//   default          TCP_NODELAY: a reply written in more than one send
+//                    does not wait for the ACK of the first part, which with
+//                    the client's delayed ACK stalls it for up to 40 ms
+//   low-latency      default + TCP_QUICKACK for the first exchange,
+//                    SO_BUSY_POLL and TCP_FASTOPEN
+//   bulk-throughput  Nagle left on to coalesce small sends, 4 MB socket
+//                    buffers
+//   many-idle        TCP_NODELAY, small fixed socket buffers instead of
+//                    autotuning, keepalive to find dead peers, deep backlog
+//
+// On Unix sockets only the buffer sizes and the backlog apply.
+//
+// TCP_DEFER_ACCEPT is not used by any profile: the server speaks first (the
+// '*' ack), so a deferred accept would only hold the connection until the
+// kernel gives up waiting for client data.
+typedef struct {
+    const char* name;
+    bool nodelay;                           /* TCP_NODELAY, inherited */
+    bool quickack;                          /* TCP_QUICKACK, on accepted sockets */
+    int sndbuf;                             /* SO_SNDBUF, inherited; 0 = autotuned */
+    int rcvbuf;                             /* SO_RCVBUF, inherited; 0 = autotuned */
+    int busy_poll_us;                       /* SO_BUSY_POLL, inherited; 0 = off */
+    int fastopen_qlen;                      /* TCP_FASTOPEN on the listener; 0 = off */
+    int keepalive_idle_s;                   /* SO_KEEPALIVE + TCP_KEEPIDLE, inherited; 0 = off */
+    int backlog;                            /* listen() backlog; 0 = as created */
+} sock_profile_t;
+
+// The profile called name, or NULL.
+const sock_profile_t* sock_profile_find(const char* name);
+
+// "default, low-latency, ..." for usage messages
+const char* sock_profile_names(void);
+
+// Applies profile to a listening socket and remembers it for the sockets
+// accepted from it. Options the kernel refuses are logged and skipped.
+void sock_profile_listener(int listener_sockfd, const sock_profile_t* profile);
+
+// Applies the options accepted sockets do not inherit from the listener's
+// profile. A listener never registered gets all of the default profile.
+void sock_profile_accepted(int listener_sockfd, int sockfd);
+
+#endif /* SOCKOPTS_H */
@@ -0,0 +1,44 @@
+#ifndef THREAD_CACHE_H
+#define THREAD_CACHE_H
+
+#include <stddef.h>
+
+// Threads for thread-per-connection servers. A thread that finishes its work
+// parks instead of exiting, and the next thread_cache_run hands it new work
+// directly. So only the first connections, and bursts past the cached count,
+// pay for pthread_create and a fresh stack. Threads are detached and never
+// joined; a cache lives as long as the process.
+
+#define THREAD_CACHE_MIN_STACK      (64 * 1024)     /* serve_connection keeps 16 KB on the stack */
+#define THREAD_CACHE_DEFAULT_STACK  (256 * 1024)
+
+typedef struct {
+    size_t stack_size;                      /* bytes; 0 = THREAD_CACHE_DEFAULT_STACK */
+    size_t guard_size;                      /* bytes of PROT_NONE below each stack */
+    int max_threads;                        /* threads alive at once; 0 = unlimited */
+    int max_idle;                           /* parked threads kept; more exit */
+} thread_cache_config_t;
+
+typedef struct thread_cache thread_cache_t;
+
+// Returns NULL if the attributes are rejected (stack below PTHREAD_STACK_MIN).
+// Stack and guard sizes are rounded up to whole pages.
+thread_cache_t* thread_cache_create(const thread_cache_config_t* config);
+
+// Runs fn(arg) on a parked thread, or on a new one while fewer than
+// max_threads are alive. At the limit it blocks until a thread finishes, so
+// an acceptor calling it stops accepting and connections wait in the kernel's
+// listen queue. Returns 0, or -1 if a thread could not be created.
+int thread_cache_run(thread_cache_t* tc, void (*fn)(void* arg), void* arg);
+
+typedef struct {
+    int alive;                              /* threads created and not exited */
+    int idle;                               /* ... of which parked */
+    unsigned long created;                  /* pthread_create calls */
+    unsigned long reused;                   /* runs handed to a parked thread */
+    unsigned long waits;                    /* runs that blocked at max_threads */
+} thread_cache_stats_t;
+
+void thread_cache_stats(thread_cache_t* tc, thread_cache_stats_t* out);
+
+#endif /* THREAD_CACHE_H */
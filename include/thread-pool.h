@@ -1,11 +1,47 @@
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
+#include <pthread.h>
+#include <stdint.h>
 
 #define     ZERO_JOB         0
 #define     ONE_JOB          1
 
+/* threadpool_add_work: the queue was full and the policy is THREADPOOL_REJECT */
+#define     THREADPOOL_REJECTED   1
+
+/* What threadpool_add_work does when the queue holds capacity jobs */
+typedef enum {
+    THREADPOOL_BLOCK,                           /* wait until a worker takes a job */
+    THREADPOOL_REJECT,                          /* return THREADPOOL_REJECTED at once */
+    THREADPOOL_CALLER_RUNS,                     /* run the job on the calling thread */
+} threadpool_overflow_t;
+
 /**************************** DEFINE STRUCTURES ******************************/
+/* Counters of one worker. Only the worker writes them; readers take
+ * threadpool_stats snapshots while it runs. */
+typedef struct threadpool_worker_stats {
+    uint64_t          jobs;                     /* jobs executed */
+    uint64_t          busy_ns;                  /* time spent running jobs */
+    uint64_t          idle_ns;                  /* time spent waiting for a job */
+    uint64_t          parks;                    /* waits that had to sleep: the queue was empty */
+    uint64_t          empty_wakeups;            /* woke for a job another worker took first */
+    uint64_t          busy_since_ns;            /* job start, 0 when not running one */
+    uint64_t          idle_since_ns;            /* wait start, 0 when not waiting */
+} threadpool_worker_stats_t;
+
+
+/* Pool-wide view returned by threadpool_stats */
+typedef struct threadpool_stats {
+    int               threads_alive;
+    int               threads_working;
+    int               queue_len;                /* jobs waiting now */
+    int               queue_high_water;         /* most jobs ever waiting at once */
+    uint64_t          oldest_wait_ns;           /* see threadpool_queue_wait_ns */
+    threadpool_worker_stats_t total;            /* summed over workers; *_since_ns unused */
+} threadpool_stats_t;
+
+
 /* Binary semaphore */
 typedef struct bsem {
     pthread_mutex_t   mutex;
@@ -19,6 +55,7 @@ typedef struct job {
     struct job*       next;                     /* pointer to previous job */
     void              (*function)(void* arg);   /* function pointer to job */
     void*             arg;                      /* job's argument */
+    uint64_t          enqueue_ns;               /* when the job was queued */
 } job;
 
 
@@ -28,7 +65,13 @@ typedef struct jobqueue {
     job*              front;                    /* pointer to front of queue */
     job*              rear;                     /* pointer to rear of queue */
     bsem*             has_jobs;                 /* flag as binary semaphore */
+    pthread_cond_t    has_room;                 /* signalled when a job is pulled */
     int               len;                      /* number of jobs in queue */
+    int               high_water;               /* largest len seen */
+    int               capacity;                 /* most jobs queued; 0 = unbounded */
+    threadpool_overflow_t overflow;             /* what to do at capacity */
+    int               blocked;                  /* producers waiting on has_room */
+    int               shutting_down;            /* threadpool_destroy began: no more jobs */
 } jobqueue;
 
 
@@ -38,12 +81,15 @@ typedef struct thread {
     int               id;                       /* thread id */
     pthread_t         pthread;                  /* pointer to actual thread */
     struct threadpool_* thpool_p;                /* access to threadpool */
+    /* a cache line of its own: workers never write a line another one does */
+    threadpool_worker_stats_t stats __attribute__((aligned(64)));
 } thread;
 
 
 /* threadpool */
 typedef struct threadpool_ {
     thread**          threads;                  /* pointer to threads */
+    int               num_threads;              /* threads created by threadpool_init */
     volatile int      num_threads_alive;        /* threads currently alive */
     volatile int      num_threads_working;      /* threads currently working */
     pthread_mutex_t   count_lock;               /* used for thread count lock */
@@ -64,18 +110,45 @@ typedef struct threadpool_ {
 threadpool_* threadpool_init(int num_threads);
 
 
+/**
+ * @brief Bounds the job queue. Until called the queue is unbounded.
+ *
+ * @param pool_p            The threadpool to bound
+ * @param capacity          Most jobs waiting for a worker; 0 removes the bound
+ * @param overflow          What threadpool_add_work does when the queue is full
+ *
+ * @return                  Nothing
+ */
+void threadpool_set_queue_limit(threadpool_* pool_p, int capacity, threadpool_overflow_t overflow);
+
+
 /**
  * @brief Take an action and its argument and adds it to the threadpool's job queue.
+ *        With a full bounded queue it blocks, rejects or runs the job itself,
+ *        as set by threadpool_set_queue_limit.
  * 
  * @param pool_p            Threadpool to which the work will be added
  * @param function_p        Pointer to function to add as work
  * @param arg_p             Pointer to an argument of function as work
  * 
- * @return int              0 on success, -1 otherwise
+ * @return int              0 when queued or run, THREADPOOL_REJECTED when the
+ *                          full queue rejected it, -1 on error
  */
 int threadpool_add_work(threadpool_* pool_p, void (*function_p)(void*), void* arg_p);
 
 
+/**
+ * @brief How long the oldest queued job has been waiting for a worker.
+ *        An acceptor can stop accepting while this is high and leave new
+ *        connections to the kernel's listen queue.
+ *
+ * @param pool_p            The threadpool to look at
+ *
+ * @return uint64_t         Nanoseconds; 0 when no job is waiting
+ */
+uint64_t threadpool_queue_wait_ns(threadpool_* pool_p);
+
+
 /**
  * @brief Construct a new threadpool wait object.
  *        Wait for all queued jobs to finish
@@ -121,6 +194,22 @@ void threadpool_resume(threadpool_* pool_p);
 void threadpool_destroy(threadpool_* pool_p);
 
 
+/**
+ * @brief Snapshot of the pool's counters, taken without stopping workers.
+ *        Time a worker has spent in its current job or wait so far is
+ *        included, so idle workers show up as idle before they wake.
+ *
+ * @param pool_p            The threadpool to look at
+ * @param stats_p           Filled with pool-wide values and per-worker totals
+ * @param workers_p         If not NULL, filled with each worker's counters
+ * @param max_workers       Room in workers_p
+ *
+ * @return int              Number of workers, which may exceed max_workers
+ */
+int threadpool_stats(threadpool_* pool_p, threadpool_stats_t* stats_p,
+                     threadpool_worker_stats_t* workers_p, int max_workers);
+
+
 /**
  * @brief Show currently working threads
  * 
@@ -0,0 +1,55 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Hierarchical timer wheel. Level 0 has one slot per tick; each further level
+// covers TW_SLOTS times the range of the one below and is cascaded down as time
+// reaches it. Arm and cancel are O(1): timers are intrusive list nodes that the
+// caller embeds in its own structures.
+#define TW_LEVELS           4
+#define TW_SLOT_BITS        6
+#define TW_SLOTS            (1 << TW_SLOT_BITS)
+#define TW_SLOT_MASK        (TW_SLOTS - 1)
+
+typedef struct tw_timer {
+    struct tw_timer* next;
+    struct tw_timer** pprev;                /* NULL when not armed */
+    uint64_t expires;                       /* tick the timer fires on */
+} tw_timer_t;
+
+typedef struct {
+    uint64_t start_ns;                      /* time of tick 0 */
+    uint64_t tick_ns;
+    uint64_t now_tick;                      /* last tick processed */
+    size_t count;                           /* armed timers */
+    tw_timer_t* slots[TW_LEVELS][TW_SLOTS];
+} timer_wheel_t;
+
+typedef void (*tw_expire_fn)(tw_timer_t* timer, void* ctx);
+
+// Initializes an empty wheel whose tick 0 is now_ns.
+void tw_init(timer_wheel_t* wheel, uint64_t tick_ms, uint64_t now_ns);
+
+// Arms (or re-arms) timer to fire at the first tick at or after deadline_ns.
+void tw_arm(timer_wheel_t* wheel, tw_timer_t* timer, uint64_t deadline_ns);
+
+// Disarms timer; does nothing if it is not armed.
+void tw_cancel(timer_wheel_t* wheel, tw_timer_t* timer);
+
+static inline bool tw_armed(const tw_timer_t* timer) {
+    return timer->pprev != NULL;
+}
+
+// Processes every tick up to now_ns and calls expire for each timer that fell
+// due. Timers are disarmed before expire runs, which may re-arm or cancel any
+// timer. Returns the number of expired timers.
+int tw_advance(timer_wheel_t* wheel, uint64_t now_ns, tw_expire_fn expire, void* ctx);
+
+// Milliseconds until tw_advance next has work to do, for use as a
+// select/epoll_wait timeout; -1 when no timer is armed.
+int tw_next_timeout_ms(const timer_wheel_t* wheel, uint64_t now_ns);
+
+#endif /* TIMER_WHEEL_H */
@@ -0,0 +1,90 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Traffic traces: what clients sent to a server, per connection and in time
+// order, for test/replay to send again. A trace is a trace_file_header_t
+// followed by records, each a trace_record_t and len payload bytes padded to
+// TRACE_ALIGN. Files are only ever appended to, through a shared mapping, so
+// a reader can map one and walk it in place. Records end at the end of the
+// file or at the first all-zero header: a writer that did not close the file
+// (the server was killed) leaves its preallocated tail zeroed.
+#define TRACE_MAGIC         0x45434152545343ull     /* "CSTRACE" */
+#define TRACE_VERSION       1
+#define TRACE_ALIGN         8
+
+enum {
+    TRACE_OPEN = 1,                         /* payload: the peer's sockaddr */
+    TRACE_DATA,                             /* payload: bytes received */
+    TRACE_CLOSE,                            /* no payload */
+};
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t header_size;                   /* offset of the first record */
+    uint64_t start_time_ns;                 /* CLOCK_REALTIME when capture began */
+    uint64_t reserved;
+} trace_file_header_t;
+
+typedef struct {
+    uint64_t t_ns;                          /* CLOCK_MONOTONIC since capture began */
+    uint32_t conn;                          /* connection id, from 1 in OPEN order */
+    uint16_t type;                          /* TRACE_* */
+    uint16_t reserved;
+    uint32_t len;                           /* payload bytes */
+    uint32_t pad;
+} trace_record_t;
+
+_Static_assert(sizeof(trace_file_header_t) % TRACE_ALIGN == 0, "records must stay aligned");
+_Static_assert(sizeof(trace_record_t) == 24, "trace_record_t is part of the file format");
+
+static inline size_t trace_record_size(uint32_t len) {
+    return sizeof(trace_record_t) + ((len + TRACE_ALIGN - 1) & ~(size_t)(TRACE_ALIGN - 1));
+}
+
+static inline const uint8_t* trace_payload(const trace_record_t* r) {
+    return (const uint8_t*)(r + 1);
+}
+
+typedef struct trace_writer trace_writer_t;
+
+// Starts a trace at path. An existing file is never overwritten: the trace
+// then goes to path.PID, so a hot-restarted server with the same command line
+// does not clobber its predecessor's capture. Returns NULL on failure.
+trace_writer_t* trace_writer_open(const char* path);
+
+// The file actually written.
+const char* trace_writer_path(const trace_writer_t* w);
+
+// Records a new connection and returns its id.
+uint32_t trace_conn_open(trace_writer_t* w, const struct sockaddr* addr, socklen_t addr_len);
+
+void trace_conn_data(trace_writer_t* w, uint32_t conn, const void* data, size_t len);
+
+void trace_conn_close(trace_writer_t* w, uint32_t conn);
+
+// Unmaps the file and cuts off the preallocated tail.
+void trace_writer_close(trace_writer_t* w);
+
+typedef struct {
+    const uint8_t* base;
+    size_t size;
+    size_t off;                             /* next record */
+    const trace_file_header_t* header;
+} trace_reader_t;
+
+// Maps a trace read-only. Returns -1, with a message on stderr, if it cannot
+// be read or is not a trace.
+int trace_reader_open(trace_reader_t* r, const char* path);
+
+// The next record, or NULL at the end of the trace. A record cut short by the
+// end of the file ends the trace.
+const trace_record_t* trace_next(trace_reader_t* r);
+
+void trace_reader_close(trace_reader_t* r);
+
+#endif /* TRACE_H */
@@ -16,14 +16,35 @@ void* xmalloc(size_t size);
 // prefixed with msg.
 void perror_die(char* msg);
 
-// Reports a peer connection to stdout. sa is the data populated by a successful
-// accept() call.
-void report_peer_connected(const struct sockaddr_in* sa, socklen_t salen);
+// Longest string format_sockaddr produces, with its terminating NUL
+#define SOCKADDR_STRLEN     128
+
+// Formats a socket address numerically, without DNS lookups:
+// "127.0.0.1:9090", "[::1]:9090", "unix:/run/x.sock", "unix:@name" (abstract
+// namespace) or "unix" for an unnamed Unix socket.
+void format_sockaddr(const struct sockaddr* sa, socklen_t salen, char* buf, size_t size);
+
+// Reports a peer connection through the log. sa is the data populated by a
+// successful accept() call.
+void report_peer_connected(const struct sockaddr* sa, socklen_t salen);
 
 // Creates a bound and listening INET socket on the given port number. Returns
 // the socket fd when successful; dies in case of errors.
 int listen_inet_socket(int portnum);
 
+// Creates a bound and listening stream socket for an endpoint:
+//
+//   PORT                 IPv4, any address; the same as listen_inet_socket
+//   HOST:PORT            IPv4 address or host name
+//   [ADDR]:PORT          IPv6; [::] is dual-stack and also takes IPv4
+//                        connections, as ::ffff:a.b.c.d
+//   unix:PATH            Unix socket at PATH; a stale socket file left by a
+//                        server that is gone is replaced
+//   unix:@NAME           Unix socket in the abstract namespace, no file
+//
+// Returns the socket fd; dies if the endpoint is malformed or cannot be bound.
+int listen_endpoint(const char* endpoint);
+
 // Sets the given socket into non-blocking mode.
 void make_socket_non_blocking(int sockfd);
 
@@ -18,14 +18,14 @@ int main(int argc, char const *argv[])
     printf("Listening on port %d\n", portnum);
 
     int sockfd = listen_inet_socket(portnum);
-    struct sockaddr_in peer_addr;
+    struct sockaddr_storage peer_addr;
     socklen_t peer_addr_len = sizeof(peer_addr);
 
     int newsockfd = accept(sockfd, (struct sockaddr*)&peer_addr, &peer_addr_len);
     if (newsockfd < 0) {
         perror_die("ERROR on accept");
     }
-    report_peer_connected(&peer_addr, peer_addr_len);
+    report_peer_connected((struct sockaddr*)&peer_addr, peer_addr_len);
 
     while (1) {
         uint8_t buf[1024];
@@ -0,0 +1,83 @@
+#include "buffer-pool.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "utils.h"
+
+
+static int size_class(size_t size) {
+    int cls = 0;
+    while (cls < BUFPOOL_CLASSES - 1 &&
+           size > ((size_t)1 << (BUFPOOL_MIN_SHIFT + BUFPOOL_CLASS_SHIFT * cls))) {
+        cls++;
+    }
+    return cls;
+}
+
+
+static size_t class_size(int cls) {
+    return (size_t)1 << (BUFPOOL_MIN_SHIFT + BUFPOOL_CLASS_SHIFT * cls);
+}
+
+
+static uint8_t* map_arena(buffer_pool_t* pool) {
+    void* arena = MAP_FAILED;
+    if (pool->hugepages) {
+        arena = mmap(NULL, BUFPOOL_ARENA_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (arena == MAP_FAILED) {
+        arena = mmap(NULL, BUFPOOL_ARENA_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (arena == MAP_FAILED) {
+            die("buffer pool: mmap of %u bytes failed", BUFPOOL_ARENA_SIZE);
+        }
+        if (pool->hugepages) {
+            madvise(arena, BUFPOOL_ARENA_SIZE, MADV_HUGEPAGE);
+        }
+    }
+    pool->reserved_bytes += BUFPOOL_ARENA_SIZE;
+    LOG_DEBUG("buffer pool: %zu bytes reserved", pool->reserved_bytes);
+    return arena;
+}
+
+
+void bufpool_init(buffer_pool_t* pool, bool hugepages) {
+    memset(pool, 0, sizeof(*pool));
+    pool->hugepages = hugepages;
+}
+
+
+void* bufpool_get(buffer_pool_t* pool, size_t size, size_t* capacity) {
+    int cls = size_class(size);
+    size_t csize = class_size(cls);
+    void* buf;
+
+    if (pool->free[cls]) {
+        bufpool_free_t* head = pool->free[cls];
+        pool->free[cls] = head->next;
+        buf = head;
+    } else {
+        if (pool->carve[cls] == pool->carve_end[cls]) {
+            // arenas are a multiple of every class size, nothing is wasted
+            pool->carve[cls] = map_arena(pool);
+            pool->carve_end[cls] = pool->carve[cls] + BUFPOOL_ARENA_SIZE;
+        }
+        buf = pool->carve[cls];
+        pool->carve[cls] += csize;
+    }
+    pool->leased_bytes += csize;
+    *capacity = csize;
+    return buf;
+}
+
+
+void bufpool_put(buffer_pool_t* pool, void* buf, size_t capacity) {
+    int cls = size_class(capacity);
+    bufpool_free_t* node = buf;
+    node->next = pool->free[cls];
+    pool->free[cls] = node;
+    pool->leased_bytes -= class_size(cls);
+}
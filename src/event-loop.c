@@ -0,0 +1,553 @@
+#include "event-loop.h"
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+
+#include "server.h"
+#include "handoff.h"
+
+#define MAX_EVENTS          1024            /* ready fds taken per epoll_wait */
+
+// Readiness is handed around in epoll's bits; poll's are the same values
+_Static_assert(POLLIN == EPOLLIN && POLLOUT == EPOLLOUT && POLLERR == EPOLLERR &&
+               POLLHUP == EPOLLHUP, "poll and epoll event bits differ");
+
+static event_backend_t backend;
+static int restart_fd;
+static int listeners[OPTIONS_MAX_LISTEN];
+static int nlisteners;
+static int listener_max = -1;               /* highest listener fd; peers above it skip the lookup */
+static bool listener_paused;                /* all listeners together */
+static bool draining;                       /* listener handed over, serving what is left */
+static bool handoff_peers;                  /* --handoff */
+
+
+// select: the fd sets are plain bitmaps of 64-bit words, laid out as the
+// kernel reads an fd_set (bit fd % 64 of word fd / 64), and grown as higher
+// fds are watched, so select() is not capped at FD_SETSIZE.
+#define FD_WORD_BITS        64
+
+typedef struct {
+    uint64_t* words;
+    int nwords;
+} fd_bitmap_t;
+
+// Tracking which FDs we want to monitor for reading and writing
+static fd_bitmap_t readfds_master;
+static fd_bitmap_t writefds_master;
+
+// The copies handed to select(); only grown between loop turns, so a ready
+// scan never sees them move
+static fd_bitmap_t readfds_ready;
+static fd_bitmap_t writefds_ready;
+
+// The highest fd in either master set, -1 if none. select() and the ready
+// scan only cover words up to it, and it drops again when that fd is closed.
+static int fdset_max = -1;
+
+// Word where the next scan of the ready sets starts; it moves every turn so
+// low fds are not always served first
+static int scan_start;
+
+// poll: one slot per watched fd, kept dense; poll_slot maps an fd to its
+// slot, -1 when unwatched
+static struct pollfd* pollfds;
+static int npollfds;
+static int* poll_slot;
+
+// epoll and epoll-et
+static int epollfd;
+static struct epoll_event* events;
+
+
+static void serve_peer(int fd, bool readable);
+static void close_peer(int fd, void* ctx);
+static void hot_restart(void);
+
+
+const char* event_backend_name(event_backend_t b)
+{
+    switch (b) {
+    case BACKEND_SELECT:
+        return "select";
+    case BACKEND_POLL:
+        return "poll";
+    case BACKEND_EPOLL:
+        return "epoll";
+    case BACKEND_EPOLL_ET:
+        return "epoll-et";
+    default:
+        return "default";
+    }
+}
+
+
+static void bitmap_grow(fd_bitmap_t* set, int nwords)
+{
+    if (nwords <= set->nwords) {
+        return;
+    }
+    set->words = realloc(set->words, nwords * sizeof(uint64_t));
+    if (set->words == NULL) {
+        die("out of memory for %d fd set words", nwords);
+    }
+    memset(set->words + set->nwords, 0, (nwords - set->nwords) * sizeof(uint64_t));
+    set->nwords = nwords;
+}
+
+
+static inline bool bitmap_isset(const fd_bitmap_t* set, int fd)
+{
+    int word = fd / FD_WORD_BITS;
+    return word < set->nwords && (set->words[word] >> (fd % FD_WORD_BITS) & 1);
+}
+
+
+static void bitmap_assign(fd_bitmap_t* set, int fd, bool on)
+{
+    uint64_t bit = 1ull << (fd % FD_WORD_BITS);
+    if (on) {
+        set->words[fd / FD_WORD_BITS] |= bit;
+    } else if (fd / FD_WORD_BITS < set->nwords) {
+        set->words[fd / FD_WORD_BITS] &= ~bit;
+    }
+}
+
+
+// Keeps both master sets and fdset_max in step with interest.
+static void select_watch(int fd, uint8_t interest)
+{
+    if (interest) {
+        // grow by doubling so a run of accepts does not realloc every word;
+        // both sets keep the same size, so a turn copies the same words of each
+        int nwords = readfds_master.nwords ? readfds_master.nwords : 1;
+        while (nwords <= fd / FD_WORD_BITS) {
+            nwords *= 2;
+        }
+        bitmap_grow(&readfds_master, nwords);
+        bitmap_grow(&writefds_master, nwords);
+        if (fd > fdset_max) {
+            fdset_max = fd;
+        }
+    }
+    bitmap_assign(&readfds_master, fd, interest & PEER_WANT_READ);
+    bitmap_assign(&writefds_master, fd, interest & PEER_WANT_WRITE);
+    while (fdset_max >= 0 && !bitmap_isset(&readfds_master, fdset_max) &&
+           !bitmap_isset(&writefds_master, fdset_max)) {
+        fdset_max--;
+    }
+}
+
+
+static void poll_watch(int fd, uint8_t interest)
+{
+    short want = (interest & PEER_WANT_READ ? POLLIN : 0) | (interest & PEER_WANT_WRITE ? POLLOUT : 0);
+    int slot = poll_slot[fd];
+    if (slot < 0) {
+        if (interest) {
+            poll_slot[fd] = npollfds;
+            pollfds[npollfds++] = (struct pollfd){.fd = fd, .events = want};
+        }
+    } else if (interest) {
+        pollfds[slot].events = want;
+    } else {
+        // The last slot fills the hole. The ready scan runs from the top
+        // down, so that slot was already served this turn.
+        pollfds[slot] = pollfds[--npollfds];
+        pollfds[slot].revents = 0;
+        poll_slot[pollfds[slot].fd] = slot;
+        poll_slot[fd] = -1;
+    }
+}
+
+
+// Edge-triggered peers are registered once for both directions and stay so
+// until closed: with every edge reported, a direction the peer does not want
+// right now only costs a wakeup, never a missed event, and interest changes
+// need no epoll_ctl at all.
+static bool epoll_watch(int fd, uint8_t old_interest, uint8_t interest, bool edge)
+{
+    struct epoll_event event = {0};
+    event.data.fd = fd;
+    int op;
+    if (interest == 0) {
+        op = EPOLL_CTL_DEL;
+    } else if (old_interest == 0) {
+        op = EPOLL_CTL_ADD;
+    } else if (edge) {
+        return true;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+    if (edge) {
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    } else {
+        event.events = (interest & PEER_WANT_READ ? EPOLLIN : 0) |
+                       (interest & PEER_WANT_WRITE ? EPOLLOUT : 0);
+    }
+    if (epoll_ctl(epollfd, op, fd, &event) < 0) {
+        LOG_WARN("epoll_ctl %s socket %d: %s",
+                 op == EPOLL_CTL_ADD ? "EPOLL_CTL_ADD" : op == EPOLL_CTL_MOD ? "EPOLL_CTL_MOD"
+                                                                            : "EPOLL_CTL_DEL",
+                 fd, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+
+// Tells the backend that fd now waits for interest (PEER_WANT_*) instead of
+// old_interest; 0 removes it. Only peers are edge-triggered under epoll-et.
+// Returns false if the kernel refused.
+static bool backend_watch(int fd, uint8_t old_interest, uint8_t interest, bool peer)
+{
+    switch (backend) {
+    case BACKEND_SELECT:
+        select_watch(fd, interest);
+        return true;
+    case BACKEND_POLL:
+        poll_watch(fd, interest);
+        return true;
+    default:
+        return epoll_watch(fd, old_interest, interest, peer && backend == BACKEND_EPOLL_ET);
+    }
+}
+
+
+static void backend_init(void)
+{
+    switch (backend) {
+    case BACKEND_SELECT:
+        break;
+    case BACKEND_POLL:
+        pollfds = xmalloc(peer_table_size * sizeof(struct pollfd));
+        poll_slot = xmalloc(peer_table_size * sizeof(int));
+        memset(poll_slot, 0xff, peer_table_size * sizeof(int));
+        break;
+    default:
+        epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollfd < 0) {
+            perror_die("epoll_create1");
+        }
+        events = xmalloc(MAX_EVENTS * sizeof(struct epoll_event));
+        break;
+    }
+}
+
+
+// The listener and the restart pipe are watched for reading, level-triggered
+// under every backend.
+static void watch_or_die(int fd, bool on)
+{
+    if (!backend_watch(fd, on ? 0 : PEER_WANT_READ, on ? PEER_WANT_READ : 0, false)) {
+        die("cannot watch fd %d", fd);
+    }
+}
+
+
+static inline bool is_listener(int fd)
+{
+    if (fd > listener_max) {
+        return false;
+    }
+    for (int i = 0; i < nlisteners; i++) {
+        if (listeners[i] == fd) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// While saturated the listeners are left out of the backend: pending
+// connections wait in the kernels' backlogs and cost the loop nothing.
+static void update_listener(void)
+{
+    bool saturated = peers_saturated();
+    if (draining || saturated == listener_paused) {
+        return;
+    }
+    if (saturated) {
+        LOG_DEBUG("saturated, no longer accepting connections");
+        METRIC_INC(listener_paused);
+    } else {
+        LOG_DEBUG("accepting connections again");
+    }
+    for (int i = 0; i < nlisteners; i++) {
+        watch_or_die(listeners[i], !saturated);
+    }
+    listener_paused = saturated;
+}
+
+
+static void close_peer(int fd, void* ctx)
+{
+    (void)ctx;
+    LOG_INFO("socket %d closing", fd);
+    METRIC_INC(conn_closed);
+    // close() would drop an epoll registration too, but only once no other
+    // descriptor refers to the socket
+    if (global_state[fd].interest) {
+        backend_watch(fd, global_state[fd].interest, 0, true);
+    }
+    close(fd);
+    on_peer_closed(fd);
+}
+
+
+// Registers what a peer's callback asked for, or closes it if that is
+// nothing. The backend is only told when the interest changed, which it
+// mostly does not for a peer streaming in one direction.
+static void update_peer(int fd, fd_status_t status)
+{
+    uint8_t interest = (status.want_read ? PEER_WANT_READ : 0) |
+                       (status.want_write ? PEER_WANT_WRITE : 0);
+    if (interest == 0) {
+        close_peer(fd, NULL);
+        return;
+    }
+    peer_state_t* peer_state = &global_state[fd];
+    if (interest == peer_state->interest) {
+        return;
+    }
+    if (!backend_watch(fd, peer_state->interest, interest, true)) {
+        close_peer(fd, NULL);
+        return;
+    }
+    peer_state->interest = interest;
+}
+
+
+// Serves a ready peer and queues it behind the others if it used up its budget.
+static void serve_peer(int fd, bool readable)
+{
+    bool exhausted;
+    update_peer(fd, on_peer_ready(fd, readable, &exhausted));
+    if (exhausted && global_state[fd].open) {
+        peers_defer(fd);
+    }
+}
+
+
+static void serve_deferred(int fd, void* ctx)
+{
+    (void)ctx;
+    serve_peer(fd, true);
+}
+
+
+// Registers a peer adopted from the previous process on hot restart.
+static void attach_peer(int fd, fd_status_t status, void* ctx)
+{
+    (void)ctx;
+    update_peer(fd, status);
+}
+
+
+static void accept_new_peer(int listener_sockfd)
+{
+    // the listening socket is ready; this means a new peer is connecting
+    struct sockaddr_storage peer_addr;
+    socklen_t peer_addr_len = sizeof(peer_addr);
+    int newsockfd = accept_peer(listener_sockfd, &peer_addr, &peer_addr_len);
+    if (newsockfd >= 0) {
+        make_socket_non_blocking(newsockfd);
+        update_peer(newsockfd,
+                    on_peer_connected(newsockfd, (struct sockaddr*)&peer_addr, peer_addr_len));
+    }
+    update_listener();
+}
+
+
+// Handles one ready fd; ready holds EPOLL* bits.
+static inline void dispatch(int fd, uint32_t ready)
+{
+    if (fd == restart_fd) {
+        if (handoff_requested()) {
+            hot_restart();
+        }
+    } else if (is_listener(fd)) {
+        accept_new_peer(fd);
+    } else if (((ready & EPOLLERR) && !on_peer_error(fd)) ||
+               (ready & (EPOLLHUP | EPOLLIN)) == EPOLLHUP) {
+        // the connection failed or is gone with nothing left to read; only
+        // this peer is affected
+        close_peer(fd, NULL);
+    } else if (!global_state[fd].deferred) {
+        // one call serves both directions; a deferred peer waits for its
+        // turn in the queue
+        serve_peer(fd, ready & EPOLLIN);
+    }
+}
+
+
+static int select_dispatch_ready(int timeout_ms)
+{
+    // select() modifies the sets passed to it, so it gets copies of the
+    // words that hold live fds
+    int nwords = fdset_max / FD_WORD_BITS + 1;
+    bitmap_grow(&readfds_ready, nwords);
+    bitmap_grow(&writefds_ready, nwords);
+    memcpy(readfds_ready.words, readfds_master.words, nwords * sizeof(uint64_t));
+    memcpy(writefds_ready.words, writefds_master.words, nwords * sizeof(uint64_t));
+
+    struct timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+    int nready = select(fdset_max + 1, (fd_set*)readfds_ready.words,
+                        (fd_set*)writefds_ready.words, NULL, timeout_ms < 0 ? NULL : &timeout);
+    if (nready <= 0) {
+        return nready;
+    }
+
+    // Whole words without a ready fd are skipped, and each ready fd in a
+    // word is found with count-trailing-zeros instead of testing every bit.
+    // nready counts a socket both readable and writable twice.
+    int left = nready;
+    int start = scan_start % nwords;
+    scan_start = start + 1;
+    for (int n = 0; n < nwords && left > 0; n++) {
+        int word = start + n < nwords ? start + n : start + n - nwords;
+        uint64_t ready = readfds_ready.words[word] | writefds_ready.words[word];
+        while (ready) {
+            int bit = __builtin_ctzll(ready);
+            ready &= ready - 1;
+            bool readable = readfds_ready.words[word] >> bit & 1;
+            bool writable = writefds_ready.words[word] >> bit & 1;
+            left -= readable + writable;
+            dispatch(word * FD_WORD_BITS + bit, (readable ? EPOLLIN : 0) | (writable ? EPOLLOUT : 0));
+        }
+    }
+    return nready;
+}
+
+
+static int poll_dispatch_ready(int timeout_ms)
+{
+    int nready = poll(pollfds, npollfds, timeout_ms);
+    // from the top down, see poll_watch
+    for (int i = npollfds - 1, left = nready; i >= 0 && left > 0; i--) {
+        if (pollfds[i].revents) {
+            left--;
+            dispatch(pollfds[i].fd, pollfds[i].revents);
+        }
+    }
+    return nready;
+}
+
+
+static int epoll_dispatch_ready(int timeout_ms)
+{
+    int nready = epoll_wait(epollfd, events, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < nready; i++) {
+        dispatch(events[i].data.fd, events[i].events);
+    }
+    return nready;
+}
+
+
+// SIGUSR2: pass the listeners, and the peers unless handoff_peers is off, to a
+// fresh copy of this binary. Without the peers this process stops accepting
+// and exits once the last of them is closed.
+static void hot_restart(void)
+{
+    if (draining) {
+        LOG_WARN("hot restart: listeners already handed over");
+        return;
+    }
+    bool with_peers = handoff_peers;
+    if (!handoff_to_new_process(listeners, nlisteners, &with_peers)) {
+        return;
+    }
+    if (with_peers) {
+        exit(EXIT_SUCCESS);
+    }
+    for (int i = 0; i < nlisteners; i++) {
+        if (!listener_paused) {
+            watch_or_die(listeners[i], false);
+        }
+        close(listeners[i]);
+    }
+    nlisteners = 0;
+    listener_max = -1;
+    listener_paused = true;
+    draining = true;
+    LOG_INFO("draining %d peers", peers_count());
+}
+
+
+int event_loop_main(int argc, char** argv, event_backend_t default_backend)
+{
+    log_init();
+    metrics_init(argv[0]);
+    ignore_sigpipe();
+
+    server_options_t opts;
+    parse_server_options(argc, argv, &opts);
+    backend = opts.backend != BACKEND_DEFAULT ? opts.backend : default_backend;
+    handoff_peers = opts.handoff_peers;
+    peer_timers_init(&opts);
+    peer_buffers_init(&opts);
+    peer_capture_init(&opts);
+    admission_init(opts.max_conns, peer_table_init(0));
+    backend_init();
+
+    restart_fd = handoff_init(argv);
+    watch_or_die(restart_fd, true);
+
+    nlisteners = handoff_from_old_process(listeners, OPTIONS_MAX_LISTEN, attach_peer, NULL);
+    if (nlisteners < 0) {
+        for (int i = 0; i < opts.nlisten; i++) {
+            LOG_INFO("Serving on %s", opts.listen[i].endpoint);
+            listeners[i] = listen_endpoint(opts.listen[i].endpoint);
+            make_socket_non_blocking(listeners[i]);
+        }
+        nlisteners = opts.nlisten;
+    }
+    for (int i = 0; i < nlisteners; i++) {
+        // Adopted listeners come in the order the same command line opened
+        // them, and have their options already; accepted sockets still need
+        // the per-socket ones.
+        sock_profile_listener(listeners[i],
+                              i < opts.nlisten ? opts.listen[i].profile : opts.sock_profile);
+        // listening sockets are always monitored for read to detect when new peer connection are incoming
+        watch_or_die(listeners[i], true);
+        if (listeners[i] > listener_max) {
+            listener_max = listeners[i];
+        }
+    }
+    LOG_INFO("event loop backend: %s", event_backend_name(backend));
+
+    while (1) {
+        // deferred peers still have work, so only look for new events
+        int timeout_ms = peers_deferred() ? 0 : peer_timers_next_ms();
+        int nready;
+        switch (backend) {
+        case BACKEND_SELECT:
+            nready = select_dispatch_ready(timeout_ms);
+            break;
+        case BACKEND_POLL:
+            nready = poll_dispatch_ready(timeout_ms);
+            break;
+        default:
+            nready = epoll_dispatch_ready(timeout_ms);
+            break;
+        }
+        if (nready < 0 && errno != EINTR) {
+            perror_die(backend == BACKEND_SELECT ? "select" : backend == BACKEND_POLL ? "poll"
+                                                                                        : "epoll_wait");
+        }
+        METRIC_INC(loop_wakeups);
+        if (nready > 0) {
+            METRIC_ADD(loop_events, nready);
+        }
+
+        peers_run_deferred(serve_deferred, NULL);
+        peer_timers_expire(close_peer, NULL);
+        update_listener();
+        if (draining && peers_count() == 0) {
+            LOG_INFO("drained, exiting");
+            exit(EXIT_SUCCESS);
+        }
+    }
+    return 0;
+}
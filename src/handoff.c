@@ -0,0 +1,343 @@
+#define _GNU_SOURCE
+#include "handoff.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define HANDOFF_MAGIC       0x66666f646e6168ull     /* "handoff" */
+#define HANDOFF_VERSION     7
+#define HANDOFF_CHILD_FD    3                       /* where the new process finds its end */
+#define HANDOFF_TIMEOUT_S   5                       /* for each message to or reply from the new process */
+
+enum { MSG_HELLO, MSG_LISTENER, MSG_PEER, MSG_END };
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t kind;                          /* MSG_* */
+    uint32_t peer_state_size;               /* sizeof(peer_state_t) + sizeof(peer_info_t) of the sender */
+    int32_t sockfd;                         /* sender's fd number, for the log */
+    uint32_t sendbuf_len;                   /* bytes of sendbuf that follow, 0: none */
+    peer_state_t state;                     /* MSG_PEER only; state.sendbuf is meaningless */
+    peer_info_t info;                       /* MSG_PEER only */
+    uint8_t sendbuf[];                      /* the peer's sendbuf_t, up to its last byte */
+} handoff_msg_t;
+
+// Largest message: a full sendbuf of the largest pool class
+#define HANDOFF_MSG_MAX     (sizeof(handoff_msg_t) + BUFPOOL_MAX_SIZE)
+
+static char** saved_argv;
+static int signal_pipe[2] = {-1, -1};
+
+
+// Any thread may take the signal, so it is turned into a readable fd the
+// event loop already waits on.
+static void on_sigusr2(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    ssize_t unused = write(signal_pipe[1], "R", 1);
+    (void)unused;
+    errno = saved_errno;
+}
+
+
+int handoff_init(char** argv) {
+    saved_argv = argv;
+    if (pipe2(signal_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror_die("pipe2");
+    }
+
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = on_sigusr2;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR2, &act, NULL) < 0) {
+        perror_die("sigaction SIGUSR2");
+    }
+    return signal_pipe[0];
+}
+
+
+bool handoff_requested(void) {
+    char buf[16];
+    bool requested = false;
+    while (read(signal_pipe[0], buf, sizeof(buf)) > 0) {
+        requested = true;
+    }
+    return requested;
+}
+
+
+// Sends msg and its sendbuf_len trailing bytes, with fd attached when fd >= 0.
+// A new process that stopped reading makes this fail after HANDOFF_TIMEOUT_S.
+static bool send_msg(int sock, const handoff_msg_t* msg, int fd) {
+    size_t len = sizeof(*msg) + msg->sendbuf_len;
+    struct iovec iov = {.iov_base = (void*)msg, .iov_len = len};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    ssize_t sent = sendmsg(sock, &mh, MSG_NOSIGNAL);
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        LOG_WARN("hot restart: new process stopped reading");
+    }
+    return sent == (ssize_t)len;
+}
+
+
+// Receives one message into msg (HANDOFF_MSG_MAX bytes); *fd is the attached
+// descriptor or -1.
+static bool recv_msg(int sock, handoff_msg_t* msg, int* fd) {
+    struct iovec iov = {.iov_base = msg, .iov_len = HANDOFF_MSG_MAX};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    *fd = -1;
+    ssize_t n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    struct cmsghdr* cmsg = n > 0 ? CMSG_FIRSTHDR(&mh) : NULL;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (n < (ssize_t)sizeof(*msg) || msg->magic != HANDOFF_MAGIC ||
+        msg->version != HANDOFF_VERSION || n != (ssize_t)(sizeof(*msg) + msg->sendbuf_len)) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+        return false;
+    }
+    return true;
+}
+
+
+static bool recv_reply(int sock, char expected_a, char expected_b, char* reply) {
+    ssize_t n = recv(sock, reply, 1, 0);
+    return n == 1 && (*reply == expected_a || *reply == expected_b);
+}
+
+
+// Forks and executes our own binary with the same arguments. Returns our end
+// of the handoff socket, or -1.
+static int spawn_new_process(pid_t* pid) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        LOG_WARN("hot restart: socketpair: %s", strerror(errno));
+        return -1;
+    }
+
+    *pid = fork();
+    if (*pid < 0) {
+        LOG_WARN("hot restart: fork: %s", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (*pid == 0) {
+        // Only async-signal-safe calls from here on: the parent has threads.
+        // Everything but stdio and the handoff socket is closed so the new
+        // process holds no stray reference to listener or peers.
+        if (dup2(sv[1], HANDOFF_CHILD_FD) < 0) {
+            _exit(127);
+        }
+        if (close_range(HANDOFF_CHILD_FD + 1, ~0U, 0) < 0) {
+            for (int fd = HANDOFF_CHILD_FD + 1; fd < sysconf(_SC_OPEN_MAX); fd++) {
+                close(fd);
+            }
+        }
+        execvp(saved_argv[0], saved_argv);
+        _exit(127);
+    }
+    close(sv[1]);
+    return sv[0];
+}
+
+
+// Runs the old process' side of the exchange. Clears *with_peers if the new
+// process only takes the listeners.
+static bool hand_over(int sock, handoff_msg_t* msg, const int* listeners, int nlisteners,
+                      bool* with_peers, int* npeers) {
+    char reply;
+    msg->kind = MSG_HELLO;
+    msg->sockfd = -1;
+    if (!send_msg(sock, msg, -1) || !recv_reply(sock, 'A', 'L', &reply)) {
+        return false;
+    }
+
+    if (*with_peers && reply == 'L') {
+        LOG_WARN("hot restart: new binary has another peer state layout, "
+                 "handing over the listeners only");
+        *with_peers = false;
+    }
+    msg->kind = MSG_LISTENER;
+    for (int i = 0; i < nlisteners; i++) {
+        msg->sockfd = listeners[i];
+        if (!send_msg(sock, msg, listeners[i])) {
+            return false;
+        }
+    }
+    if (*with_peers) {
+        msg->kind = MSG_PEER;
+        for (int fd = 0; fd < peer_table_size; fd++) {
+            if (!global_state[fd].open) {
+                continue;
+            }
+            const sendbuf_t* sendbuf = global_state[fd].sendbuf;
+            msg->sockfd = fd;
+            msg->state = global_state[fd];
+            msg->info = peer_info[fd];
+            msg->sendbuf_len = sendbuf ? sizeof(sendbuf_t) + sendbuf->used : 0;
+            if (sendbuf) {
+                memcpy(msg->sendbuf, sendbuf, msg->sendbuf_len);
+            }
+            if (!send_msg(sock, msg, fd)) {
+                return false;
+            }
+            (*npeers)++;
+        }
+    }
+
+    msg->kind = MSG_END;
+    msg->sockfd = -1;
+    msg->sendbuf_len = 0;
+    return send_msg(sock, msg, -1) && recv_reply(sock, 'K', 'K', &reply);
+}
+
+
+bool handoff_to_new_process(const int* listeners, int nlisteners, bool* with_peers) {
+    if (saved_argv == NULL) {
+        return false;
+    }
+    char fdbuf[16];
+    snprintf(fdbuf, sizeof(fdbuf), "%d", HANDOFF_CHILD_FD);
+    setenv(HANDOFF_ENV, fdbuf, 1);
+    pid_t pid;
+    int sock = spawn_new_process(&pid);
+    unsetenv(HANDOFF_ENV);
+    if (sock < 0) {
+        return false;
+    }
+    LOG_INFO("hot restart: started pid %d", (int)pid);
+
+    // a new process that hangs, or stops reading while the peers go over
+    // one message each, must not stall this one forever
+    struct timeval timeout = {HANDOFF_TIMEOUT_S, 0};
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+        LOG_WARN("hot restart: socket timeouts: %s", strerror(errno));
+        close(sock);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return false;
+    }
+
+    handoff_msg_t* msg = xmalloc(HANDOFF_MSG_MAX);
+    memset(msg, 0, sizeof(*msg));
+    msg->magic = HANDOFF_MAGIC;
+    msg->version = HANDOFF_VERSION;
+    msg->peer_state_size = sizeof(peer_state_t) + sizeof(peer_info_t);
+
+    int npeers = 0;
+    bool ok = hand_over(sock, msg, listeners, nlisteners, with_peers, &npeers);
+    free(msg);
+    close(sock);
+
+    if (ok) {
+        LOG_INFO("hot restart: pid %d took over %d listeners and %d peers", (int)pid, nlisteners,
+                 npeers);
+    } else {
+        // without its end of the socket it exits; reap it so no zombie stays
+        LOG_WARN("hot restart: pid %d failed, continuing", (int)pid);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    return ok;
+}
+
+
+int handoff_from_old_process(int* listeners, int max_listeners,
+                             void (*attach)(int sockfd, fd_status_t status, void* ctx), void* ctx) {
+    const char* env = getenv(HANDOFF_ENV);
+    if (env == NULL) {
+        return -1;
+    }
+    int sock = atoi(env);
+    unsetenv(HANDOFF_ENV);
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+    handoff_msg_t* msg = xmalloc(HANDOFF_MSG_MAX);
+    int fd;
+    if (!recv_msg(sock, msg, &fd) || msg->kind != MSG_HELLO) {
+        die("hot restart: no hello from the old process");
+    }
+    bool take_peers = msg->peer_state_size == sizeof(peer_state_t) + sizeof(peer_info_t);
+    if (send(sock, take_peers ? "A" : "L", 1, MSG_NOSIGNAL) != 1) {
+        die("hot restart: old process went away");
+    }
+
+    int nlisteners = 0;
+    int npeers = 0;
+    while (1) {
+        if (!recv_msg(sock, msg, &fd)) {
+            die("hot restart: handoff interrupted");
+        }
+        if (msg->kind == MSG_END) {
+            break;
+        }
+        if (msg->kind == MSG_LISTENER && fd >= 0) {
+            if (nlisteners == max_listeners) {
+                die("hot restart: more than %d listeners", max_listeners);
+            }
+            listeners[nlisteners++] = fd;
+            continue;
+        }
+        if (msg->kind != MSG_PEER || fd < 0) {
+            die("hot restart: unexpected message %u", msg->kind);
+        }
+        if (fd >= peer_table_size) {
+            LOG_WARN("hot restart: socket %d (was %d) outside the peer table, dropping it",
+                     fd, msg->sockfd);
+            close(fd);
+            continue;
+        }
+        const sendbuf_t* sendbuf = msg->sendbuf_len ? (const sendbuf_t*)msg->sendbuf : NULL;
+        attach(fd, on_peer_adopted(fd, &msg->state, &msg->info, sendbuf), ctx);
+        npeers++;
+    }
+    if (send(sock, "K", 1, MSG_NOSIGNAL) != 1) {
+        die("hot restart: old process went away");
+    }
+    close(sock);
+    free(msg);
+    if (nlisteners == 0) {
+        die("hot restart: no listener received from the old process");
+    }
+    LOG_INFO("hot restart: took over %d listeners and %d peers", nlisteners, npeers);
+    return nlisteners;
+}
@@ -0,0 +1,64 @@
+#include "histogram.h"
+
+#include <string.h>
+
+
+uint64_t histogram_bucket_value(int index) {
+    if (index < HIST_SUB_COUNT) {
+        return (uint64_t)index;
+    }
+    int shift = (index - HIST_SUB_COUNT) / HIST_HALF_COUNT + 1;
+    uint64_t sub = (index - HIST_SUB_COUNT) % HIST_HALF_COUNT + HIST_HALF_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+
+void histogram_merge(histogram_t* dst, const histogram_t* src) {
+    uint64_t count = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        uint64_t n = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+        dst->buckets[i] += n;
+        count += n;
+    }
+    // Count from the buckets themselves so a snapshot taken while the writer
+    // is mid-record stays self-consistent.
+    dst->count += count;
+    dst->sum_ns += __atomic_load_n(&src->sum_ns, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+    if (max > dst->max_ns) {
+        dst->max_ns = max;
+    }
+}
+
+
+void histogram_diff(histogram_t* dst, const histogram_t* a, const histogram_t* b) {
+    memset(dst, 0, sizeof(*dst));
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        dst->buckets[i] = a->buckets[i] - b->buckets[i];
+        dst->count += dst->buckets[i];
+        if (dst->buckets[i]) {
+            dst->max_ns = histogram_bucket_value(i);
+        }
+    }
+    dst->sum_ns = a->sum_ns - b->sum_ns;
+}
+
+
+uint64_t histogram_percentile(const histogram_t* h, double q) {
+    if (h->count == 0) {
+        return 0;
+    }
+    uint64_t target = (uint64_t)(q * h->count + 0.5);
+    if (target == 0) {
+        target = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            uint64_t v = histogram_bucket_value(i);
+            return h->max_ns && v > h->max_ns ? h->max_ns : v;
+        }
+    }
+    return h->max_ns;
+}
@@ -0,0 +1,260 @@
+#include "log.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_FLUSH_INTERVAL_MS   10
+#define LOG_OUTBUF_SIZE         (64 * 1024)
+
+// Single-producer single-consumer ring owned by one thread. head is only
+// written by the producer and tail only by the flusher, each on its own cache
+// line so the two sides don't bounce a line back and forth.
+typedef struct log_ring {
+    uint64_t head __attribute__((aligned(64)));     /* next slot to write */
+    uint64_t dropped;                               /* records lost to a full ring */
+    uint64_t tail __attribute__((aligned(64)));     /* next slot to read */
+    int orphaned;                                   /* owner thread has exited */
+    uint32_t thread_id;
+    struct log_ring* next;
+    log_record_t records[LOG_RING_SIZE];
+} log_ring_t;
+
+static const char* level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static __thread log_ring_t* tl_ring;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_ring_t* rings;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t flusher;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+static int flusher_running;
+static int flusher_stop;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+// Called when a thread with a ring exits; the flusher frees the ring once it
+// has been drained.
+static void ring_release(void* arg) {
+    log_ring_t* ring = arg;
+    __atomic_store_n(&ring->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+
+static void ring_key_create(void) {
+    pthread_key_create(&ring_key, ring_release);
+}
+
+
+// First log call on a thread: allocate its ring and publish it to the flusher.
+// This is the only place a producer takes a lock.
+static log_ring_t* ring_create(void) {
+    pthread_once(&ring_key_once, ring_key_create);
+
+    log_ring_t* ring;
+    if (posix_memalign((void**)&ring, 64, sizeof(*ring)) != 0) {
+        return NULL;
+    }
+    memset(ring, 0, offsetof(log_ring_t, records));
+    ring->thread_id = (uint32_t)syscall(SYS_gettid);
+
+    pthread_mutex_lock(&rings_lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+
+    pthread_setspecific(ring_key, ring);
+    tl_ring = ring;
+    return ring;
+}
+
+
+static size_t format_record(char* out, size_t outlen, const log_record_t* rec) {
+    time_t secs = rec->timestamp_ns / 1000000000ull;
+    long usecs = (rec->timestamp_ns % 1000000000ull) / 1000;
+    struct tm tm;
+    localtime_r(&secs, &tm);
+
+    const char* level = rec->level < LOG_LEVEL_NONE ? level_names[rec->level] : "?";
+    int n = snprintf(out, outlen, "%02d:%02d:%02d.%06ld %-5s [%u] %.*s\n",
+                     tm.tm_hour, tm.tm_min, tm.tm_sec, usecs, level, rec->thread_id,
+                     (int)rec->len, rec->msg);
+    if (n < 0) {
+        return 0;
+    }
+    return (size_t)n < outlen ? (size_t)n : outlen - 1;
+}
+
+
+// Writes out buf once fewer than two records' worth of space is left in it.
+static void make_room(char* buf, size_t* len) {
+    if (LOG_OUTBUF_SIZE - *len < 2 * LOG_MSG_SIZE) {
+        fwrite(buf, 1, *len, stdout);
+        *len = 0;
+    }
+}
+
+
+// Drains every ring into stdout. Only the flusher (or log_shutdown, after the
+// flusher has been joined) calls this, so it is the single consumer.
+static void drain_rings(void) {
+    static char outbuf[LOG_OUTBUF_SIZE];
+    size_t outlen = 0;
+
+    pthread_mutex_lock(&rings_lock);
+    log_ring_t** link = &rings;
+    while (*link) {
+        log_ring_t* ring = *link;
+        int orphaned = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+
+        while (tail != head) {
+            make_room(outbuf, &outlen);
+            outlen += format_record(outbuf + outlen, LOG_OUTBUF_SIZE - outlen,
+                                    &ring->records[tail & (LOG_RING_SIZE - 1)]);
+            tail++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        uint64_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) {
+            make_room(outbuf, &outlen);
+            size_t room = LOG_OUTBUF_SIZE - outlen;
+            int n = snprintf(outbuf + outlen, room, "log: thread %u dropped %lu records\n",
+                             ring->thread_id, (unsigned long)dropped);
+            if (n > 0) {
+                outlen += (size_t)n < room ? (size_t)n : room - 1;
+            }
+        }
+
+        if (orphaned) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    if (outlen) {
+        fwrite(outbuf, 1, outlen, stdout);
+    }
+    fflush(stdout);
+}
+
+
+static void* flusher_main(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&flusher_lock);
+    while (!flusher_stop) {
+        pthread_mutex_unlock(&flusher_lock);
+        drain_rings();
+        pthread_mutex_lock(&flusher_lock);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (!flusher_stop) {
+            pthread_cond_timedwait(&flusher_cond, &flusher_lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&flusher_lock);
+    return NULL;
+}
+
+
+void log_init(void) {
+    if (flusher_running) {
+        return;
+    }
+    // The flusher batches its own writes, stdout doesn't need to be unbuffered.
+    setvbuf(stdout, NULL, _IOFBF, LOG_OUTBUF_SIZE);
+
+    flusher_stop = 0;
+    if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+        fprintf(stderr, "log_init(): cannot create flusher thread, logging synchronously\n");
+        setvbuf(stdout, NULL, _IONBF, 0);
+        return;
+    }
+    __atomic_store_n(&flusher_running, 1, __ATOMIC_RELEASE);
+    atexit(log_shutdown);
+}
+
+
+void log_shutdown(void) {
+    if (!__atomic_exchange_n(&flusher_running, 0, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    pthread_mutex_lock(&flusher_lock);
+    flusher_stop = 1;
+    pthread_cond_signal(&flusher_cond);
+    pthread_mutex_unlock(&flusher_lock);
+
+    // The final drain picks up anything written after the flusher's last pass.
+    pthread_join(flusher, NULL);
+    drain_rings();
+}
+
+
+void log_write(int level, const char* fmt, ...) {
+    va_list args;
+
+    if (!__atomic_load_n(&flusher_running, __ATOMIC_ACQUIRE)) {
+        va_start(args, fmt);
+        vprintf(fmt, args);
+        va_end(args);
+        putchar('\n');
+        return;
+    }
+
+    log_ring_t* ring = tl_ring;
+    if (ring == NULL && (ring = ring_create()) == NULL) {
+        return;
+    }
+
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= LOG_RING_SIZE) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    log_record_t* rec = &ring->records[head & (LOG_RING_SIZE - 1)];
+    rec->timestamp_ns = now_ns();
+    rec->thread_id = ring->thread_id;
+    rec->level = (uint16_t)level;
+
+    va_start(args, fmt);
+    int n = vsnprintf(rec->msg, LOG_MSG_SIZE, fmt, args);
+    va_end(args);
+    if (n < 0) {
+        n = 0;
+    } else if (n >= LOG_MSG_SIZE) {
+        n = LOG_MSG_SIZE - 1;
+    }
+    rec->len = (uint16_t)n;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
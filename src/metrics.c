@@ -0,0 +1,217 @@
+#include "metrics.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define METRICS_HIST_NAME(name) #name,
+const char* const metrics_hist_names[METRICS_HIST_COUNT] = {
+    METRICS_HISTOGRAMS(METRICS_HIST_NAME)
+};
+
+__thread metrics_counters_t* metrics_tl;
+__thread int metrics_tl_shared;
+metrics_shm_t* metrics_shm;
+
+// Used by threads that log metrics before metrics_init (or without it at all,
+// e.g. test programs). Counts are kept but never published.
+static __thread metrics_slot_t tl_private;
+
+static char shm_name[64];
+static pthread_key_t slot_key;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+
+
+static void metrics_unlink(void) {
+    if (shm_name[0]) {
+        shm_unlink(shm_name);
+    }
+}
+
+
+// Servers are normally stopped with a signal, which skips atexit handlers.
+static void metrics_unlink_on_signal(int sig) {
+    metrics_unlink();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+
+static void install_unlink_handler(int sig) {
+    struct sigaction old;
+    if (sigaction(sig, NULL, &old) == 0 && old.sa_handler == SIG_DFL) {
+        signal(sig, metrics_unlink_on_signal);
+    }
+}
+
+
+// Thread exit: hand the slot back. Counters are left in place so the sums seen
+// by readers stay monotonic; the next owner keeps adding to them.
+static void slot_release(void* arg) {
+    metrics_slot_t* slot = arg;
+    if (!slot->shared) {
+        __atomic_store_n(&slot->owner_tid, 0, __ATOMIC_RELEASE);
+    }
+}
+
+
+static void slot_key_create(void) {
+    pthread_key_create(&slot_key, slot_release);
+}
+
+
+void metrics_init(const char* program) {
+    if (metrics_shm) {
+        return;
+    }
+
+    snprintf(shm_name, sizeof(shm_name), METRICS_SHM_PREFIX "%d", (int)getpid());
+    void* mem = MAP_FAILED;
+    int fd = shm_open(shm_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd >= 0) {
+        if (ftruncate(fd, sizeof(metrics_shm_t)) == 0) {
+            mem = mmap(NULL, sizeof(metrics_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (mem == MAP_FAILED) {
+            shm_unlink(shm_name);
+        }
+    }
+    if (mem == MAP_FAILED) {
+        LOG_WARN("metrics: shared memory unavailable, counters are private");
+        shm_name[0] = '\0';
+        mem = mmap(NULL, sizeof(metrics_shm_t), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            return;
+        }
+    } else {
+        atexit(metrics_unlink);
+        install_unlink_handler(SIGINT);
+        install_unlink_handler(SIGTERM);
+    }
+
+    metrics_shm_t* shm = mem;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    shm->header.version = METRICS_VERSION;
+    shm->header.header_size = sizeof(metrics_header_t);
+    shm->header.slot_size = sizeof(metrics_slot_t);
+    shm->header.max_slots = METRICS_MAX_SLOTS;
+    shm->header.pid = getpid();
+    shm->header.start_time_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    if (program) {
+        const char* base = strrchr(program, '/');
+        snprintf(shm->header.program, sizeof(shm->header.program), "%s", base ? base + 1 : program);
+    }
+    // The last slot is shared by every thread that finds the table full.
+    shm->slots[METRICS_MAX_SLOTS - 1].shared = 1;
+    shm->slots[METRICS_MAX_SLOTS - 1].owner_tid = -1;
+
+    // Readers check magic last: everything above is visible once it is set.
+    __atomic_store_n(&shm->header.magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+    __atomic_store_n(&metrics_shm, shm, __ATOMIC_RELEASE);
+    if (shm_name[0]) {
+        LOG_INFO("metrics published in /dev/shm%s", shm_name);
+    }
+}
+
+
+metrics_counters_t* metrics_claim_slot(void) {
+    metrics_shm_t* shm = __atomic_load_n(&metrics_shm, __ATOMIC_ACQUIRE);
+    if (shm == NULL) {
+        // Don't cache: the thread should pick up a real slot once
+        // metrics_init has run.
+        return &tl_private.c;
+    }
+
+    pthread_once(&slot_key_once, slot_key_create);
+    int32_t tid = (int32_t)syscall(SYS_gettid);
+    metrics_slot_t* slot = &shm->slots[METRICS_MAX_SLOTS - 1];
+    for (int i = 0; i < METRICS_MAX_SLOTS - 1; i++) {
+        int32_t expected = 0;
+        if (__atomic_compare_exchange_n(&shm->slots[i].owner_tid, &expected, tid, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            slot = &shm->slots[i];
+            uint32_t used = __atomic_load_n(&shm->header.slots_used, __ATOMIC_RELAXED);
+            while (used < (uint32_t)i + 1 &&
+                   !__atomic_compare_exchange_n(&shm->header.slots_used, &used, i + 1, false,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            }
+            break;
+        }
+    }
+
+    metrics_tl_shared = slot->shared;
+    metrics_tl = &slot->c;
+    pthread_setspecific(slot_key, slot);
+    return metrics_tl;
+}
+
+
+const metrics_shm_t* metrics_attach(pid_t pid) {
+    char name[64];
+    snprintf(name, sizeof(name), METRICS_SHM_PREFIX "%d", (int)pid);
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(metrics_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        return NULL;
+    }
+
+    const metrics_shm_t* shm = mem;
+    if (__atomic_load_n(&shm->header.magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC ||
+        shm->header.version != METRICS_VERSION ||
+        (size_t)st.st_size < sizeof(metrics_shm_t)) {
+        munmap(mem, st.st_size);
+        return NULL;
+    }
+    return shm;
+}
+
+
+// Slots past slots_used have never been claimed, except the shared overflow
+// slot at the end.
+static int next_used_slot(const metrics_shm_t* shm, int i) {
+    uint32_t used = __atomic_load_n(&shm->header.slots_used, __ATOMIC_RELAXED);
+    i++;
+    return (uint32_t)i < used ? i : (i < METRICS_MAX_SLOTS ? METRICS_MAX_SLOTS - 1 : i);
+}
+
+
+void metrics_sum(const metrics_shm_t* shm, metrics_counters_t* out) {
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < METRICS_MAX_SLOTS; i = next_used_slot(shm, i)) {
+        const metrics_counters_t* c = &shm->slots[i].c;
+#define METRICS_SUM_FIELD(name) out->name += __atomic_load_n(&c->name, __ATOMIC_RELAXED);
+        METRICS_COUNTERS(METRICS_SUM_FIELD)
+#undef METRICS_SUM_FIELD
+    }
+}
+
+
+void metrics_sum_hist(const metrics_shm_t* shm, int id, histogram_t* out) {
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < METRICS_MAX_SLOTS; i = next_used_slot(shm, i)) {
+        histogram_merge(out, &shm->slots[i].hist[id]);
+    }
+}
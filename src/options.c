@@ -0,0 +1,209 @@
+#include "options.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_ENDPOINT            "9090"
+#define DEFAULT_IDLE_TIMEOUT_MS     300000
+#define DEFAULT_HEADER_TIMEOUT_MS   30000
+#define DEFAULT_WRITE_TIMEOUT_MS    30000
+
+enum {
+    OPT_IDLE_TIMEOUT = 256,
+    OPT_HEADER_TIMEOUT,
+    OPT_WRITE_TIMEOUT,
+    OPT_MAX_CONNS,
+    OPT_HANDOFF,
+    OPT_HUGEPAGES,
+    OPT_ZEROCOPY,
+    OPT_BACKEND,
+    OPT_SOCK_PROFILE,
+    OPT_LISTEN,
+    OPT_CAPTURE,
+};
+
+static const struct option long_options[] = {
+    {"idle-timeout",    required_argument, NULL, OPT_IDLE_TIMEOUT},
+    {"header-timeout",  required_argument, NULL, OPT_HEADER_TIMEOUT},
+    {"write-timeout",   required_argument, NULL, OPT_WRITE_TIMEOUT},
+    {"max-conns",       required_argument, NULL, OPT_MAX_CONNS},
+    {"handoff",         required_argument, NULL, OPT_HANDOFF},
+    {"hugepages",       no_argument,       NULL, OPT_HUGEPAGES},
+    {"zerocopy",        required_argument, NULL, OPT_ZEROCOPY},
+    {"backend",         required_argument, NULL, OPT_BACKEND},
+    {"sock-profile",    required_argument, NULL, OPT_SOCK_PROFILE},
+    {"listen",          required_argument, NULL, OPT_LISTEN},
+    {"capture",         required_argument, NULL, OPT_CAPTURE},
+    {"help",            no_argument,       NULL, 'h'},
+    {NULL, 0, NULL, 0},
+};
+
+
+static void usage(const char* prog, int status) {
+    fprintf(status ? stderr : stdout,
+            "usage: %s [options] [port]\n"
+            "  --listen=ENDPOINT[,PROFILE]\n"
+            "                        also listen on PORT, HOST:PORT, [ADDR]:PORT, unix:PATH or\n"
+            "                        unix:@NAME (abstract), optionally with its own socket\n"
+            "                        profile; may be repeated (default: port %s)\n"
+            "  --idle-timeout=MS     close connections without traffic (default %d, 0 = off)\n"
+            "  --header-timeout=MS   limit for receiving a message once '^' arrived (default %d)\n"
+            "  --write-timeout=MS    close peers that stop reading replies (default %d)\n"
+            "  --max-conns=N         stop accepting at N open connections (default: table size)\n"
+            "  --handoff=all|listener\n"
+            "                        what SIGUSR2 (hot restart) passes to the new process;\n"
+            "                        with 'listener' this process drains its peers (default all)\n"
+            "  --hugepages           back the I/O buffer pool with hugepages\n"
+            "  --zerocopy=BYTES      send replies of at least BYTES with MSG_ZEROCOPY (default 0 = off)\n"
+            "  --backend=select|poll|epoll|epoll-et\n"
+            "                        how the loop waits for events (default: the binary's own)\n"
+            "  --sock-profile=NAME   socket options for endpoints that name none:\n"
+            "                        %s (sockopts.h)\n"
+            "  --capture=FILE        record what clients send into a trace for test/replay\n"
+            "                        (an existing FILE is kept; the trace goes to FILE.PID)\n",
+            prog, DEFAULT_ENDPOINT, DEFAULT_IDLE_TIMEOUT_MS, DEFAULT_HEADER_TIMEOUT_MS, DEFAULT_WRITE_TIMEOUT_MS,
+            sock_profile_names());
+    exit(status);
+}
+
+
+static int parse_count(const char* prog, const char* arg, const char* what) {
+    char* end;
+    long v = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || v < 0 || v > 0x7fffffff) {
+        fprintf(stderr, "%s: invalid %s '%s'\n", prog, what, arg);
+        usage(prog, EXIT_FAILURE);
+    }
+    return (int)v;
+}
+
+
+static event_backend_t parse_backend(const char* prog, const char* arg) {
+    static const struct {
+        const char* name;
+        event_backend_t backend;
+    } backends[] = {
+        {"select", BACKEND_SELECT},
+        {"poll", BACKEND_POLL},
+        {"epoll", BACKEND_EPOLL},
+        {"epoll-et", BACKEND_EPOLL_ET},
+    };
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strcmp(arg, backends[i].name) == 0) {
+            return backends[i].backend;
+        }
+    }
+    fprintf(stderr, "%s: --backend must be select, poll, epoll or epoll-et\n", prog);
+    usage(prog, EXIT_FAILURE);
+    return BACKEND_DEFAULT;
+}
+
+
+// ENDPOINT or ENDPOINT,PROFILE; the profile is filled in later when absent.
+static void add_endpoint(const char* prog, server_options_t* opts, const char* arg) {
+    if (opts->nlisten == OPTIONS_MAX_LISTEN) {
+        fprintf(stderr, "%s: at most %d endpoints\n", prog, OPTIONS_MAX_LISTEN);
+        usage(prog, EXIT_FAILURE);
+    }
+    listen_spec_t* spec = &opts->listen[opts->nlisten++];
+    spec->endpoint = arg;
+    spec->profile = NULL;
+    const char* comma = strrchr(arg, ',');
+    if (comma) {
+        spec->profile = sock_profile_find(comma + 1);
+        if (spec->profile == NULL) {
+            fprintf(stderr, "%s: unknown socket profile '%s'\n", prog, comma + 1);
+            usage(prog, EXIT_FAILURE);
+        }
+        spec->endpoint = strndup(arg, comma - arg);
+    }
+}
+
+
+void parse_server_options(int argc, char** argv, server_options_t* opts) {
+    opts->nlisten = 0;
+    opts->max_conns = 0;
+    opts->handoff_peers = true;
+    opts->hugepages = false;
+    opts->zerocopy_min = 0;
+    opts->backend = BACKEND_DEFAULT;
+    opts->sock_profile = sock_profile_find("default");
+    opts->capture_path = NULL;
+    opts->idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS;
+    opts->header_timeout_ms = DEFAULT_HEADER_TIMEOUT_MS;
+    opts->write_timeout_ms = DEFAULT_WRITE_TIMEOUT_MS;
+
+    int c;
+    while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (c) {
+        case OPT_IDLE_TIMEOUT:
+            opts->idle_timeout_ms = parse_count(argv[0], optarg, "duration");
+            break;
+        case OPT_HEADER_TIMEOUT:
+            opts->header_timeout_ms = parse_count(argv[0], optarg, "duration");
+            break;
+        case OPT_WRITE_TIMEOUT:
+            opts->write_timeout_ms = parse_count(argv[0], optarg, "duration");
+            break;
+        case OPT_MAX_CONNS:
+            opts->max_conns = parse_count(argv[0], optarg, "connection count");
+            break;
+        case OPT_HANDOFF:
+            if (strcmp(optarg, "all") == 0) {
+                opts->handoff_peers = true;
+            } else if (strcmp(optarg, "listener") == 0) {
+                opts->handoff_peers = false;
+            } else {
+                fprintf(stderr, "%s: --handoff must be 'all' or 'listener'\n", argv[0]);
+                usage(argv[0], EXIT_FAILURE);
+            }
+            break;
+        case OPT_HUGEPAGES:
+            opts->hugepages = true;
+            break;
+        case OPT_ZEROCOPY:
+            opts->zerocopy_min = parse_count(argv[0], optarg, "size");
+            break;
+        case OPT_BACKEND:
+            opts->backend = parse_backend(argv[0], optarg);
+            break;
+        case OPT_SOCK_PROFILE:
+            opts->sock_profile = sock_profile_find(optarg);
+            if (opts->sock_profile == NULL) {
+                fprintf(stderr, "%s: unknown socket profile '%s'\n", argv[0], optarg);
+                usage(argv[0], EXIT_FAILURE);
+            }
+            break;
+        case OPT_LISTEN:
+            add_endpoint(argv[0], opts, optarg);
+            break;
+        case OPT_CAPTURE:
+            opts->capture_path = optarg;
+            break;
+        case 'h':
+            usage(argv[0], EXIT_SUCCESS);
+            break;
+        default:
+            usage(argv[0], EXIT_FAILURE);
+        }
+    }
+
+    if (optind < argc) {
+        parse_count(argv[0], argv[optind], "port");
+        add_endpoint(argv[0], opts, argv[optind++]);
+    }
+    if (optind < argc) {
+        fprintf(stderr, "%s: unexpected argument '%s'\n", argv[0], argv[optind]);
+        usage(argv[0], EXIT_FAILURE);
+    }
+    if (opts->nlisten == 0) {
+        add_endpoint(argv[0], opts, DEFAULT_ENDPOINT);
+    }
+    for (int i = 0; i < opts->nlisten; i++) {
+        if (opts->listen[i].profile == NULL) {
+            opts->listen[i].profile = opts->sock_profile;
+        }
+    }
+}
@@ -0,0 +1,164 @@
+#include <dirent.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "utils.h"
+
+// vmstat-like reader for the metrics segment of a running server.
+//
+//   server-stat -l                      list running servers
+//   server-stat -H <pid>                latency percentiles since start
+//   server-stat <pid> [interval [count]]
+//
+// The first line shows averages since the server started, every following line
+// the rates and message latency percentiles over the last interval.
+
+#define HEADER_EVERY        20
+
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void list_servers(void) {
+    DIR* dir = opendir("/dev/shm");
+    if (dir == NULL) {
+        perror_die("opendir /dev/shm");
+    }
+    const char* prefix = METRICS_SHM_PREFIX + 1;
+    printf("%8s %s\n", "pid", "program");
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strncmp(de->d_name, prefix, strlen(prefix)) != 0) {
+            continue;
+        }
+        pid_t pid = atoi(de->d_name + strlen(prefix));
+        const metrics_shm_t* shm = metrics_attach(pid);
+        if (shm && kill(pid, 0) == 0) {
+            printf("%8d %s\n", pid, shm->header.program);
+        }
+    }
+    closedir(dir);
+}
+
+
+static void print_histograms(const metrics_shm_t* shm) {
+    printf("%-16s %10s %10s %10s %10s %10s %10s\n",
+           "histogram", "count", "mean(us)", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+    for (int id = 0; id < METRICS_HIST_COUNT; id++) {
+        static histogram_t h;
+        metrics_sum_hist(shm, id, &h);
+        printf("%-16s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+               metrics_hist_names[id], (unsigned long)h.count,
+               h.count ? h.sum_ns / 1e3 / h.count : 0.0,
+               histogram_percentile(&h, 0.50) / 1e3,
+               histogram_percentile(&h, 0.99) / 1e3,
+               histogram_percentile(&h, 0.999) / 1e3,
+               h.max_ns / 1e3);
+    }
+}
+
+
+static void print_header(void) {
+    printf("%7s %7s %7s %7s %7s %9s %9s %8s %8s %7s %8s %7s %6s %7s %8s %8s %8s\n",
+           "open", "acc/s", "close/s", "rej/s", "err/s", "inKB/s", "outKB/s", "recv/s", "send/s",
+           "eagain/s", "wake/s", "ev/wake", "qdepth", "bufKB", "p50us", "p99us", "p999us");
+}
+
+
+static void print_line(const metrics_shm_t* shm, const metrics_counters_t* cur,
+                       const metrics_counters_t* prev, const histogram_t* latency,
+                       double secs) {
+    if (secs <= 0) {
+        secs = 1;
+    }
+    uint64_t wakeups = cur->loop_wakeups - prev->loop_wakeups;
+    double ev_per_wake = wakeups ? (double)(cur->loop_events - prev->loop_events) / wakeups : 0;
+    printf("%7ld %7.0f %7.0f %7.0f %7.0f %9.1f %9.1f %8.0f %8.0f %7.0f %8.0f %7.2f %6ld %7ld %8.1f %8.1f %8.1f\n",
+           (long)(cur->conn_accepted - cur->conn_closed),
+           (cur->conn_accepted - prev->conn_accepted) / secs,
+           (cur->conn_closed - prev->conn_closed) / secs,
+           (cur->conn_rejected - prev->conn_rejected) / secs,
+           (cur->conn_reset + cur->conn_epipe + cur->conn_io_errors -
+            prev->conn_reset - prev->conn_epipe - prev->conn_io_errors) / secs,
+           (cur->bytes_in - prev->bytes_in) / secs / 1024,
+           (cur->bytes_out - prev->bytes_out) / secs / 1024,
+           (cur->recv_calls - prev->recv_calls) / secs,
+           (cur->send_calls - prev->send_calls) / secs,
+           (cur->eagain - prev->eagain) / secs,
+           wakeups / secs,
+           ev_per_wake,
+           (long)__atomic_load_n(&shm->header.gauges.pool_queue_depth, __ATOMIC_RELAXED),
+           (long)__atomic_load_n(&shm->header.gauges.bufpool_leased_bytes, __ATOMIC_RELAXED) / 1024,
+           histogram_percentile(latency, 0.50) / 1e3,
+           histogram_percentile(latency, 0.99) / 1e3,
+           histogram_percentile(latency, 0.999) / 1e3);
+}
+
+
+int main(int argc, char** argv) {
+    if (argc >= 2 && strcmp(argv[1], "-l") == 0) {
+        list_servers();
+        return 0;
+    }
+    if (argc >= 3 && strcmp(argv[1], "-H") == 0) {
+        const metrics_shm_t* shm = metrics_attach(atoi(argv[2]));
+        if (shm == NULL) {
+            die("no metrics for pid %s", argv[2]);
+        }
+        print_histograms(shm);
+        return 0;
+    }
+    if (argc < 2) {
+        die("usage: %s -l | -H <pid> | <pid> [interval [count]]", argv[0]);
+    }
+
+    pid_t pid = atoi(argv[1]);
+    int interval = argc >= 3 ? atoi(argv[2]) : 1;
+    int count = argc >= 4 ? atoi(argv[3]) : -1;
+    if (interval <= 0) {
+        interval = 1;
+    }
+
+    const metrics_shm_t* shm = metrics_attach(pid);
+    if (shm == NULL) {
+        die("no metrics for pid %d (is it running, and built with the same layout?)", pid);
+    }
+    printf("%s (pid %d)\n", shm->header.program, shm->header.pid);
+
+    metrics_counters_t prev, cur;
+    memset(&prev, 0, sizeof(prev));
+    static histogram_t hist_prev, hist_cur, hist_interval;
+    double prev_time = shm->header.start_time_ns / 1e9;
+
+    for (int line = 0; count < 0 || line < count; line++) {
+        if (line % HEADER_EVERY == 0) {
+            print_header();
+        }
+        metrics_sum(shm, &cur);
+        metrics_sum_hist(shm, METRICS_HIST_msg_latency, &hist_cur);
+        histogram_diff(&hist_interval, &hist_cur, &hist_prev);
+        double t = now_sec();
+        print_line(shm, &cur, &prev, &hist_interval, t - prev_time);
+        fflush(stdout);
+        prev = cur;
+        hist_prev = hist_cur;
+        prev_time = t;
+
+        if (kill(pid, 0) != 0) {
+            break;
+        }
+        if (count < 0 || line + 1 < count) {
+            sleep(interval);
+        }
+    }
+    return 0;
+}
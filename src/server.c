@@ -1,7 +1,21 @@
 #include "server.h"
 
-// each peer is identified by the file descriptor
-peer_state_t global_state[MAXFDS];
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "probes.h"
+#include "trace.h"
+
+peer_state_t* global_state;
+peer_info_t* peer_info;
+int peer_table_size;
+
+static int* deferred_ring;
+static int deferred_head;
+static int deferred_count;
 
 // These constants make creating fd_status_t values less verbose.
 const fd_status_t fd_status_R = {.want_read = true, .want_write = false};
@@ -9,161 +23,1138 @@ const fd_status_t fd_status_W = {.want_read = false, .want_write = true};
 const fd_status_t fd_status_RW = {.want_read = true, .want_write = true};
 const fd_status_t fd_status_NORW = {.want_read = false, .want_write = false};
 
+static void* map_table(size_t bytes)
+{
+    // anonymous mappings are page aligned and zero filled on first touch
+    void* table = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+        perror_die("mmap peer table");
+    }
+    return table;
+}
 
 
-void serve_connection(int sockfd) {
-    /* Client attempting to connect and send data will succeed even before the
-     * the connection is accept()-ed by the server. Therefore, to better simulate
-     * blocking of other clients while one is being served, do this 'ack' from
-     * the server which the client expects to see before proceeding. */
-    if (send(sockfd, "*", 1, 0) < 1) {
-        perror_die("send");
+int peer_table_init(int size)
+{
+    if (size <= 0) {
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur == RLIM_INFINITY ||
+            limit.rlim_cur > PEER_TABLE_MAX) {
+            size = PEER_TABLE_MAX;
+        } else {
+            size = (int)limit.rlim_cur;
+        }
     }
+    global_state = map_table((size_t)size * sizeof(peer_state_t));
+    peer_info = map_table((size_t)size * sizeof(peer_info_t));
+    deferred_ring = map_table((size_t)size * sizeof(int));
+    peer_table_size = size;
+    return size;
+}
 
-    ProcessingState state = WAIT_FOR_MSG;
 
-    while (1) {
-        uint8_t buf[1024];
-        int len = recv(sockfd, buf, sizeof(buf), 0);
-        if (len < 0) {
-            perror_die("recv");
-        } else if (len == 0) {
+// Ring of deferred fds; each fd is in it at most once, so a ring as large as
+// the table never overflows.
+void peers_defer(int sockfd)
+{
+    assert(sockfd < peer_table_size);
+    if (global_state[sockfd].deferred) {
+        return;
+    }
+    global_state[sockfd].deferred = true;
+    deferred_ring[(deferred_head + deferred_count) % peer_table_size] = sockfd;
+    deferred_count++;
+}
+
+
+bool peers_deferred(void)
+{
+    return deferred_count > 0;
+}
+
+
+void peers_run_deferred(void (*serve)(int sockfd, void* ctx), void* ctx)
+{
+    // peers serve defers again go behind this round
+    for (int n = deferred_count; n > 0; n--) {
+        int sockfd = deferred_ring[deferred_head];
+        deferred_head = (deferred_head + 1) % peer_table_size;
+        deferred_count--;
+        global_state[sockfd].deferred = false;
+        if (global_state[sockfd].open) {
+            serve(sockfd, ctx);
+        }
+    }
+}
+
+
+// Connection timeouts; every peer has a single timer armed for the earliest one
+static timer_wheel_t peer_wheel;
+static uint64_t idle_timeout_ns;
+static uint64_t header_timeout_ns;
+static uint64_t write_timeout_ns;
+
+// Admission control
+static int max_peers;                       /* 0: no limit */
+static int peer_fd_limit;                   /* 0: no limit */
+static int peers_open;                      /* updated atomically, blocking servers are threaded */
+static int spare_fd = -1;                   /* given up to accept-and-close on EMFILE; acceptor only */
+static bool out_of_fds;                     /* EMFILE and no spare fd left; atomic */
+static bool rearm_spare;                    /* a peer closed since; atomic, acceptor reserves */
+
+
+
+static void reserve_spare_fd(void)
+{
+    if (spare_fd < 0) {
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+}
+
+
+void admission_init(int max_conns, int fd_limit)
+{
+    max_peers = max_conns;
+    peer_fd_limit = fd_limit;
+    reserve_spare_fd();
+    if (spare_fd < 0) {
+        perror_die("open spare fd");
+    }
+}
+
+
+void ignore_sigpipe(void)
+{
+    // peers that go away are handled where send() fails, never by a signal
+    signal(SIGPIPE, SIG_IGN);
+}
+
+
+int peers_count(void)
+{
+    return __atomic_load_n(&peers_open, __ATOMIC_RELAXED);
+}
+
+
+bool peers_saturated(void)
+{
+    return __atomic_load_n(&out_of_fds, __ATOMIC_RELAXED) ||
+           (max_peers && __atomic_load_n(&peers_open, __ATOMIC_RELAXED) >= max_peers);
+}
+
+
+// Out of fds with a connection waiting: the only way to get it out of the
+// accept queue is to free an fd, take the connection and close it. Otherwise
+// a level-triggered loop spins on the listener.
+static void shed_with_spare_fd(int listener_sockfd)
+{
+    if (spare_fd < 0) {
+        __atomic_store_n(&out_of_fds, true, __ATOMIC_RELAXED);
+        return;
+    }
+    close(spare_fd);
+    spare_fd = -1;
+    int sockfd = accept(listener_sockfd, NULL, NULL);
+    if (sockfd >= 0) {
+        close(sockfd);
+        METRIC_INC(conn_rejected);
+    }
+    reserve_spare_fd();
+    if (spare_fd < 0) {
+        // another thread took the fd back; wait for a peer to close
+        __atomic_store_n(&out_of_fds, true, __ATOMIC_RELAXED);
+    }
+}
+
+
+int accept_peer(int listener_sockfd, struct sockaddr_storage* peer_addr, socklen_t* peer_addr_len)
+{
+    // only the acceptor touches spare_fd: closing peers just ask for it back
+    if (__atomic_load_n(&rearm_spare, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&rearm_spare, false, __ATOMIC_ACQUIRE)) {
+        reserve_spare_fd();
+    }
+    int sockfd = accept(listener_sockfd, (struct sockaddr*)peer_addr, peer_addr_len);
+    if (sockfd < 0) {
+        switch (errno) {
+        case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+        case EWOULDBLOCK:
+#endif
+            // this can happen due to nonblocking socket mode
+            METRIC_INC(eagain);
+            break;
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            METRIC_INC(accept_errors);
+            LOG_WARN("accept: %s, shedding connection", strerror(errno));
+            shed_with_spare_fd(listener_sockfd);
+            break;
+        default:
+            // ECONNABORTED, EPROTO, EINTR and friends only concern the one
+            // connection that was being accepted
+            METRIC_INC(accept_errors);
+            LOG_DEBUG("accept: %s", strerror(errno));
             break;
         }
+        return -1;
+    }
+
+    if ((peer_fd_limit && sockfd >= peer_fd_limit) ||
+        (max_peers && __atomic_load_n(&peers_open, __ATOMIC_RELAXED) >= max_peers)) {
+        // closing before the '*' ack tells the client it was not served
+        LOG_DEBUG("rejecting socket %d: %d peers open", sockfd, peers_open);
+        METRIC_INC(conn_rejected);
+        close(sockfd);
+        return -1;
+    }
+    sock_profile_accepted(listener_sockfd, sockfd);
+    PROBE1(conn__accept, sockfd);
+    return sockfd;
+}
+
+
+static void peer_opened(void)
+{
+    __atomic_add_fetch(&peers_open, 1, __ATOMIC_RELAXED);
+}
+
+
+static void peer_released(void)
+{
+    __atomic_sub_fetch(&peers_open, 1, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&out_of_fds, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&out_of_fds, false, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&rearm_spare, true, __ATOMIC_RELEASE);
+    }
+}
+
+
+
+// Counts a failed recv/send on sockfd by error class. The caller closes the
+// connection; no other peer is affected.
+static void peer_io_error(int sockfd, const char* op, int err)
+{
+    switch (err) {
+    case ECONNRESET:
+        METRIC_INC(conn_reset);
+        break;
+    case EPIPE:
+        METRIC_INC(conn_epipe);
+        break;
+    default:
+        METRIC_INC(conn_io_errors);
+        break;
+    }
+    LOG_DEBUG("socket %d: %s: %s", sockfd, op, strerror(err));
+}
+
+
+static int zerocopy_reap(int sockfd);
+
 
-        for (int i = 0; i < len; i++) {
-            switch (state) {
-            case WAIT_FOR_MSG:
-                if (buf[i] == '^') {
-                    state = IN_MSG;
-                }
-                break;
-            case IN_MSG:
-                if (buf[i] == '$') {
-                    state = WAIT_FOR_MSG;
-                } else {
-                    buf[i] += 1;
-                    if (send(sockfd, &buf[i], 1, 0) < 1) {
-                        perror("send error");
-                        close(sockfd);
-                        return;
-                    }
-                }
-                break;
-            default:
-                break;
+bool on_peer_error(int sockfd)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+        err = errno;
+    }
+    if (err) {
+        peer_io_error(sockfd, "poll", err);
+        return false;
+    }
+    // completions on the error queue are reported as an error too
+    return zerocopy_reap(sockfd) > 0;
+}
+
+
+// Peers' output buffers; nothing is leased while a peer has nothing to send
+static buffer_pool_t buffer_pool;
+static int zerocopy_min;
+static trace_writer_t* capture;             /* --capture; NULL when off */
+
+
+void peer_buffers_init(const server_options_t* opts)
+{
+    bufpool_init(&buffer_pool, opts->hugepages);
+    zerocopy_min = opts->zerocopy_min;
+}
+
+
+static void capture_close(void)
+{
+    trace_writer_close(capture);
+    capture = NULL;
+}
+
+
+void peer_capture_init(const server_options_t* opts)
+{
+    if (opts->capture_path == NULL) {
+        return;
+    }
+    capture = trace_writer_open(opts->capture_path);
+    if (capture == NULL) {
+        die("cannot capture to %s", opts->capture_path);
+    }
+    // exit() paths (drained, handed over) leave an exact-size file; a killed
+    // server leaves a zero tail that readers stop at
+    atexit(capture_close);
+    LOG_INFO("capturing inbound traffic to %s", trace_writer_path(capture));
+}
+
+
+static sendbuf_t* sendbuf_lease(int size)
+{
+    size_t capacity;
+    sendbuf_t* sendbuf = bufpool_get(&buffer_pool, sizeof(sendbuf_t) + size, &capacity);
+    sendbuf->size = (int)(capacity - sizeof(sendbuf_t));
+    sendbuf->used = 0;
+    sendbuf->end = 0;
+    sendbuf->ptr = 0;
+    sendbuf->nsegs = 0;
+    sendbuf->seg = 0;
+    sendbuf->npending = 0;
+    sendbuf->zc_used = false;
+    sendbuf->next = NULL;
+    METRIC_GAUGE_SET(bufpool_leased_bytes, (int64_t)buffer_pool.leased_bytes);
+    METRIC_GAUGE_SET(bufpool_reserved_bytes, (int64_t)buffer_pool.reserved_bytes);
+    return sendbuf;
+}
+
+
+static void sendbuf_put(sendbuf_t* sendbuf)
+{
+    bufpool_put(&buffer_pool, sendbuf, sizeof(sendbuf_t) + sendbuf->size);
+    METRIC_GAUGE_SET(bufpool_leased_bytes, (int64_t)buffer_pool.leased_bytes);
+}
+
+
+static bool zerocopy_pending(const peer_info_t* info, const sendbuf_t* sendbuf)
+{
+    return sendbuf->zc_used && (int32_t)(info->zc_done - sendbuf->zc_seq) <= 0;
+}
+
+
+static void sendbuf_release(peer_state_t* peer_state)
+{
+    sendbuf_t* sendbuf = peer_state->sendbuf;
+    if (sendbuf == NULL) {
+        return;
+    }
+    peer_state->sendbuf = NULL;
+    peer_info_t* info = &peer_info[peer_state - global_state];
+    if (zerocopy_pending(info, sendbuf)) {
+        // the pages may still be read by the kernel; reusing them now would
+        // change bytes the peer has not received yet
+        sendbuf->next = info->zc_parked;
+        info->zc_parked = sendbuf;
+        return;
+    }
+    sendbuf_put(sendbuf);
+}
+
+
+// Collects the socket's MSG_ZEROCOPY completions and returns the parked
+// buffers they release to the pool. Returns the number of completions read.
+static int zerocopy_reap(int sockfd)
+{
+    peer_info_t* info = &peer_info[sockfd];
+    int reaped = 0;
+    while (info->zc_done != info->zc_sent) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        if (recvmsg(sockfd, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            const struct sock_extended_err* serr = (const void*)CMSG_DATA(cmsg);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) {
+                continue;
+            }
+            // [ee_info, ee_data] is the range of sends that completed
+            if ((int32_t)(serr->ee_data + 1 - info->zc_done) > 0) {
+                info->zc_done = serr->ee_data + 1;
+            }
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                METRIC_ADD(zerocopy_copied, serr->ee_data - serr->ee_info + 1);
             }
+            reaped++;
         }
     }
-    close(sockfd);
+
+    sendbuf_t** link = &info->zc_parked;
+    while (*link) {
+        sendbuf_t* sendbuf = *link;
+        if (zerocopy_pending(info, sendbuf)) {
+            link = &sendbuf->next;
+        } else {
+            *link = sendbuf->next;
+            sendbuf_put(sendbuf);
+        }
+    }
+    return reaped;
 }
 
 
+// Buffers still parked when their socket closed. Their completions can no
+// longer be read, so each closed socket's buffers wait out ZEROCOPY_ORPHAN_NS,
+// by which time the kernel has sent or dropped the data, and go back to the
+// pool. Past ZEROCOPY_MAX_ORPHANS sockets or ZEROCOPY_ORPHAN_BYTES the oldest
+// go back early.
+#define ZEROCOPY_ORPHAN_NS      (10 * 1000000000ull)
+#define ZEROCOPY_MAX_ORPHANS    256
+#define ZEROCOPY_ORPHAN_BYTES   (16u << 20)
+
+typedef struct {
+    sendbuf_t* parked;
+    size_t bytes;
+    uint64_t closed_ns;
+} zerocopy_orphan_t;
 
-fd_status_t on_peer_connected(int sockfd, const struct sockaddr_in* peer_addr, socklen_t peer_addr_len)
+static zerocopy_orphan_t zc_orphans[ZEROCOPY_MAX_ORPHANS];      /* FIFO by closed_ns */
+static int zc_orphan_head;
+static int zc_orphan_count;
+static size_t zc_orphan_bytes;
+
+
+static void zerocopy_release_oldest_orphan(void)
 {
-    assert(sockfd < MAXFDS);
-    report_peer_connected(peer_addr, peer_addr_len);
+    zerocopy_orphan_t* orphan = &zc_orphans[zc_orphan_head];
+    while (orphan->parked) {
+        sendbuf_t* sendbuf = orphan->parked;
+        orphan->parked = sendbuf->next;
+        sendbuf_put(sendbuf);
+    }
+    zc_orphan_bytes -= orphan->bytes;
+    zc_orphan_head = (zc_orphan_head + 1) % ZEROCOPY_MAX_ORPHANS;
+    zc_orphan_count--;
+    METRIC_GAUGE_SET(zerocopy_orphan_bytes, (int64_t)zc_orphan_bytes);
+}
 
-    // Initialize state to send back a '*' to the peer imediately
-    peer_state_t* peer_state = &global_state[sockfd];
-    peer_state->state = INITIAL_ACK;
-    peer_state->sendbuf[0] = '*';
-    peer_state->sendptr = 0;
-    peer_state->sendbuf_end = 1;
 
-    // signal that this socket is ready for writing
-    return fd_status_W;
+static void zerocopy_expire_orphans(uint64_t now_ns)
+{
+    while (zc_orphan_count > 0 &&
+           (now_ns - zc_orphans[zc_orphan_head].closed_ns >= ZEROCOPY_ORPHAN_NS ||
+            zc_orphan_bytes > ZEROCOPY_ORPHAN_BYTES)) {
+        zerocopy_release_oldest_orphan();
+    }
+}
+
+
+// Takes over the buffers still parked on a socket that is being closed.
+static void zerocopy_orphan(int sockfd)
+{
+    // the last chance to read completions that already arrived
+    zerocopy_reap(sockfd);
+    sendbuf_t* parked = peer_info[sockfd].zc_parked;
+    peer_info[sockfd].zc_parked = NULL;
+    if (parked == NULL) {
+        return;
+    }
+    LOG_DEBUG("socket %d closed with zerocopy sends in flight", sockfd);
+    if (zc_orphan_count == ZEROCOPY_MAX_ORPHANS) {
+        zerocopy_release_oldest_orphan();
+    }
+    zerocopy_orphan_t* orphan =
+        &zc_orphans[(zc_orphan_head + zc_orphan_count) % ZEROCOPY_MAX_ORPHANS];
+    orphan->parked = parked;
+    orphan->bytes = 0;
+    orphan->closed_ns = hist_now_ns();
+    for (sendbuf_t* sendbuf = parked; sendbuf; sendbuf = sendbuf->next) {
+        orphan->bytes += sizeof(sendbuf_t) + sendbuf->size;
+    }
+    zc_orphan_count++;
+    zc_orphan_bytes += orphan->bytes;
+    METRIC_GAUGE_SET(zerocopy_orphan_bytes, (int64_t)zc_orphan_bytes);
+    zerocopy_expire_orphans(orphan->closed_ns);
+}
+
+
+// Unix sockets always copy; for TCP a kernel without SO_ZEROCOPY turns it
+// off for everyone.
+static void zerocopy_enable(int sockfd)
+{
+    int one = 1;
+    peer_info_t* info = &peer_info[sockfd];
+    info->zc_enabled = false;
+    if (!zerocopy_min || info->addr.ss_family == AF_UNIX) {
+        return;
+    }
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        LOG_WARN("SO_ZEROCOPY: %s, sending with copies", strerror(errno));
+        zerocopy_min = 0;
+        return;
+    }
+    info->zc_enabled = true;
+}
+
+
+// Adds 1 to every byte of p[0, n), eight bytes at a time: the low seven bits
+// of each byte are incremented without carrying into the next byte and the
+// top bit is flipped where that addition overflowed into it.
+static void transform_bytes(uint8_t* p, size_t n)
+{
+    const uint64_t low7 = 0x7f7f7f7f7f7f7f7full;
+    const uint64_t ones = 0x0101010101010101ull;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+        uint64_t x;
+        memcpy(&x, p + i, sizeof(x));
+        x = ((x & low7) + ones) ^ (x & ~low7);
+        memcpy(p + i, &x, sizeof(x));
+    }
+    for (; i < n; i++) {
+        p[i] += 1;
+    }
+}
+
+
+// Queues data[start, end) for sending as it is. Runs that continue the last
+// segment extend it; once segs is full a run is moved up behind the last
+// segment instead.
+static void sendbuf_queue(sendbuf_t* sendbuf, int start, int end)
+{
+    if (start == end) {
+        return;
+    }
+    uint8_t* data = sendbuf->data;
+    sendbuf->end += end - start;
+    send_seg_t* last = sendbuf->nsegs ? &sendbuf->segs[sendbuf->nsegs - 1] : NULL;
+    if (last && last->end == start) {
+        last->end = end;
+    } else if (sendbuf->nsegs == PEER_SEND_SEGS) {
+        memmove(&data[last->end], &data[start], end - start);
+        last->end += end - start;
+    } else {
+        sendbuf->segs[sendbuf->nsegs++] = (send_seg_t){start, end};
+    }
+}
+
+
+// Moves the send position nsent reply bytes forward.
+static void sendbuf_consume(sendbuf_t* sendbuf, int nsent)
+{
+    sendbuf->ptr += nsent;
+    while (nsent > 0) {
+        send_seg_t* seg = &sendbuf->segs[sendbuf->seg];
+        int n = seg->end - seg->start < nsent ? seg->end - seg->start : nsent;
+        seg->start += n;
+        nsent -= n;
+        if (seg->start == seg->end) {
+            sendbuf->seg++;
+        }
+    }
+}
+
+
+// Points iov (PEER_SEND_SEGS entries) at the bytes still to send; returns
+// how many entries were used.
+static int sendbuf_iov(const sendbuf_t* sendbuf, struct iovec* iov)
+{
+    int n = 0;
+    for (int i = sendbuf->seg; i < sendbuf->nsegs; i++) {
+        iov[n].iov_base = (void*)&sendbuf->data[sendbuf->segs[i].start];
+        iov[n].iov_len = sendbuf->segs[i].end - sendbuf->segs[i].start;
+        n++;
+    }
+    return n;
+}
+
+
+// Every protocol state change goes through here so state__change sees it.
+static inline void set_state(peer_state_t* peer_state, ProcessingState state)
+{
+    PROBE3(state__change, peer_state, peer_state->state, state);
+    peer_state->state = state;
 }
 
 
-fd_status_t on_peer_ready_recv(int sockfd) 
+// Called on a message's closing '$'. Its latency is recorded once the last byte
+// it put in sendbuf has been handed to send().
+static void message_done(peer_state_t* peer_state)
 {
-    assert(sockfd < MAXFDS);
+    sendbuf_t* sendbuf = peer_state->sendbuf;
+    if (sendbuf->end <= sendbuf->ptr) {
+        // nothing of it is waiting in sendbuf
+        METRIC_HIST_RECORD(msg_latency, hist_now_ns() - peer_state->msg_start_ns);
+    } else if (sendbuf->npending < PEER_PENDING_MSGS) {
+        pending_msg_t* msg = &sendbuf->pending[sendbuf->npending++];
+        msg->end = sendbuf->end;
+        msg->start_ns = peer_state->msg_start_ns;
+    }
+}
+
+
+// Records every pending message whose last byte is now before sendbuf->ptr.
+static void messages_sent(sendbuf_t* sendbuf)
+{
+    if (sendbuf->npending == 0) {
+        return;
+    }
+    uint64_t now = hist_now_ns();
+    int done = 0;
+    while (done < sendbuf->npending && sendbuf->pending[done].end <= sendbuf->ptr) {
+        METRIC_HIST_RECORD(msg_latency, now - sendbuf->pending[done].start_ns);
+        done++;
+    }
+    sendbuf->npending -= done;
+    memmove(sendbuf->pending, sendbuf->pending + done,
+            sendbuf->npending * sizeof(pending_msg_t));
+}
+
+
+static bool output_pending(const peer_state_t* peer_state)
+{
+    return peer_state->sendbuf != NULL;
+}
+
+
+// True from the first byte of a message or frame to its last.
+static bool in_message(const peer_state_t* peer_state)
+{
+    return peer_state->state == IN_MSG || peer_state->state == IN_FRAME_HEADER ||
+           peer_state->state == IN_FRAME;
+}
+
+
+// Deadline of the earliest enabled timeout that currently applies to the
+// peer and its name, or UINT64_MAX when none does.
+static uint64_t peer_deadline(const peer_state_t* peer_state, const char** reason)
+{
+    uint64_t deadline = UINT64_MAX;
+    if (idle_timeout_ns) {
+        deadline = peer_state->last_activity_ns + idle_timeout_ns;
+        *reason = "idle";
+    }
+    if (write_timeout_ns && output_pending(peer_state) &&
+        peer_state->last_send_ns + write_timeout_ns < deadline) {
+        deadline = peer_state->last_send_ns + write_timeout_ns;
+        *reason = "write stall";
+    }
+    if (header_timeout_ns && in_message(peer_state) &&
+        peer_state->msg_start_ns + header_timeout_ns < deadline) {
+        deadline = peer_state->msg_start_ns + header_timeout_ns;
+        *reason = "message";
+    }
+    return deadline;
+}
+
+
+static void peer_rearm(peer_state_t* peer_state)
+{
+    const char* reason = NULL;
+    uint64_t deadline = peer_deadline(peer_state, &reason);
+    if (deadline == UINT64_MAX) {
+        tw_cancel(&peer_wheel, &peer_state->timer);
+    } else {
+        tw_arm(&peer_wheel, &peer_state->timer, deadline);
+    }
+}
+
+
+void peer_timers_init(const server_options_t* opts)
+{
+    tw_init(&peer_wheel, PEER_TIMER_TICK_MS, hist_now_ns());
+    idle_timeout_ns = opts->idle_timeout_ms * 1000000ull;
+    header_timeout_ns = opts->header_timeout_ms * 1000000ull;
+    write_timeout_ns = opts->write_timeout_ms * 1000000ull;
+}
+
+
+int peer_timers_next_ms(void)
+{
+    return tw_next_timeout_ms(&peer_wheel, hist_now_ns());
+}
+
+
+typedef struct {
+    void (*close_peer)(int sockfd, void* ctx);
+    void* ctx;
+    uint64_t now_ns;
+} expire_ctx_t;
+
+
+static void peer_timer_expired(tw_timer_t* timer, void* ctx)
+{
+    expire_ctx_t* expire = ctx;
+    peer_state_t* peer_state = (peer_state_t*)((char*)timer - offsetof(peer_state_t, timer));
+    int sockfd = (int)(peer_state - global_state);
+
+    const char* reason = NULL;
+    if (peer_deadline(peer_state, &reason) > expire->now_ns) {
+        // the wheel rounds up to whole ticks, so this is only reached if the
+        // peer's state changed without a rearm; keep it going
+        peer_rearm(peer_state);
+        return;
+    }
+    char addr[SOCKADDR_STRLEN];
+    format_sockaddr((struct sockaddr*)&peer_info[sockfd].addr, peer_info[sockfd].addr_len, addr,
+                    sizeof(addr));
+    LOG_INFO("socket %d (%s) timed out (%s) after %.1fs connected", sockfd, addr, reason,
+             (expire->now_ns - peer_info[sockfd].connected_ns) / 1e9);
+    METRIC_INC(conn_timed_out);
+    expire->close_peer(sockfd, expire->ctx);
+}
+
+
+void peer_timers_expire(void (*close_peer)(int sockfd, void* ctx), void* ctx)
+{
+    expire_ctx_t expire = {close_peer, ctx, hist_now_ns()};
+    tw_advance(&peer_wheel, expire.now_ns, peer_timer_expired, &expire);
+    if (zc_orphan_count > 0) {
+        zerocopy_expire_orphans(expire.now_ns);
+    }
+}
+
+
+void on_peer_closed(int sockfd)
+{
+    assert(sockfd < peer_table_size);
+    PROBE1(closed__entry, sockfd);
+    if (capture && peer_info[sockfd].trace_conn) {
+        trace_conn_close(capture, peer_info[sockfd].trace_conn);
+    }
+    global_state[sockfd].open = false;
+    sendbuf_release(&global_state[sockfd]);
+    if (peer_info[sockfd].zc_parked) {
+        zerocopy_orphan(sockfd);
+    }
+    tw_cancel(&peer_wheel, &global_state[sockfd].timer);
+    peer_released();
+    PROBE1(conn__close, sockfd);
+    PROBE1(closed__exit, sockfd);
+}
+
+
+fd_status_t on_peer_adopted(int sockfd, const peer_state_t* state, const peer_info_t* info,
+                            const sendbuf_t* sendbuf)
+{
+    assert(sockfd < peer_table_size);
+    METRIC_INC(conn_accepted);
+    peer_opened();
+
     peer_state_t* peer_state = &global_state[sockfd];
+    *peer_state = *state;
+    // the timer links pointed into the other process' wheel
+    memset(&peer_state->timer, 0, sizeof(peer_state->timer));
+    peer_state->open = true;
+    peer_state->interest = 0;
+    peer_state->deferred = false;
+    peer_state->sendbuf = NULL;
+    peer_info[sockfd] = *info;
+    // buffers parked in the other process are its own; the completions for
+    // them still arrive here and are counted
+    peer_info[sockfd].zc_parked = NULL;
+    peer_info[sockfd].trace_conn = 0;
+    zerocopy_enable(sockfd);
+    if (sendbuf) {
+        peer_state->sendbuf = sendbuf_lease(sendbuf->used);
+        int size = peer_state->sendbuf->size;
+        memcpy(peer_state->sendbuf, sendbuf, sizeof(sendbuf_t) + sendbuf->used);
+        peer_state->sendbuf->size = size;
+        peer_state->sendbuf->zc_used = false;
+        peer_state->sendbuf->next = NULL;
+    }
+    peer_rearm(peer_state);
 
-    if (peer_state->state == INITIAL_ACK || peer_state->sendptr < peer_state->sendbuf_end) {
-        // Until the initial ACK has been sent to the peer or
-        //  until all data staged for sending
+    // the same decision on_peer_ready makes: pending output goes first
+    if (peer_state->state == INITIAL_ACK || output_pending(peer_state)) {
         return fd_status_W;
     }
-    uint8_t buf[1024];
-    int nbytes = recv(sockfd, buf, sizeof(buf), 0);
-    if (nbytes == 0) {
-        // the peer disconnected
-        return fd_status_NORW;
-    } else if (nbytes < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            // the socket is not ready for recv. wait until it is
-            return fd_status_R;
-        }  else {
-            perror_die("recv");
-        }
+    return fd_status_R;
+}
+
+
+fd_status_t on_peer_connected(int sockfd, const struct sockaddr* peer_addr, socklen_t peer_addr_len)
+{
+    assert(sockfd < peer_table_size);
+    PROBE1(connected__entry, sockfd);
+    report_peer_connected(peer_addr, peer_addr_len);
+    METRIC_INC(conn_accepted);
+    peer_opened();
+
+    // Initialize state to send back a '*' to the peer imediately
+    peer_info_t* info = &peer_info[sockfd];
+    memset(info, 0, sizeof(*info));
+    info->addr_len = peer_addr_len < sizeof(info->addr) ? peer_addr_len : sizeof(info->addr);
+    memcpy(&info->addr, peer_addr, info->addr_len);
+    info->connected_ns = hist_now_ns();
+    if (capture) {
+        info->trace_conn = trace_conn_open(capture, peer_addr, info->addr_len);
     }
-    bool ready_to_send = false;
-    for (int i = 0; i < nbytes; ++i) {
+
+    peer_state_t* peer_state = &global_state[sockfd];
+    peer_state->open = true;
+    peer_state->interest = 0;
+    set_state(peer_state, INITIAL_ACK);
+    peer_state->sendbuf = sendbuf_lease(1);
+    peer_state->sendbuf->data[0] = '*';
+    peer_state->sendbuf->used = 1;
+    peer_state->sendbuf->end = 1;
+    peer_state->sendbuf->segs[peer_state->sendbuf->nsegs++] = (send_seg_t){0, 1};
+    peer_state->last_activity_ns = info->connected_ns;
+    peer_state->last_send_ns = peer_state->last_activity_ns;
+    peer_rearm(peer_state);
+    zerocopy_enable(sockfd);
+
+    // signal that this socket is ready for writing
+    PROBE1(connected__exit, sockfd);
+    return fd_status_W;
+}
+
+
+// Runs the received bytes data[start, end) of the peer's sendbuf through
+// the protocol, transforming reply bytes in place and queueing them. Data
+// starts with PEER_RECV_HEADROOM spare bytes so a frame header split across
+// two recvs can be put back together in front of its last part. Returns false
+// on a malformed frame.
+static bool parse_input(peer_state_t* peer_state, peer_info_t* info, int start, int end)
+{
+    sendbuf_t* sendbuf = peer_state->sendbuf;
+    uint8_t* data = sendbuf->data;
+    int i = start;
+    while (i < end) {
         switch (peer_state->state) {
-        case INITIAL_ACK:
-            assert(0 && "can't reach here");
+        case WAIT_FOR_MODE:
+            if (data[i] == FRAME_MAGIC) {
+                set_state(peer_state, WAIT_FOR_FRAME);
+                i++;
+            } else {
+                set_state(peer_state, WAIT_FOR_MSG);
+            }
             break;
-        
-        case WAIT_FOR_MSG:
-            if (buf[i] == '^') {
-                peer_state->state = IN_MSG;
+
+        case WAIT_FOR_MSG: {
+            uint8_t* open = memchr(&data[i], '^', end - i);
+            if (open == NULL) {
+                return true;
             }
+            set_state(peer_state, IN_MSG);
+            peer_state->msg_start_ns = hist_now_ns();
+            i = open - data + 1;
             break;
-        
-        case IN_MSG:
-            if (buf[i] == '$') {
-                peer_state->state = WAIT_FOR_MSG;
-            } else {
-                assert(peer_state->sendbuf_end < SENDBUF_SIZE);
-                peer_state->sendbuf[peer_state->sendbuf_end++] = buf[i] + 1;
-                ready_to_send = true;
+        }
+
+        case IN_MSG: {
+            uint8_t* close = memchr(&data[i], '$', end - i);
+            int stop = close ? close - data : end;
+            transform_bytes(&data[i], stop - i);
+            sendbuf_queue(sendbuf, i, stop);
+            if (close == NULL) {
+                return true;
             }
+            set_state(peer_state, WAIT_FOR_MSG);
+            message_done(peer_state);
+            i = stop + 1;
+            break;
+        }
+
+        case WAIT_FOR_FRAME:
+            set_state(peer_state, IN_FRAME_HEADER);
+            peer_state->msg_start_ns = hist_now_ns();
+            info->header_len = 0;
             break;
 
+        case IN_FRAME_HEADER: {
+            int take = sizeof(frame_header_t) - info->header_len;
+            if (take > end - i) {
+                take = end - i;
+            }
+            memcpy((uint8_t*)&info->header + info->header_len, &data[i], take);
+            info->header_len += take;
+            i += take;
+            if (info->header_len < sizeof(frame_header_t)) {
+                return true;
+            }
+            const frame_header_t* header = &info->header;
+            uint32_t len = ntohl(header->len);
+            if (header->type != FRAME_DATA || header->reserved[0] || header->reserved[1] ||
+                header->reserved[2] || len > FRAME_MAX_LEN) {
+                return false;
+            }
+            // the reply header is the request's; rebuild it in front of i if
+            // part of it came with the previous recv
+            memcpy(&data[i - sizeof(frame_header_t)], header, sizeof(frame_header_t));
+            sendbuf_queue(sendbuf, i - sizeof(frame_header_t), i);
+            info->frame_left = len;
+            set_state(peer_state, IN_FRAME);
+            break;
+        }
+
+        case IN_FRAME: {
+            int take = info->frame_left < (uint32_t)(end - i) ? (int)info->frame_left : end - i;
+            transform_bytes(&data[i], take);
+            sendbuf_queue(sendbuf, i, i + take);
+            info->frame_left -= take;
+            i += take;
+            break;
+        }
+
         default:
+            assert(0 && "can't reach here");
             break;
         }
+        if (peer_state->state == IN_FRAME && info->frame_left == 0) {
+            set_state(peer_state, WAIT_FOR_FRAME);
+            message_done(peer_state);
+        }
+    }
+    return true;
+}
+
+
+// Runs the protocol on a blocking socket until the peer disconnects or an I/O
+// error ends the connection. Uses the same parser as the event loops, with
+// a buffer of its own: the pool belongs to the event loop's thread.
+static void serve_messages(int sockfd) {
+    /* Client attempting to connect and send data will succeed even before the
+     * the connection is accept()-ed by the server. Therefore, to better simulate
+     * blocking of other clients while one is being served, do this 'ack' from
+     * the server which the client expects to see before proceeding. */
+    METRIC_INC(send_calls);
+    if (send(sockfd, "*", 1, MSG_NOSIGNAL) < 1) {
+        peer_io_error(sockfd, "send", errno);
+        return;
+    }
+    METRIC_INC(bytes_out);
+
+    uint8_t storage[PEER_RECV_LEASE] __attribute__((aligned(16)));
+    sendbuf_t* sendbuf = (sendbuf_t*)storage;
+    peer_state_t peer_state = {.state = WAIT_FOR_MODE, .sendbuf = sendbuf};
+    peer_info_t info = {0};
+
+    while (1) {
+        memset(sendbuf, 0, sizeof(*sendbuf));
+        sendbuf->size = sizeof(storage) - sizeof(sendbuf_t);
+        int len = recv(sockfd, &sendbuf->data[PEER_RECV_HEADROOM],
+                       sendbuf->size - PEER_RECV_HEADROOM, 0);
+        METRIC_INC(recv_calls);
+        if (len < 0) {
+            peer_io_error(sockfd, "recv", errno);
+            return;
+        } else if (len == 0) {
+            return;
+        }
+        METRIC_ADD(bytes_in, len);
+        sendbuf->used = PEER_RECV_HEADROOM + len;
+
+        if (!parse_input(&peer_state, &info, PEER_RECV_HEADROOM, sendbuf->used)) {
+            LOG_DEBUG("socket %d: malformed frame", sockfd);
+            METRIC_INC(conn_protocol_errors);
+            return;
+        }
+        while (sendbuf->ptr < sendbuf->end) {
+            struct iovec iov[PEER_SEND_SEGS];
+            struct msghdr mh = {.msg_iov = iov, .msg_iovlen = sendbuf_iov(sendbuf, iov)};
+            int nsent = sendmsg(sockfd, &mh, MSG_NOSIGNAL);
+            METRIC_INC(send_calls);
+            if (nsent < 0) {
+                peer_io_error(sockfd, "send", errno);
+                return;
+            }
+            METRIC_ADD(bytes_out, nsent);
+            sendbuf_consume(sendbuf, nsent);
+            messages_sent(sendbuf);
+        }
+    }
+}
+
+
+void serve_connection(int sockfd) {
+    METRIC_INC(conn_accepted);
+    peer_opened();
+    serve_messages(sockfd);
+    METRIC_INC(conn_closed);
+    close(sockfd);
+    peer_released();
+    PROBE1(conn__close, sockfd);
+}
+
+
+// One recv and the replies it produces; *nmoved is the number of bytes read.
+// *more is cleared unless the read filled the buffer, i.e. unless the socket
+// probably has more.
+static fd_status_t peer_recv(int sockfd, int* nmoved, bool* more)
+{
+    peer_state_t* peer_state = &global_state[sockfd];
+    *more = false;
+    // Receive straight into the buffer the reply will be sent from; each
+    // message's bytes are transformed where they are and sent from there.
+    sendbuf_t* sendbuf = peer_state->sendbuf = sendbuf_lease(PEER_RECV_LEASE - sizeof(sendbuf_t));
+    int room = sendbuf->size - PEER_RECV_HEADROOM;
+    int nbytes = recv(sockfd, &sendbuf->data[PEER_RECV_HEADROOM], room, 0);
+    METRIC_INC(recv_calls);
+    if (nbytes <= 0) {
+        sendbuf_release(peer_state);
+        if (nbytes == 0) {
+            // the peer disconnected
+            return fd_status_NORW;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // the socket is not ready for recv. wait until it is
+            METRIC_INC(eagain);
+            return fd_status_R;
+        }
+        peer_io_error(sockfd, "recv", errno);
+        return fd_status_NORW;
     }
-    
+    METRIC_ADD(bytes_in, nbytes);
+    if (capture && peer_info[sockfd].trace_conn) {
+        trace_conn_data(capture, peer_info[sockfd].trace_conn,
+                        &sendbuf->data[PEER_RECV_HEADROOM], nbytes);
+    }
+    sendbuf->used = PEER_RECV_HEADROOM + nbytes;
+    *nmoved = nbytes;
+    *more = nbytes == room;
+    peer_state->last_activity_ns = hist_now_ns();
+
+    if (!parse_input(peer_state, &peer_info[sockfd], PEER_RECV_HEADROOM, sendbuf->used)) {
+        LOG_DEBUG("socket %d: malformed frame", sockfd);
+        METRIC_INC(conn_protocol_errors);
+        sendbuf_release(peer_state);
+        return fd_status_NORW;
+    }
+    bool ready_to_send = sendbuf->end > 0;
+    if (ready_to_send) {
+        // sendbuf was empty before this recv; the write-stall clock starts now
+        peer_state->last_send_ns = peer_state->last_activity_ns;
+    } else {
+        sendbuf_release(peer_state);
+    }
+    peer_rearm(peer_state);
+
     return (fd_status_t) {.want_read = !ready_to_send,
                           .want_write = ready_to_send};
 }
 
-fd_status_t on_peer_ready_send(int sockfd)
+// One sendmsg of everything queued; *nmoved is the number of bytes sent.
+static fd_status_t peer_send(int sockfd, int* nmoved)
 {
-    assert(sockfd < MAXFDS);
     peer_state_t* peer_state = &global_state[sockfd];
 
-    if (peer_state->sendptr >= peer_state->sendbuf_end) {
+    sendbuf_t* sendbuf = peer_state->sendbuf;
+    if (sendbuf == NULL) {
         // nothing to send
         return fd_status_RW;
     }
-    int send_len = peer_state->sendbuf_end - peer_state->sendptr;
-    int nsent = send(sockfd, &peer_state->sendbuf[peer_state->sendptr], send_len, 0);
+    struct iovec iov[PEER_SEND_SEGS];
+    struct msghdr mh = {.msg_iov = iov, .msg_iovlen = sendbuf_iov(sendbuf, iov)};
+    int send_len = sendbuf->end - sendbuf->ptr;
+    int flags = MSG_NOSIGNAL;
+    if (zerocopy_min && send_len >= zerocopy_min && peer_info[sockfd].zc_enabled) {
+        flags |= MSG_ZEROCOPY;
+    }
+    int nsent = sendmsg(sockfd, &mh, flags);
+    if (nsent == -1 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+        // over the socket's optmem limit for pinned pages; copy this time
+        flags &= ~MSG_ZEROCOPY;
+        nsent = sendmsg(sockfd, &mh, flags);
+    }
+    METRIC_INC(send_calls);
     if (nsent == -1) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            METRIC_INC(eagain);
             return fd_status_W;
-        } else {
-            perror_die("send");
         }
+        peer_io_error(sockfd, "send", errno);
+        return fd_status_NORW;
+    }
+    METRIC_ADD(bytes_out, nsent);
+    *nmoved = nsent;
+    if ((flags & MSG_ZEROCOPY) && nsent > 0) {
+        METRIC_INC(zerocopy_sends);
+        sendbuf->zc_used = true;
+        sendbuf->zc_seq = peer_info[sockfd].zc_sent++;
+    }
+
+    sendbuf_consume(sendbuf, nsent);
+    messages_sent(sendbuf);
+    if (nsent > 0) {
+        peer_state->last_activity_ns = hist_now_ns();
+        peer_state->last_send_ns = peer_state->last_activity_ns;
     }
 
     if (nsent < send_len) {
-        peer_state->sendptr += nsent;
+        peer_rearm(peer_state);
         return fd_status_W;
     } else {
-        // everything was sent successfully, reset the send queue
-        peer_state->sendptr = 0;
-        peer_state->sendbuf_end = 0;
+        // everything was sent successfully, give the buffer back
+        sendbuf_release(peer_state);
 
         // special case state transition in if we ware in INITAL_ACK until now
         if (peer_state->state == INITIAL_ACK) {
-            peer_state->state = WAIT_FOR_MSG;
+            set_state(peer_state, WAIT_FOR_MODE);
         }
+        peer_rearm(peer_state);
 
         return fd_status_R;
     }
-}
\ No newline at end of file
+}
+
+
+// on_peer_ready without the probes; adds the bytes it moves to *nin, *nout.
+static fd_status_t peer_ready(int sockfd, bool readable, bool* exhausted, int* nin, int* nout)
+{
+    peer_state_t* peer_state = &global_state[sockfd];
+    *exhausted = false;
+
+    if (zerocopy_min && peer_info[sockfd].zc_done != peer_info[sockfd].zc_sent) {
+        // select reports queued completions as readable
+        zerocopy_reap(sockfd);
+    }
+
+    // Alternate sending what is queued and reading more, so a reply usually
+    // leaves in the turn its request arrived. Without a hint that there is
+    // input, a recv would mostly buy an EAGAIN.
+    bool may_recv = readable;
+    int budget = PEER_IO_BUDGET;
+    while (1) {
+        int nmoved = 0;
+        bool sending = peer_state->state == INITIAL_ACK || output_pending(peer_state);
+        fd_status_t status;
+        if (sending) {
+            // Until the initial ACK has been sent to the peer or
+            //  until all data staged for sending
+            status = peer_send(sockfd, &nmoved);
+        } else if (may_recv) {
+            status = peer_recv(sockfd, &nmoved, &may_recv);
+        } else {
+            return fd_status_R;
+        }
+        *(sending ? nout : nin) += nmoved;
+        if (nmoved == 0 || (!status.want_read && !status.want_write) ||
+            (sending && output_pending(peer_state))) {
+            // would block, closed, failed, or the socket buffer is full
+            return status;
+        }
+        budget -= nmoved;
+        if (budget <= 0) {
+            *exhausted = output_pending(peer_state) || may_recv;
+            return status;
+        }
+    }
+}
+
+
+fd_status_t on_peer_ready(int sockfd, bool readable, bool* exhausted)
+{
+    assert(sockfd < peer_table_size);
+    PROBE2(ready__entry, sockfd, readable);
+    int nin = 0;
+    int nout = 0;
+    fd_status_t status = peer_ready(sockfd, readable, exhausted, &nin, &nout);
+    PROBE5(ready__exit, sockfd, nin, nout, status.want_read, status.want_write);
+    return status;
+}
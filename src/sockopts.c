@@ -0,0 +1,128 @@
+#include "sockopts.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "log.h"
+
+#define SOCK_MAX_LISTENERS  16
+
+static const sock_profile_t profiles[] = {
+    {.name = "default", .nodelay = true},
+    {.name = "low-latency", .nodelay = true, .quickack = true, .busy_poll_us = 50,
+     .fastopen_qlen = 256},
+    {.name = "bulk-throughput", .sndbuf = 4 << 20, .rcvbuf = 4 << 20},
+    {.name = "many-idle", .nodelay = true, .sndbuf = 16384, .rcvbuf = 16384,
+     .keepalive_idle_s = 60, .backlog = 4096},
+};
+
+#define NUM_PROFILES        (int)(sizeof(profiles) / sizeof(profiles[0]))
+
+// Which profile each listener was set up with; written before serving starts
+static struct {
+    int sockfd;
+    bool tcp;
+    const sock_profile_t* profile;
+} listeners[SOCK_MAX_LISTENERS];
+static int nlisteners;
+
+
+const sock_profile_t* sock_profile_find(const char* name) {
+    for (int i = 0; i < NUM_PROFILES; i++) {
+        if (strcmp(profiles[i].name, name) == 0) {
+            return &profiles[i];
+        }
+    }
+    return NULL;
+}
+
+
+const char* sock_profile_names(void) {
+    return "default, low-latency, bulk-throughput, many-idle";
+}
+
+
+static bool set_int(int sockfd, int level, int option, const char* what, int value) {
+    if (setsockopt(sockfd, level, option, &value, sizeof(value)) < 0) {
+        LOG_WARN("socket %d: %s=%d: %s", sockfd, what, value, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+
+void sock_profile_listener(int listener_sockfd, const sock_profile_t* p) {
+    int domain = AF_UNSPEC;
+    socklen_t len = sizeof(domain);
+    getsockopt(listener_sockfd, SOL_SOCKET, SO_DOMAIN, &domain, &len);
+    bool tcp = domain == AF_INET || domain == AF_INET6;
+
+    if (p->nodelay && tcp) {
+        set_int(listener_sockfd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", 1);
+    }
+    if (p->sndbuf) {
+        set_int(listener_sockfd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", p->sndbuf);
+    }
+    if (p->rcvbuf) {
+        // the window scale offered in the SYN-ACK comes from the listener's
+        // buffer, so it has to be large before connections arrive
+        set_int(listener_sockfd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", p->rcvbuf);
+    }
+    if (p->busy_poll_us && tcp) {
+        set_int(listener_sockfd, SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL", p->busy_poll_us);
+    }
+    if (p->fastopen_qlen && tcp) {
+        set_int(listener_sockfd, IPPROTO_TCP, TCP_FASTOPEN, "TCP_FASTOPEN", p->fastopen_qlen);
+    }
+    if (p->keepalive_idle_s && tcp &&
+        set_int(listener_sockfd, SOL_SOCKET, SO_KEEPALIVE, "SO_KEEPALIVE", 1)) {
+        set_int(listener_sockfd, IPPROTO_TCP, TCP_KEEPIDLE, "TCP_KEEPIDLE", p->keepalive_idle_s);
+    }
+    // listen() again on a listening socket only changes its backlog
+    if (p->backlog && listen(listener_sockfd, p->backlog) < 0) {
+        LOG_WARN("socket %d: backlog %d: %s", listener_sockfd, p->backlog, strerror(errno));
+    }
+
+    for (int i = 0; i < nlisteners; i++) {
+        if (listeners[i].sockfd == listener_sockfd) {
+            listeners[i].tcp = tcp;
+            listeners[i].profile = p;
+            return;
+        }
+    }
+    if (nlisteners == SOCK_MAX_LISTENERS) {
+        LOG_WARN("socket %d: more than %d listeners, accepted sockets get the default profile",
+                 listener_sockfd, SOCK_MAX_LISTENERS);
+        return;
+    }
+    listeners[nlisteners].sockfd = listener_sockfd;
+    listeners[nlisteners].tcp = tcp;
+    listeners[nlisteners].profile = p;
+    nlisteners++;
+    LOG_INFO("socket %d: socket profile %s", listener_sockfd, p->name);
+}
+
+
+void sock_profile_accepted(int listener_sockfd, int sockfd) {
+    const sock_profile_t* p = NULL;
+    bool tcp = true;
+    for (int i = 0; i < nlisteners; i++) {
+        if (listeners[i].sockfd == listener_sockfd) {
+            p = listeners[i].profile;
+            tcp = listeners[i].tcp;
+            break;
+        }
+    }
+    if (p == NULL) {
+        // a listener set up without a profile passed nothing on; the default
+        // profile is TCP_NODELAY alone
+        set_int(sockfd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", 1);
+        return;
+    }
+    if (p->quickack && tcp) {
+        set_int(sockfd, IPPROTO_TCP, TCP_QUICKACK, "TCP_QUICKACK", 1);
+    }
+}
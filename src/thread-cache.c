@@ -0,0 +1,174 @@
+#include "thread-cache.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "metrics.h"
+
+// A thread's handoff slot. The acceptor fills fn/arg of a parked worker and
+// signals that worker's own condition, so a handoff wakes exactly one thread.
+typedef struct worker {
+    struct worker* next;                    /* idle stack link */
+    pthread_cond_t wake;
+    void (*fn)(void* arg);
+    void* arg;
+    thread_cache_t* cache;
+} worker_t;
+
+struct thread_cache {
+    pthread_mutex_t lock;
+    pthread_cond_t room;                    /* a thread finished while at max_threads */
+    pthread_attr_t attr;
+    worker_t* idle;                         /* LIFO: the most recently used stack is warmest */
+    int nidle;
+    int alive;
+    int waiting;                            /* callers blocked in thread_cache_run */
+    int max_threads;
+    int max_idle;
+    unsigned long created;
+    unsigned long reused;
+    unsigned long waits;
+};
+
+
+static size_t round_to_page(size_t n) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (n + page - 1) / page * page;
+}
+
+
+static void* worker_main(void* arg) {
+    worker_t* w = (worker_t*)arg;
+    thread_cache_t* tc = w->cache;
+
+    pthread_mutex_lock(&tc->lock);
+    while (1) {
+        while (w->fn == NULL) {
+            pthread_cond_wait(&w->wake, &tc->lock);
+        }
+        void (*fn)(void*) = w->fn;
+        void* fn_arg = w->arg;
+        w->fn = NULL;
+        pthread_mutex_unlock(&tc->lock);
+
+        fn(fn_arg);
+
+        pthread_mutex_lock(&tc->lock);
+        if (tc->nidle < tc->waiting || tc->nidle < tc->max_idle) {
+            // park; a blocked caller with no parked thread yet takes this one
+            w->next = tc->idle;
+            tc->idle = w;
+            tc->nidle++;
+            if (tc->waiting > 0) {
+                pthread_cond_signal(&tc->room);
+            }
+            continue;
+        }
+        tc->alive--;
+        if (tc->waiting > 0) {
+            // the freed slot is room too
+            pthread_cond_signal(&tc->room);
+        }
+        pthread_mutex_unlock(&tc->lock);
+        break;
+    }
+
+    pthread_cond_destroy(&w->wake);
+    free(w);
+    return NULL;
+}
+
+
+thread_cache_t* thread_cache_create(const thread_cache_config_t* config) {
+    thread_cache_t* tc = calloc(1, sizeof(*tc));
+    if (tc == NULL) {
+        return NULL;
+    }
+    size_t stack = config->stack_size ? config->stack_size : THREAD_CACHE_DEFAULT_STACK;
+    pthread_attr_init(&tc->attr);
+    pthread_attr_setdetachstate(&tc->attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_attr_setstacksize(&tc->attr, round_to_page(stack)) != 0 ||
+        pthread_attr_setguardsize(&tc->attr, round_to_page(config->guard_size)) != 0) {
+        pthread_attr_destroy(&tc->attr);
+        free(tc);
+        return NULL;
+    }
+    pthread_mutex_init(&tc->lock, NULL);
+    pthread_cond_init(&tc->room, NULL);
+    tc->max_threads = config->max_threads > 0 ? config->max_threads : INT_MAX;
+    tc->max_idle = config->max_idle;
+    return tc;
+}
+
+
+int thread_cache_run(thread_cache_t* tc, void (*fn)(void* arg), void* arg) {
+    pthread_mutex_lock(&tc->lock);
+    if (tc->idle == NULL && tc->alive >= tc->max_threads) {
+        tc->waits++;
+        METRIC_INC(thread_cache_waits);
+        tc->waiting++;
+        while (tc->idle == NULL && tc->alive >= tc->max_threads) {
+            pthread_cond_wait(&tc->room, &tc->lock);
+        }
+        tc->waiting--;
+    }
+
+    worker_t* w = tc->idle;
+    if (w != NULL) {
+        tc->idle = w->next;
+        tc->nidle--;
+        tc->reused++;
+        w->fn = fn;
+        w->arg = arg;
+        pthread_cond_signal(&w->wake);
+        pthread_mutex_unlock(&tc->lock);
+        METRIC_INC(thread_cache_reused);
+        return 0;
+    }
+
+    // reserve the slot before unlocking so concurrent callers respect the cap
+    tc->alive++;
+    tc->created++;
+    pthread_mutex_unlock(&tc->lock);
+
+    w = calloc(1, sizeof(*w));
+    if (w != NULL) {
+        pthread_cond_init(&w->wake, NULL);
+        w->fn = fn;
+        w->arg = arg;
+        w->cache = tc;
+        pthread_t thread;
+        int err = pthread_create(&thread, &tc->attr, worker_main, w);
+        if (err == 0) {
+            METRIC_INC(thread_cache_created);
+            return 0;
+        }
+        LOG_ERROR("thread cache: pthread_create: %s", strerror(err));
+        pthread_cond_destroy(&w->wake);
+        free(w);
+    }
+
+    pthread_mutex_lock(&tc->lock);
+    tc->alive--;
+    tc->created--;
+    if (tc->waiting > 0) {
+        pthread_cond_signal(&tc->room);
+    }
+    pthread_mutex_unlock(&tc->lock);
+    return -1;
+}
+
+
+void thread_cache_stats(thread_cache_t* tc, thread_cache_stats_t* out) {
+    pthread_mutex_lock(&tc->lock);
+    out->alive = tc->alive;
+    out->idle = tc->nidle;
+    out->created = tc->created;
+    out->reused = tc->reused;
+    out->waits = tc->waits;
+    pthread_mutex_unlock(&tc->lock);
+}
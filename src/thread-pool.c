@@ -5,9 +5,13 @@
 #include <errno.h>
 #include <sys/prctl.h>
 #include <signal.h>
+#include <string.h>
 #include <time.h>
 
 #include "thread-pool.h"
+#include "metrics.h"
+#include "log.h"
+#include "probes.h"
 
 #ifdef THPOOL_DEBUG
 #define THPOOL_DEBUG 1
@@ -21,6 +25,9 @@
 #define err(str)
 #endif
 
+/* jobqueue_push: the pool is being destroyed */
+#define JOBQUEUE_CLOSED -2
+
 /**************************** LOCAL VARIABLES ********************************/
 static volatile int threads_keep_alive;
 static volatile int threads_on_hold;
@@ -35,14 +42,14 @@ static void thread_destroy(thread* thread_p);
 // Job queue functions
 static int jobqueue_init(jobqueue * jobqueue_p);
 static job* jobqueue_pull(jobqueue* jobqueue_p);
-static void jobqueue_push(jobqueue* jobqueue_p, struct job* newjob);
+static int jobqueue_push(jobqueue* jobqueue_p, struct job* newjob);
 static void jobqueue_destroy(jobqueue* jobqueue_p);
 static void jobqueue_clear(jobqueue* jobqueue_p);
 
 // Semaphore functions
 static void bsem_init(bsem* bsem_p, int value);
 static void bsem_reset(bsem* bsem_p);
-static void bsem_wait(bsem* bsem_p);
+static int bsem_wait(bsem* bsem_p);
 static void bsem_post(bsem* bsem_p);
 static void bsem_post_all(bsem *bsem_p);
 
@@ -73,6 +80,7 @@ threadpool_* threadpool_init(int num_threads)
     }
     l_thpool_p->num_threads_alive = 0;
     l_thpool_p->num_threads_working = 0;
+    l_thpool_p->num_threads = num_threads;
 
     /* Init job queue */
     if(jobqueue_init(&l_thpool_p->jobqueue) == -1) {
@@ -97,7 +105,7 @@ threadpool_* threadpool_init(int num_threads)
     /* Thread init */
     for (int n = 0; n < num_threads; n++) {
         thread_init(l_thpool_p, &l_thpool_p->threads[n], n);
-        printf("threadpool_init(): Created thread %d in pool\n", n);
+        LOG_DEBUG("threadpool_init(): Created thread %d in pool", n);
     }
 
     /* wait for thread initialized */
@@ -108,14 +116,37 @@ threadpool_* threadpool_init(int num_threads)
 }
 
 
+/**
+ * @brief Bounds the job queue. Until called the queue is unbounded.
+ *
+ * @param pool_p            The threadpool to bound
+ * @param capacity          Most jobs waiting for a worker; 0 removes the bound
+ * @param overflow          What threadpool_add_work does when the queue is full
+ *
+ * @return                  Nothing
+ */
+void threadpool_set_queue_limit(threadpool_* thpool_p, int capacity, threadpool_overflow_t overflow)
+{
+    pthread_mutex_lock(&thpool_p->jobqueue.mutex);
+    thpool_p->jobqueue.capacity = capacity > 0 ? capacity : 0;
+    thpool_p->jobqueue.overflow = overflow;
+    /* a raised or removed bound frees blocked producers */
+    pthread_cond_broadcast(&thpool_p->jobqueue.has_room);
+    pthread_mutex_unlock(&thpool_p->jobqueue.mutex);
+}
+
+
 /**
  * @brief Take an action and its argument and adds it to the threadpool's job queue.
+ *        With a full bounded queue it blocks, rejects or runs the job itself,
+ *        as set by threadpool_set_queue_limit.
  * 
  * @param pool_p            Threadpool to which the work will be added
  * @param function_p        Pointer to function to add as work
  * @param arg_p             Pointer to an argument of function as work
  * 
- * @return int              0 on success, -1 otherwise
+ * @return int              0 when queued or run, THREADPOOL_REJECTED when the
+ *                          full queue rejected it, -1 on error
  */
 int threadpool_add_work(threadpool_* thpool_p, void (*function_p)(void*), void* arg_p)
 {
@@ -130,14 +161,54 @@ int threadpool_add_work(threadpool_* thpool_p, void (*function_p)(void*), void*
     /* add function and argument */
     newjob->function = function_p;
     newjob->arg = arg_p;
+    newjob->enqueue_ns = hist_now_ns();
 
     /* add job to queue */
-    jobqueue_push(&thpool_p->jobqueue, newjob);
+    int pushed = jobqueue_push(&thpool_p->jobqueue, newjob);
+    if (pushed == JOBQUEUE_CLOSED) {
+        free(newjob);
+        METRIC_INC(pool_jobs_rejected);
+        return THREADPOOL_REJECTED;
+    }
+    if (pushed != 0) {
+        /* full, and the policy is not to wait */
+        PROBE2(job__overflow, thpool_p->jobqueue.capacity, thpool_p->jobqueue.overflow);
+        free(newjob);
+        if (thpool_p->jobqueue.overflow == THREADPOOL_CALLER_RUNS) {
+            METRIC_INC(pool_caller_runs);
+            function_p(arg_p);
+            return 0;
+        }
+        METRIC_INC(pool_jobs_rejected);
+        return THREADPOOL_REJECTED;
+    }
+    METRIC_INC(pool_jobs_queued);
     
     return 0;
 }
 
 
+/**
+ * @brief How long the oldest queued job has been waiting for a worker.
+ *        An acceptor can stop accepting while this is high and leave new
+ *        connections to the kernel's listen queue.
+ *
+ * @param pool_p            The threadpool to look at
+ *
+ * @return uint64_t         Nanoseconds; 0 when no job is waiting
+ */
+uint64_t threadpool_queue_wait_ns(threadpool_* thpool_p)
+{
+    uint64_t wait_ns = 0;
+    pthread_mutex_lock(&thpool_p->jobqueue.mutex);
+    if (thpool_p->jobqueue.front) {
+        wait_ns = hist_now_ns() - thpool_p->jobqueue.front->enqueue_ns;
+    }
+    pthread_mutex_unlock(&thpool_p->jobqueue.mutex);
+    return wait_ns;
+}
+
+
 /**
  * @brief Construct a new threadpool wait object.
  *        Wait for all queued jobs to finish
@@ -171,6 +242,12 @@ void threadpool_destroy(threadpool_* thpool_p) {
 
     volatile int threads_total = thpool_p->num_threads_alive;
 
+    /* Refuse new jobs and release producers blocked on a full queue */
+    pthread_mutex_lock(&thpool_p->jobqueue.mutex);
+    thpool_p->jobqueue.shutting_down = 1;
+    pthread_cond_broadcast(&thpool_p->jobqueue.has_room);
+    pthread_mutex_unlock(&thpool_p->jobqueue.mutex);
+
     /* End each thread's to kill idle threads */
     threads_keep_alive = 0;
 
@@ -248,7 +325,68 @@ void threadpool_resume(threadpool_* thpool_p)
  */
 int threadpool_threads_working(threadpool_* thpool_p)
 {
-    return thpool_p->num_threads_working;
+    pthread_mutex_lock(&thpool_p->count_lock);
+    int working = thpool_p->num_threads_working;
+    pthread_mutex_unlock(&thpool_p->count_lock);
+    return working;
+}
+
+
+/**
+ * @brief Snapshot of the pool's counters, taken without stopping workers.
+ *        Time a worker has spent in its current job or wait so far is
+ *        included, so idle workers show up as idle before they wake.
+ *
+ * @param pool_p            The threadpool to look at
+ * @param stats_p           Filled with pool-wide values and per-worker totals
+ * @param workers_p         If not NULL, filled with each worker's counters
+ * @param max_workers       Room in workers_p
+ *
+ * @return int              Number of workers, which may exceed max_workers
+ */
+int threadpool_stats(threadpool_* thpool_p, threadpool_stats_t* stats_p,
+                     threadpool_worker_stats_t* workers_p, int max_workers)
+{
+    memset(stats_p, 0, sizeof(*stats_p));
+    pthread_mutex_lock(&thpool_p->count_lock);
+    stats_p->threads_alive = thpool_p->num_threads_alive;
+    stats_p->threads_working = thpool_p->num_threads_working;
+    pthread_mutex_unlock(&thpool_p->count_lock);
+
+    pthread_mutex_lock(&thpool_p->jobqueue.mutex);
+    stats_p->queue_len = thpool_p->jobqueue.len;
+    stats_p->queue_high_water = thpool_p->jobqueue.high_water;
+    pthread_mutex_unlock(&thpool_p->jobqueue.mutex);
+    stats_p->oldest_wait_ns = threadpool_queue_wait_ns(thpool_p);
+
+    uint64_t now = hist_now_ns();
+    for (int n = 0; n < thpool_p->num_threads; n++) {
+        const threadpool_worker_stats_t* w = &thpool_p->threads[n]->stats;
+        threadpool_worker_stats_t snap;
+        snap.jobs = __atomic_load_n(&w->jobs, __ATOMIC_RELAXED);
+        snap.busy_ns = __atomic_load_n(&w->busy_ns, __ATOMIC_RELAXED);
+        snap.idle_ns = __atomic_load_n(&w->idle_ns, __ATOMIC_RELAXED);
+        snap.parks = __atomic_load_n(&w->parks, __ATOMIC_RELAXED);
+        snap.empty_wakeups = __atomic_load_n(&w->empty_wakeups, __ATOMIC_RELAXED);
+        snap.busy_since_ns = __atomic_load_n(&w->busy_since_ns, __ATOMIC_RELAXED);
+        snap.idle_since_ns = __atomic_load_n(&w->idle_since_ns, __ATOMIC_RELAXED);
+        /* the stamp may be a hair newer than now */
+        if (snap.busy_since_ns && snap.busy_since_ns < now) {
+            snap.busy_ns += now - snap.busy_since_ns;
+        }
+        if (snap.idle_since_ns && snap.idle_since_ns < now) {
+            snap.idle_ns += now - snap.idle_since_ns;
+        }
+        if (workers_p && n < max_workers) {
+            workers_p[n] = snap;
+        }
+        stats_p->total.jobs += snap.jobs;
+        stats_p->total.busy_ns += snap.busy_ns;
+        stats_p->total.idle_ns += snap.idle_ns;
+        stats_p->total.parks += snap.parks;
+        stats_p->total.empty_wakeups += snap.empty_wakeups;
+    }
+    return thpool_p->num_threads;
 }
 
 
@@ -257,11 +395,12 @@ int threadpool_threads_working(threadpool_* thpool_p)
 /* Initialize thread in thread pool */
 static int thread_init(threadpool_* thpool_p, thread** thread_p, int id)
 {
-    *thread_p = (struct thread*)malloc(sizeof(struct thread));
-    if (*thread_p == NULL) {
+    /* whole cache lines, so the stats share a line with no other thread's */
+    if (posix_memalign((void**)thread_p, 64, sizeof(struct thread)) != 0) {
         err("thread_init(): Could not allocate memory for thread\n");
         return -1;
     }
+    memset(*thread_p, 0, sizeof(struct thread));
 
     (*thread_p)->thpool_p = thpool_p;
     (*thread_p)->id       = id;
@@ -272,6 +411,13 @@ static int thread_init(threadpool_* thpool_p, thread** thread_p, int id)
 }
 
 
+/* Adds n to a counter of the calling worker; it is the only writer */
+static inline void worker_stat_add(uint64_t* counter, uint64_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+
 /* What thread is doing */
 static void* thread_do(struct thread* thread_p)
 {
@@ -298,9 +444,17 @@ static void* thread_do(struct thread* thread_p)
     l_thpool_p->num_threads_alive++;
     pthread_mutex_unlock(&l_thpool_p->count_lock);
 
+    /* the clock is read twice per job, as before the stats: the wait ends
+     * when the job starts and the next wait starts when the job ends */
+    threadpool_worker_stats_t* stats = &thread_p->stats;
+    uint64_t now_ns = hist_now_ns();
     while (threads_keep_alive) {
         /* waiting until has job */
-        bsem_wait(l_thpool_p->jobqueue.has_jobs);
+        uint64_t wait_ns = now_ns;
+        __atomic_store_n(&stats->idle_since_ns, wait_ns, __ATOMIC_RELAXED);
+        if (bsem_wait(l_thpool_p->jobqueue.has_jobs)) {
+            worker_stat_add(&stats->parks, 1);
+        }
         
         if (threads_keep_alive) {
             pthread_mutex_lock(&l_thpool_p->count_lock);
@@ -311,12 +465,28 @@ static void* thread_do(struct thread* thread_p)
             void (*func_buff)(void *);
             void* arg_buff;
             job* job_p = jobqueue_pull(&l_thpool_p->jobqueue);
+            uint64_t start_ns = now_ns = hist_now_ns();
+            __atomic_store_n(&stats->idle_since_ns, 0, __ATOMIC_RELAXED);
+            worker_stat_add(&stats->idle_ns, start_ns - wait_ns);
             if (job_p) {
                 func_buff = job_p->function;
                 arg_buff = job_p->arg;
+                __atomic_store_n(&stats->busy_since_ns, start_ns, __ATOMIC_RELAXED);
+                METRIC_HIST_RECORD(pool_queue_wait, start_ns - job_p->enqueue_ns);
+                PROBE2(job__start, job_p, start_ns - job_p->enqueue_ns);
                 /* execute job */
                 func_buff(arg_buff);
+                now_ns = hist_now_ns();
+                uint64_t run_ns = now_ns - start_ns;
+                METRIC_HIST_RECORD(pool_run_time, run_ns);
+                PROBE2(job__end, job_p, run_ns);
+                __atomic_store_n(&stats->busy_since_ns, 0, __ATOMIC_RELAXED);
+                worker_stat_add(&stats->busy_ns, run_ns);
+                worker_stat_add(&stats->jobs, 1);
                 free(job_p);
+                METRIC_INC(pool_jobs_done);
+            } else {
+                worker_stat_add(&stats->empty_wakeups, 1);
             }
 
             pthread_mutex_lock(&l_thpool_p->count_lock);
@@ -360,8 +530,13 @@ static void thread_destroy(thread* thread_p)
 static int jobqueue_init(jobqueue * jobqueue_p)
 {
     jobqueue_p->len = 0;
+    jobqueue_p->high_water = 0;
     jobqueue_p->front = NULL;
     jobqueue_p->rear = NULL;
+    jobqueue_p->capacity = 0;
+    jobqueue_p->overflow = THREADPOOL_BLOCK;
+    jobqueue_p->blocked = 0;
+    jobqueue_p->shutting_down = 0;
 
     jobqueue_p->has_jobs = (struct bsem*)malloc(sizeof(struct bsem));
     if (jobqueue_p->has_jobs == NULL) {
@@ -369,6 +544,7 @@ static int jobqueue_init(jobqueue * jobqueue_p)
     }
 
     pthread_mutex_init(&(jobqueue_p->mutex), NULL);
+    pthread_cond_init(&(jobqueue_p->has_room), NULL);
     bsem_init(jobqueue_p->has_jobs, 0);
 
     return 0;
@@ -400,6 +576,10 @@ static job* jobqueue_pull(jobqueue* jobqueue_p)
         bsem_post(jobqueue_p->has_jobs);
         break;
     }
+    if (l_job_p) {
+        pthread_cond_signal(&jobqueue_p->has_room);
+    }
+    METRIC_GAUGE_SET(pool_queue_depth, jobqueue_p->len);
 
     pthread_mutex_unlock(&jobqueue_p->mutex);
     
@@ -407,10 +587,33 @@ static job* jobqueue_pull(jobqueue* jobqueue_p)
 }
 
 
-/* add job to queue */
-static void jobqueue_push(jobqueue* jobqueue_p, struct job* newjob)
+/* add job to queue; returns -1, without queueing, if it is full and the policy is not to wait,
+ * and JOBQUEUE_CLOSED once the pool is being destroyed, even if it had to wait for room */
+static int jobqueue_push(jobqueue* jobqueue_p, struct job* newjob)
 {
     pthread_mutex_lock(&jobqueue_p->mutex);
+    if (!jobqueue_p->shutting_down && jobqueue_p->capacity &&
+        jobqueue_p->len >= jobqueue_p->capacity) {
+        if (jobqueue_p->overflow != THREADPOOL_BLOCK) {
+            pthread_mutex_unlock(&jobqueue_p->mutex);
+            return -1;
+        }
+        METRIC_INC(pool_submit_blocked);
+        jobqueue_p->blocked++;
+        while (!jobqueue_p->shutting_down &&
+               jobqueue_p->capacity && jobqueue_p->len >= jobqueue_p->capacity) {
+            pthread_cond_wait(&jobqueue_p->has_room, &jobqueue_p->mutex);
+        }
+        jobqueue_p->blocked--;
+        if (jobqueue_p->shutting_down && jobqueue_p->blocked == 0) {
+            /* jobqueue_destroy waits for the last one out */
+            pthread_cond_broadcast(&jobqueue_p->has_room);
+        }
+    }
+    if (jobqueue_p->shutting_down) {
+        pthread_mutex_unlock(&jobqueue_p->mutex);
+        return JOBQUEUE_CLOSED;
+    }
     newjob->next = NULL;
 
     switch (jobqueue_p->len) {
@@ -425,9 +628,15 @@ static void jobqueue_push(jobqueue* jobqueue_p, struct job* newjob)
         break;
     }
     jobqueue_p->len++;
+    if (jobqueue_p->len > jobqueue_p->high_water) {
+        jobqueue_p->high_water = jobqueue_p->len;
+    }
+    METRIC_GAUGE_SET(pool_queue_depth, jobqueue_p->len);
+    PROBE2(job__enqueue, newjob, jobqueue_p->len);
 
     bsem_post(jobqueue_p->has_jobs);
     pthread_mutex_unlock(&jobqueue_p->mutex);
+    return 0;
 }
 
 
@@ -435,6 +644,14 @@ static void jobqueue_push(jobqueue* jobqueue_p, struct job* newjob)
 static void jobqueue_destroy(jobqueue* jobqueue_p)
 {
     jobqueue_clear(jobqueue_p);
+
+    /* a producer still waiting on has_room would outlive it */
+    pthread_mutex_lock(&jobqueue_p->mutex);
+    while (jobqueue_p->blocked) {
+        pthread_cond_wait(&jobqueue_p->has_room, &jobqueue_p->mutex);
+    }
+    pthread_mutex_unlock(&jobqueue_p->mutex);
+    pthread_cond_destroy(&jobqueue_p->has_room);
     free(jobqueue_p->has_jobs);
 }
 
@@ -450,6 +667,11 @@ static void jobqueue_clear(jobqueue* jobqueue_p)
     jobqueue_p->rear = NULL;
     bsem_reset(jobqueue_p->has_jobs);
     jobqueue_p->len = 0;
+
+    /* the room freed goes to producers blocked on a full queue */
+    pthread_mutex_lock(&jobqueue_p->mutex);
+    pthread_cond_broadcast(&jobqueue_p->has_room);
+    pthread_mutex_unlock(&jobqueue_p->mutex);
 }
 
 
@@ -475,15 +697,18 @@ static void bsem_reset(bsem* bsem_p)
 }
 
 
-/* wait on semaphore until semaphore has value 0 */
-static void bsem_wait(bsem* bsem_p)
+/* wait on semaphore until semaphore has value 0; returns 1 if it had to sleep */
+static int bsem_wait(bsem* bsem_p)
 {
+    int slept = 0;
     pthread_mutex_lock(&bsem_p->mutex);
     while (bsem_p->v != 1) {
+        slept = 1;
         pthread_cond_wait(&bsem_p->cond, &bsem_p->mutex);
     }
     bsem_p->v = 0;
     pthread_mutex_unlock(&bsem_p->mutex);   
+    return slept;
 }
 
 
@@ -1,58 +1,107 @@
+#include <getopt.h>
 #include <pthread.h>
+#include <stdint.h>
 #include "server.h"
+#include "thread-cache.h"
 
-typedef struct { int sockfd; } thread_config_t;
+// Thread-per-connection server. Connection threads come from a thread cache:
+// a thread whose peer went away parks and serves the next accepted peer.
+//
+//   thread-server [-s stack-KB] [-g guard-KB] [-m max-threads] [-c cached] [port]
+//
+// Past max-threads the main thread stops accepting until a connection ends;
+// new peers wait in the listen queue. -c 0 creates a thread per connection.
 
+#define DEFAULT_STACK_KB        (THREAD_CACHE_DEFAULT_STACK / 1024)
+#define DEFAULT_GUARD_KB        16
+#define DEFAULT_MAX_THREADS     1024
+#define DEFAULT_CACHED_THREADS  64
 
-void* server_thread(void* arg) {
-    thread_config_t* config = (thread_config_t*)arg;
-    int sockfd = config->sockfd;
+
+static void server_thread(void* arg) {
+    int sockfd = (int)(intptr_t)arg;
     // This cast will work for linux
     unsigned long id = (unsigned long)pthread_self();
-    printf("Thread %lu created to handle connection with socket %d\n", id, sockfd);
+    LOG_INFO("Thread %lu serving connection with socket %d", id, sockfd);
     serve_connection(sockfd);
-    printf("Thread %lu done\n", id);
-    return 0;
+    LOG_INFO("Thread %lu done", id);
 }
 
 int main(int argc, char** argv) {
-    /* Change the buffer mode of 'stdout' to no buffering (_IONBF) and resize internal buffer to 0 */
-    setvbuf(stdout, NULL, _IONBF, 0);
-    
+    log_init();
+    metrics_init(argv[0]);
+    ignore_sigpipe();
+
+    int stack_kb = DEFAULT_STACK_KB;
+    int guard_kb = DEFAULT_GUARD_KB;
+    int max_threads = DEFAULT_MAX_THREADS;
+    int cached = DEFAULT_CACHED_THREADS;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:g:m:c:")) != -1) {
+        switch (opt) {
+        case 's':
+            stack_kb = atoi(optarg);
+            break;
+        case 'g':
+            guard_kb = atoi(optarg);
+            break;
+        case 'm':
+            max_threads = atoi(optarg);
+            break;
+        case 'c':
+            cached = atoi(optarg);
+            break;
+        default:
+            die("usage: %s [-s stack-KB] [-g guard-KB] [-m max-threads] [-c cached] [port]",
+                argv[0]);
+        }
+    }
+    if (stack_kb * 1024 < THREAD_CACHE_MIN_STACK) {
+        die("stack of %d KB is below the %d KB a connection needs",
+            stack_kb, THREAD_CACHE_MIN_STACK / 1024);
+    }
+
     int port_num = 9090;
-    if (argc >= 2) {
-        port_num = atoi(argv[1]);
+    if (optind < argc) {
+        port_num = atoi(argv[optind]);
+    }
+
+    thread_cache_config_t config = {
+        .stack_size = (size_t)stack_kb * 1024,
+        .guard_size = (size_t)guard_kb * 1024,
+        .max_threads = max_threads,
+        .max_idle = cached,
+    };
+    thread_cache_t* threads = thread_cache_create(&config);
+    if (threads == NULL) {
+        die("thread cache: bad stack (%d KB) or guard (%d KB) size", stack_kb, guard_kb);
     }
 
-    printf("Serving on port %d\n", port_num);
+    LOG_INFO("Serving on port %d: %d KB stacks, %d KB guard, at most %d threads, %d cached",
+             port_num, stack_kb, guard_kb, max_threads, cached);
 
+    admission_init(0, 0);
     int sockfd = listen_inet_socket(port_num);
 
     while (1) {
-        struct sockaddr_in peer_addr;
+        struct sockaddr_storage peer_addr;
         socklen_t peer_addr_len = sizeof(peer_addr);
 
         // create a new connected socket which socket is connect to server
-        int newsocketfd = accept(sockfd, (struct sockaddr*)&peer_addr, &peer_addr_len);
+        int newsocketfd = accept_peer(sockfd, &peer_addr, &peer_addr_len);
 
         if (newsocketfd < 0) {
-            perror_die("ERROR on accept");
+            continue;
         }
 
-        report_peer_connected(&peer_addr, peer_addr_len);
-        
-        pthread_t p_thread;
-        thread_config_t* config = (thread_config_t*)malloc(sizeof(*config));
-        if (!config) {
-            die("OOM");
-        }
-        config->sockfd = newsocketfd;
-        pthread_create(&p_thread, NULL, server_thread, config);
+        report_peer_connected((struct sockaddr*)&peer_addr, peer_addr_len);
 
-        // detach the thread - when it done, its resource will be cleaned up
-        // since the main thread lives forever, it will outlive the serving threads
-        pthread_detach(p_thread);
+        // blocks at max_threads, holding later peers in the listen queue
+        if (thread_cache_run(threads, server_thread, (void*)(intptr_t)newsocketfd) < 0) {
+            METRIC_INC(conn_rejected);
+            close(newsocketfd);
+        }
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,9 +1,24 @@
 #include <stdio.h>
+#include <getopt.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <string.h>
 #include "thread-pool.h"
 #include "server.h"
 
+// Each job holds a worker for a whole connection, so accepted peers queue for
+// a worker. The queue is bounded:
+//
+//   threadpool-server [-q capacity] [-o block|reject|caller] [-w wait-ms] [port [threads]]
+//
+// At capacity the acceptor blocks (block), closes the new peer at once
+// (reject) or serves it itself (caller). With -w it also stops accepting
+// while the oldest queued peer has waited longer than wait-ms, leaving new
+// peers to the kernel's listen queue.
+
+#define DEFAULT_QUEUE_CAPACITY  64
+#define BACKOFF_SLEEP_US        1000
+
 
 typedef struct { int sockfd; } thread_config_t;
 
@@ -16,58 +31,121 @@ void server_thread(void* arg) {
   // This cast will work for Linux, but in general casting pthread_id to an
   // integral type isn't portable.
   unsigned long id = (unsigned long)pthread_self();
-  printf("Thread %lu created to handle connection with socket %d\n", id,
-         sockfd);
+  LOG_INFO("Thread %lu created to handle connection with socket %d", id, sockfd);
   serve_connection(sockfd);
-  printf("Thread %lu done\n", id);
+  LOG_INFO("Thread %lu done", id);
+}
+
+static threadpool_overflow_t parse_overflow(const char* name)
+{
+    if (strcmp(name, "block") == 0) {
+        return THREADPOOL_BLOCK;
+    }
+    if (strcmp(name, "reject") == 0) {
+        return THREADPOOL_REJECT;
+    }
+    if (strcmp(name, "caller") == 0) {
+        return THREADPOOL_CALLER_RUNS;
+    }
+    die("unknown overflow policy '%s': block, reject or caller", name);
+    return THREADPOOL_BLOCK;
+}
+
+
+// Holds the acceptor back while queued peers wait longer than max_wait_ns.
+static void backoff_while_queue_slow(threadpool_* threadpool, uint64_t max_wait_ns)
+{
+    uint64_t wait_ns = threadpool_queue_wait_ns(threadpool);
+    if (wait_ns <= max_wait_ns) {
+        return;
+    }
+    METRIC_INC(listener_paused);
+    LOG_DEBUG("oldest queued peer waited %lu us, not accepting", (unsigned long)(wait_ns / 1000));
+    while (threadpool_queue_wait_ns(threadpool) > max_wait_ns) {
+        usleep(BACKOFF_SLEEP_US);
+    }
 }
 
-int main(int argc, char const *argv[])
+
+int main(int argc, char *argv[])
 {
-    setvbuf(stdout, NULL, _IONBF, 0);
+    log_init();
+    metrics_init(argv[0]);
+    ignore_sigpipe();
+
+    int capacity = DEFAULT_QUEUE_CAPACITY;
+    threadpool_overflow_t overflow = THREADPOOL_BLOCK;
+    int max_wait_ms = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "q:o:w:")) != -1) {
+        switch (opt) {
+        case 'q':
+            capacity = atoi(optarg);
+            break;
+        case 'o':
+            overflow = parse_overflow(optarg);
+            break;
+        case 'w':
+            max_wait_ms = atoi(optarg);
+            break;
+        default:
+            die("usage: %s [-q capacity] [-o block|reject|caller] [-w wait-ms] [port [threads]]",
+                argv[0]);
+        }
+    }
 
     int portnum = 9090;
-    if (argc >= 2) {
-        portnum = atoi(argv[1]);
+    if (optind < argc) {
+        portnum = atoi(argv[optind]);
     }
 
     int num_threads = 5;
-    if (argc >=3) {
-        num_threads = atoi(argv[2]);
+    if (optind + 1 < argc) {
+        num_threads = atoi(argv[optind + 1]);
     }
 
-    printf("Serving on port %d\n", portnum);
-    fflush(stdout);
+    LOG_INFO("Serving on port %d", portnum);
 
-    printf("Making threadpool with %d threads\n", num_threads);
+    LOG_INFO("Making threadpool with %d threads, queue of %d", num_threads, capacity);
     threadpool_* threadpool = threadpool_init(num_threads);
+    threadpool_set_queue_limit(threadpool, capacity, overflow);
 
+    admission_init(0, 0);
     int sockfd = listen_inet_socket(portnum);
 
     while (1) {
-        struct sockaddr_in peer_addr;
+        if (max_wait_ms > 0) {
+            backoff_while_queue_slow(threadpool, (uint64_t)max_wait_ms * 1000000);
+        }
+
+        struct sockaddr_storage peer_addr;
         socklen_t peer_addr_len = sizeof(peer_addr);
 
-        int newsockfd =
-            accept(sockfd, (struct sockaddr*)&peer_addr, &peer_addr_len);
+        int newsockfd = accept_peer(sockfd, &peer_addr, &peer_addr_len);
 
         if (newsockfd < 0) {
-            perror_die("ERROR on accept");
+            continue;
         }
 
-        report_peer_connected(&peer_addr, peer_addr_len);
+        report_peer_connected((struct sockaddr*)&peer_addr, peer_addr_len);
 
         thread_config_t* config = (thread_config_t*)malloc(sizeof(*config));
         if (!config) {
             die("OOM");
         }
         config->sockfd = newsockfd;
-        threadpool_add_work(threadpool, server_thread, (void*)(thread_config_t*)config);
+        if (threadpool_add_work(threadpool, server_thread, (void*)(thread_config_t*)config) != 0) {
+            // a full queue under -o reject: close now rather than keep the peer waiting
+            LOG_DEBUG("job queue full, rejecting socket %d", newsockfd);
+            METRIC_INC(conn_rejected);
+            free(config);
+            close(newsockfd);
+        }
     }
 
 
     threadpool_wait(threadpool);
-    printf("Killing threadpool\n");
+    LOG_INFO("Killing threadpool");
     threadpool_destroy(threadpool);
 
     return 0;
@@ -0,0 +1,148 @@
+#include "timer-wheel.h"
+
+#include <string.h>
+
+
+static void link_timer(tw_timer_t** head, tw_timer_t* timer) {
+    timer->next = *head;
+    if (*head) {
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+}
+
+
+static void unlink_timer(tw_timer_t* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+
+// Puts timer into the slot matching its distance from now_tick.
+static void place(timer_wheel_t* wheel, tw_timer_t* timer) {
+    uint64_t expires = timer->expires;
+    uint64_t delta = expires - wheel->now_tick;
+    int level = 0;
+    while (level < TW_LEVELS - 1 && delta >= (1ull << (TW_SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+    if (level == TW_LEVELS - 1 && delta >= (1ull << (TW_SLOT_BITS * TW_LEVELS))) {
+        // Beyond the wheel's range: park it as far out as we can, it is
+        // re-placed when that slot cascades.
+        expires = wheel->now_tick + (1ull << (TW_SLOT_BITS * TW_LEVELS)) - 1;
+    }
+    int slot = (int)((expires >> (TW_SLOT_BITS * level)) & TW_SLOT_MASK);
+    link_timer(&wheel->slots[level][slot], timer);
+}
+
+
+void tw_init(timer_wheel_t* wheel, uint64_t tick_ms, uint64_t now_ns) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->start_ns = now_ns;
+    wheel->tick_ns = (tick_ms ? tick_ms : 1) * 1000000ull;
+}
+
+
+void tw_arm(timer_wheel_t* wheel, tw_timer_t* timer, uint64_t deadline_ns) {
+    if (tw_armed(timer)) {
+        unlink_timer(timer);
+    } else {
+        wheel->count++;
+    }
+    uint64_t tick = deadline_ns > wheel->start_ns
+                  ? (deadline_ns - wheel->start_ns + wheel->tick_ns - 1) / wheel->tick_ns
+                  : 0;
+    if (tick <= wheel->now_tick) {
+        tick = wheel->now_tick + 1;
+    }
+    timer->expires = tick;
+    place(wheel, timer);
+}
+
+
+void tw_cancel(timer_wheel_t* wheel, tw_timer_t* timer) {
+    if (tw_armed(timer)) {
+        unlink_timer(timer);
+        wheel->count--;
+    }
+}
+
+
+// Moves every timer of a higher-level slot down to where it now belongs.
+static void cascade(timer_wheel_t* wheel, int level) {
+    int slot = (int)((wheel->now_tick >> (TW_SLOT_BITS * level)) & TW_SLOT_MASK);
+    tw_timer_t* list = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    while (list) {
+        tw_timer_t* timer = list;
+        list = timer->next;
+        timer->next = NULL;
+        place(wheel, timer);
+    }
+    if (slot == 0 && level + 1 < TW_LEVELS) {
+        cascade(wheel, level + 1);
+    }
+}
+
+
+int tw_advance(timer_wheel_t* wheel, uint64_t now_ns, tw_expire_fn expire, void* ctx) {
+    if (now_ns < wheel->start_ns) {
+        return 0;
+    }
+    uint64_t target = (now_ns - wheel->start_ns) / wheel->tick_ns;
+    int expired = 0;
+
+    while (wheel->now_tick < target) {
+        if (wheel->count == 0) {
+            wheel->now_tick = target;
+            break;
+        }
+        wheel->now_tick++;
+        int slot = (int)(wheel->now_tick & TW_SLOT_MASK);
+        if (slot == 0) {
+            cascade(wheel, 1);
+        }
+
+        // Detach the slot so expire callbacks can arm timers into it for a
+        // later lap; cancels still work through pprev.
+        tw_timer_t* pending = wheel->slots[0][slot];
+        wheel->slots[0][slot] = NULL;
+        if (pending) {
+            pending->pprev = &pending;
+        }
+        while (pending) {
+            tw_timer_t* timer = pending;
+            unlink_timer(timer);
+            wheel->count--;
+            expired++;
+            expire(timer, ctx);
+        }
+    }
+    return expired;
+}
+
+
+int tw_next_timeout_ms(const timer_wheel_t* wheel, uint64_t now_ns) {
+    if (wheel->count == 0) {
+        return -1;
+    }
+    // First non-empty level-0 slot; otherwise the next cascade is the earliest
+    // point anything can change.
+    uint64_t next_tick = (wheel->now_tick | TW_SLOT_MASK) + 1;
+    for (uint64_t tick = wheel->now_tick + 1; tick < next_tick; tick++) {
+        if (wheel->slots[0][tick & TW_SLOT_MASK]) {
+            next_tick = tick;
+            break;
+        }
+    }
+    uint64_t when = wheel->start_ns + next_tick * wheel->tick_ns;
+    if (when <= now_ns) {
+        return 0;
+    }
+    return (int)((when - now_ns + 999999) / 1000000);
+}
@@ -0,0 +1,245 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histogram.h"
+#include "log.h"
+
+// The writer maps a window of the file and appends records into it. A record
+// that does not fit moves the window up to the page it starts on, and the
+// file is extended a window at a time so stores never hit an unbacked page.
+#define TRACE_WINDOW        (4u << 20)
+#define TRACE_MAX_RECORD    (64u << 10)     /* longer payloads are split */
+
+struct trace_writer {
+    int fd;
+    char* path;
+    uint8_t* map;
+    uint64_t map_off;                       /* file offset of map[0] */
+    uint64_t end;                           /* file offset of the next record */
+    uint64_t file_size;                     /* bytes allocated */
+    uint64_t start_ns;
+    uint32_t next_conn;
+    long page_size;
+};
+
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+// Maps [end rounded down to a page, + TRACE_WINDOW), growing the file to cover it.
+static int map_window(trace_writer_t* w) {
+    if (w->map) {
+        munmap(w->map, TRACE_WINDOW);
+        w->map = NULL;
+    }
+    w->map_off = w->end & ~(uint64_t)(w->page_size - 1);
+    uint64_t need = w->map_off + TRACE_WINDOW;
+    if (need > w->file_size) {
+        // allocate blocks now: a full disk fails here, not as SIGBUS on a store
+        int err = posix_fallocate(w->fd, w->file_size, need - w->file_size);
+        if (err == EOPNOTSUPP || err == EINVAL) {
+            err = ftruncate(w->fd, need) < 0 ? errno : 0;
+        }
+        if (err) {
+            LOG_ERROR("trace %s: growing to %lu bytes: %s", w->path, (unsigned long)need,
+                      strerror(err));
+            return -1;
+        }
+        w->file_size = need;
+    }
+    void* map = mmap(NULL, TRACE_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, w->map_off);
+    if (map == MAP_FAILED) {
+        LOG_ERROR("trace %s: mmap: %s", w->path, strerror(errno));
+        return -1;
+    }
+    w->map = map;
+    return 0;
+}
+
+
+// Appends one record; a failed write ends the capture rather than the server.
+static void append(trace_writer_t* w, uint32_t conn, uint16_t type, const void* data, uint32_t len) {
+    if (w->fd < 0) {
+        return;
+    }
+    size_t size = trace_record_size(len);
+    if (w->map == NULL || w->end + size > w->map_off + TRACE_WINDOW) {
+        if (map_window(w) < 0) {
+            LOG_ERROR("trace %s: capture stopped", w->path);
+            close(w->fd);
+            w->fd = -1;
+            return;
+        }
+    }
+    uint8_t* p = w->map + (w->end - w->map_off);
+    // payload first: a zero header is the end of the trace until it is written
+    if (len) {
+        memcpy(p + sizeof(trace_record_t), data, len);
+    }
+    trace_record_t* rec = (trace_record_t*)p;
+    rec->conn = conn;
+    rec->len = len;
+    rec->reserved = 0;
+    rec->pad = 0;
+    rec->t_ns = hist_now_ns() - w->start_ns;
+    __atomic_store_n(&rec->type, type, __ATOMIC_RELEASE);
+    w->end += size;
+}
+
+
+trace_writer_t* trace_writer_open(const char* path) {
+    trace_writer_t* w = calloc(1, sizeof(*w));
+    if (w == NULL) {
+        return NULL;
+    }
+    w->page_size = sysconf(_SC_PAGESIZE);
+    w->path = strdup(path);
+    w->fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (w->fd < 0 && errno == EEXIST) {
+        char alt[4096];
+        snprintf(alt, sizeof(alt), "%s.%d", path, (int)getpid());
+        free(w->path);
+        w->path = strdup(alt);
+        w->fd = open(alt, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    }
+    if (w->fd < 0) {
+        LOG_ERROR("trace %s: %s", w->path, strerror(errno));
+        free(w->path);
+        free(w);
+        return NULL;
+    }
+    if (map_window(w) < 0) {
+        close(w->fd);
+        free(w->path);
+        free(w);
+        return NULL;
+    }
+
+    trace_file_header_t* header = (trace_file_header_t*)w->map;
+    header->magic = TRACE_MAGIC;
+    header->version = TRACE_VERSION;
+    header->header_size = sizeof(trace_file_header_t);
+    header->start_time_ns = realtime_ns();
+    w->start_ns = hist_now_ns();
+    w->end = sizeof(trace_file_header_t);
+    w->next_conn = 1;
+    return w;
+}
+
+
+const char* trace_writer_path(const trace_writer_t* w) {
+    return w->path;
+}
+
+
+uint32_t trace_conn_open(trace_writer_t* w, const struct sockaddr* addr, socklen_t addr_len) {
+    uint32_t conn = w->next_conn++;
+    append(w, conn, TRACE_OPEN, addr, addr_len);
+    return conn;
+}
+
+
+void trace_conn_data(trace_writer_t* w, uint32_t conn, const void* data, size_t len) {
+    const uint8_t* p = data;
+    while (len > 0) {
+        uint32_t chunk = len < TRACE_MAX_RECORD ? (uint32_t)len : TRACE_MAX_RECORD;
+        append(w, conn, TRACE_DATA, p, chunk);
+        p += chunk;
+        len -= chunk;
+    }
+}
+
+
+void trace_conn_close(trace_writer_t* w, uint32_t conn) {
+    append(w, conn, TRACE_CLOSE, NULL, 0);
+}
+
+
+void trace_writer_close(trace_writer_t* w) {
+    if (w->map) {
+        munmap(w->map, TRACE_WINDOW);
+    }
+    if (w->fd >= 0) {
+        if (ftruncate(w->fd, w->end) < 0) {
+            LOG_WARN("trace %s: truncate: %s", w->path, strerror(errno));
+        }
+        close(w->fd);
+    }
+    free(w->path);
+    free(w);
+}
+
+
+int trace_reader_open(trace_reader_t* r, const char* path) {
+    memset(r, 0, sizeof(*r));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(trace_file_header_t)) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        close(fd);
+        return -1;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: mmap: %s\n", path, strerror(errno));
+        return -1;
+    }
+    // records are read once, front to back
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    const trace_file_header_t* header = map;
+    if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION ||
+        header->header_size < sizeof(*header) || header->header_size > (size_t)st.st_size) {
+        fprintf(stderr, "%s: not a version %d trace\n", path, TRACE_VERSION);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    r->base = map;
+    r->size = st.st_size;
+    r->off = header->header_size;
+    r->header = header;
+    return 0;
+}
+
+
+const trace_record_t* trace_next(trace_reader_t* r) {
+    if (r->off + sizeof(trace_record_t) > r->size) {
+        return NULL;
+    }
+    const trace_record_t* rec = (const trace_record_t*)(r->base + r->off);
+    if (rec->type == 0) {
+        return NULL;
+    }
+    size_t size = trace_record_size(rec->len);
+    if (r->off + size > r->size) {
+        return NULL;
+    }
+    r->off += size;
+    return rec;
+}
+
+
+void trace_reader_close(trace_reader_t* r) {
+    if (r->base) {
+        munmap((void*)r->base, r->size);
+    }
+    memset(r, 0, sizeof(*r));
+}
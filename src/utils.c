@@ -1,12 +1,19 @@
 #include "utils.h"
+#include "log.h"
 
+#include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
 #define _GNU_SOURCE
 #include <netdb.h>
 
@@ -36,17 +43,43 @@ void perror_die(char* msg) {
     exit(EXIT_FAILURE);
 }
 
-void report_peer_connected(const struct sockaddr_in* sa, socklen_t salen) {
+void format_sockaddr(const struct sockaddr* sa, socklen_t salen, char* buf, size_t size) {
+    if (sa->sa_family == AF_UNIX) {
+        const struct sockaddr_un* un = (const struct sockaddr_un*)sa;
+        int len = (int)salen - (int)offsetof(struct sockaddr_un, sun_path);
+        if (len <= 0) {
+            snprintf(buf, size, "unix");
+        } else if (un->sun_path[0] == '\0') {
+            // abstract names are not NUL terminated; salen says where they end
+            snprintf(buf, size, "unix:@%.*s", len - 1, un->sun_path + 1);
+        } else {
+            snprintf(buf, size, "unix:%.*s", len, un->sun_path);
+        }
+        return;
+    }
+
     char hostbuf[NI_MAXHOST];
-    char portbuf[NI_MAXHOST];
-    if (getnameinfo((struct sockaddr*)sa, salen, hostbuf, NI_MAXHOST, portbuf, NI_MAXSERV, 0) == 0) {
-        printf("peer (%s, %s) connected\n", hostbuf, portbuf);
+    char portbuf[NI_MAXSERV];
+    // Numeric only: a reverse DNS lookup here would block the calling loop on
+    // the resolver.
+    if (getnameinfo(sa, salen, hostbuf, NI_MAXHOST, portbuf, NI_MAXSERV,
+                    NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+        snprintf(buf, size, "unknown");
+    } else if (sa->sa_family == AF_INET6) {
+        snprintf(buf, size, "[%s]:%s", hostbuf, portbuf);
     } else {
-        printf("peer (unknown) connected\n");
+        snprintf(buf, size, "%s:%s", hostbuf, portbuf);
     }
 }
 
 
+void report_peer_connected(const struct sockaddr* sa, socklen_t salen) {
+    char addr[SOCKADDR_STRLEN];
+    format_sockaddr(sa, salen, addr, sizeof(addr));
+    LOG_INFO("peer (%s) connected", addr);
+}
+
+
 int listen_inet_socket(int portnum) {
   // create socket with AF_INET; IPv4 internet protocol with socket stream
   int sockfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -94,4 +127,118 @@ void make_socket_non_blocking(int sockfd) {
   if (fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1) {
     perror_die("fcntl F_SETFL O_NONBLOCK");
   }
-}
\ No newline at end of file
+}
+
+
+// Binds a Unix socket; a socket file nobody accepts on any more is removed
+// first, one that still has a server behind it is left alone.
+static int bind_unix(int sockfd, const struct sockaddr_un* addr, socklen_t addrlen) {
+    if (bind(sockfd, (const struct sockaddr*)addr, addrlen) == 0 || errno != EADDRINUSE ||
+        addr->sun_path[0] == '\0') {
+        return sockfd;
+    }
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool stale = probe >= 0 && connect(probe, (const struct sockaddr*)addr, addrlen) < 0 &&
+                 errno == ECONNREFUSED;
+    if (probe >= 0) {
+        close(probe);
+    }
+    if (!stale) {
+        errno = EADDRINUSE;
+        return -1;
+    }
+    unlink(addr->sun_path);
+    return bind(sockfd, (const struct sockaddr*)addr, addrlen) == 0 ? sockfd : -1;
+}
+
+
+static int listen_unix(const char* endpoint, const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(addr.sun_path) || (path[0] == '@' && len == 1)) {
+        die("listen %s: bad socket path", endpoint);
+    }
+    memcpy(addr.sun_path, path, len);
+    if (path[0] == '@') {
+        // abstract namespace: a leading NUL, and the length says where the
+        // name ends
+        addr.sun_path[0] = '\0';
+    }
+    socklen_t addrlen = offsetof(struct sockaddr_un, sun_path) + len + (path[0] != '@');
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        perror_die("ERROR opening socket");
+    }
+    if (bind_unix(sockfd, &addr, addrlen) < 0) {
+        die("listen %s: %s", endpoint, strerror(errno));
+    }
+    if (listen(sockfd, N_BACKLOG) < 0) {
+        perror_die("ERROR on listen");
+    }
+    return sockfd;
+}
+
+
+int listen_endpoint(const char* endpoint) {
+    if (strncmp(endpoint, "unix:", 5) == 0) {
+        return listen_unix(endpoint, endpoint + 5);
+    }
+
+    char host[NI_MAXHOST] = "";
+    const char* port = endpoint;
+    const char* colon = strrchr(endpoint, ':');
+    if (colon) {
+        const char* start = endpoint;
+        const char* end = colon;
+        if (*start == '[') {
+            // [ADDR]:PORT
+            start++;
+            end--;
+            if (end < start || *end != ']') {
+                die("listen %s: expected [ADDR]:PORT", endpoint);
+            }
+        }
+        if ((size_t)(end - start) >= sizeof(host)) {
+            die("listen %s: host name too long", endpoint);
+        }
+        memcpy(host, start, end - start);
+        host[end - start] = '\0';
+        port = colon + 1;
+    }
+
+    struct addrinfo hints = {
+        .ai_family = strchr(host, ':') ? AF_INET6 : host[0] ? AF_UNSPEC : AF_INET,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_PASSIVE | AI_NUMERICSERV,
+    };
+    struct addrinfo* ai;
+    int rc = getaddrinfo(host[0] ? host : NULL, port, &hints, &ai);
+    if (rc != 0) {
+        die("listen %s: %s", endpoint, gai_strerror(rc));
+    }
+
+    int sockfd = socket(ai->ai_family, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        perror_die("ERROR opening socket");
+    }
+    int opt = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        perror_die("setsockopt");
+    }
+    if (ai->ai_family == AF_INET6) {
+        // dual-stack whatever the net.ipv6.bindv6only default is
+        opt = 0;
+        setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt));
+    }
+    if (bind(sockfd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        die("listen %s: %s", endpoint, strerror(errno));
+    }
+    freeaddrinfo(ai);
+    if (listen(sockfd, N_BACKLOG) < 0) {
+        perror_die("ERROR on listen");
+    }
+    return sockfd;
+}
@@ -0,0 +1,389 @@
+# Comparative benchmark of the server variants.
+#
+# Starts each server on loopback, drives it with bin/loadgen through a matrix of
+# connection counts, message sizes and pipelining depths, and samples the
+# server's CPU time and memory from /proc. Results are written as JSON and CSV;
+# with --baseline they are compared against a stored run and regressions are
+# reported (exit status 1).
+#
+#   python3 test/bench.py                         full matrix
+#   python3 test/bench.py --quick                 small matrix, short runs
+#   python3 test/bench.py --save-baseline FILE    store this run as baseline
+#   python3 test/bench.py --baseline FILE         compare against it
+#   python3 test/bench.py --profiles default low-latency
+#                                                 also per socket profile
+#   python3 test/bench.py --trace FILE            replay captured traffic
+#                                                 (--capture, bin/replay)
+#                                                 instead of the matrix
+import argparse
+import csv
+import itertools
+import json
+import logging
+import os
+import socket
+import subprocess
+import sys
+import time
+
+# A name:backend entry runs the binary with --backend=backend (event-loop.h),
+# so the backends are compared within one binary.
+SERVERS = ['sequential-server', 'thread-server', 'threadpool-server',
+           'select-server', 'epoll-server', 'epoll-server:poll',
+           'epoll-server:epoll-et']
+
+# Servers that take --sock-profile (sockopts.h); the others always run with
+# the default profile.
+PROFILE_SERVERS = ['select-server', 'epoll-server']
+
+MATRIX = {
+    'connections': [1, 16, 256],
+    'msg_size': [16, 1024],
+    'depth': [1, 8],
+}
+
+QUICK_MATRIX = {
+    'connections': [1, 16],
+    'msg_size': [64],
+    'depth': [1, 4],
+}
+
+CSV_FIELDS = ['server', 'profile', 'connections', 'msg_size', 'depth', 'connected',
+              'messages', 'errors', 'msgs_per_sec', 'mb_per_sec',
+              'p50_us', 'p99_us', 'p999_us', 'max_us',
+              'cpu_user_s', 'cpu_sys_s', 'rss_kb', 'peak_rss_kb',
+              'server_died']
+
+# A cell regresses when throughput drops or p99 grows by more than this.
+THROUGHPUT_TOLERANCE = 0.10
+LATENCY_TOLERANCE = 0.25
+
+CLK_TCK = os.sysconf('SC_CLK_TCK')
+
+REPLAY_TIMEOUT_S = 600
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(('127.0.0.1', 0))
+        return s.getsockname()[1]
+
+
+def is_listening(port):
+    """Checks /proc/net for a listener on port, without connecting to it."""
+    for path in ('/proc/net/tcp', '/proc/net/tcp6'):
+        try:
+            with open(path) as f:
+                next(f)
+                for line in f:
+                    fields = line.split()
+                    if fields[3] == '0A' and \
+                            int(fields[1].rsplit(':', 1)[1], 16) == port:
+                        return True
+        except OSError:
+            pass
+    return False
+
+
+def wait_listening(port, proc, timeout=5.0):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if proc.poll() is not None:
+            return False
+        if is_listening(port):
+            return True
+        time.sleep(0.05)
+    return False
+
+
+def proc_cpu(pid):
+    """Returns (user, system) CPU seconds of pid."""
+    with open('/proc/{0}/stat'.format(pid)) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    return int(fields[11]) / CLK_TCK, int(fields[12]) / CLK_TCK
+
+
+def proc_rss(pid):
+    """Returns (current, peak) resident set size of pid in kB."""
+    rss = hwm = 0
+    with open('/proc/{0}/status'.format(pid)) as f:
+        for line in f:
+            if line.startswith('VmRSS:'):
+                rss = int(line.split()[1])
+            elif line.startswith('VmHWM:'):
+                hwm = int(line.split()[1])
+    return rss, hwm
+
+
+def server_command(args, server, profile, port):
+    binary, _, backend = server.partition(':')
+    server_cmd = [os.path.join(args.bin_dir, binary), str(port)] + args.server_arg
+    if backend:
+        server_cmd.append('--backend=' + backend)
+    if profile != 'default':
+        server_cmd.append('--sock-profile=' + profile)
+    return server_cmd
+
+
+def run_cell(args, server, profile, conns, msg_size, depth):
+    port = free_port()
+    server_cmd = server_command(args, server, profile, port)
+    proc = subprocess.Popen(server_cmd, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.DEVNULL)
+    try:
+        if not wait_listening(port, proc):
+            logging.error('%s did not start', server)
+            return None
+
+        cpu_before = proc_cpu(proc.pid)
+        loadgen_cmd = [os.path.join(args.bin_dir, 'loadgen'), '-j',
+                       '-p', str(port), '-c', str(conns),
+                       '-t', str(min(args.threads, conns)),
+                       '-d', str(args.duration), '-s', str(msg_size),
+                       '-P', str(depth)]
+        out = subprocess.run(loadgen_cmd, stdout=subprocess.PIPE,
+                             stderr=subprocess.DEVNULL, text=True,
+                             timeout=args.duration + 30)
+        died = proc.poll() is not None
+        cpu_after = proc_cpu(proc.pid) if not died else cpu_before
+        rss, peak = proc_rss(proc.pid) if not died else (0, 0)
+
+        try:
+            result = json.loads(out.stdout.strip().splitlines()[-1])
+        except (IndexError, ValueError):
+            logging.error('%s: no result from loadgen', server)
+            result = {'connected': 0, 'messages': 0, 'errors': conns,
+                      'msgs_per_sec': 0, 'mb_per_sec': 0,
+                      'latency_us': {'p50': 0, 'p99': 0, 'p999': 0, 'max': 0}}
+
+        lat = result['latency_us']
+        return {
+            'server': server, 'profile': profile, 'connections': conns,
+            'msg_size': msg_size,
+            'depth': depth, 'connected': result['connected'],
+            'messages': result['messages'], 'errors': result['errors'],
+            'msgs_per_sec': result['msgs_per_sec'],
+            'mb_per_sec': result['mb_per_sec'],
+            'p50_us': lat['p50'], 'p99_us': lat['p99'],
+            'p999_us': lat['p999'], 'max_us': lat['max'],
+            'cpu_user_s': round(cpu_after[0] - cpu_before[0], 3),
+            'cpu_sys_s': round(cpu_after[1] - cpu_before[1], 3),
+            'rss_kb': rss, 'peak_rss_kb': peak, 'server_died': died,
+        }
+    finally:
+        if proc.poll() is None:
+            proc.terminate()
+        proc.wait()
+
+
+def run_replay(args, server, profile, trace):
+    """Replays trace as fast as the server takes it."""
+    port = free_port()
+    proc = subprocess.Popen(server_command(args, server, profile, port),
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        if not wait_listening(port, proc):
+            logging.error('%s did not start', server)
+            return None
+
+        cpu_before = proc_cpu(proc.pid)
+        replay_cmd = [os.path.join(args.bin_dir, 'replay'), '-j', '-f',
+                      '-p', str(port), trace]
+        out = subprocess.run(replay_cmd, stdout=subprocess.PIPE,
+                             stderr=subprocess.DEVNULL, text=True,
+                             timeout=REPLAY_TIMEOUT_S)
+        died = proc.poll() is not None
+        cpu_after = proc_cpu(proc.pid) if not died else cpu_before
+        rss, peak = proc_rss(proc.pid) if not died else (0, 0)
+        try:
+            result = json.loads(out.stdout.strip().splitlines()[-1])
+        except (IndexError, ValueError):
+            logging.error('%s: no result from replay', server)
+            return None
+        return {
+            'server': server, 'profile': profile,
+            'trace': os.path.basename(trace),
+            'connections': result['connections'], 'failed': result['failed'],
+            'bytes_out': result['bytes_out'], 'bytes_in': result['bytes_in'],
+            'secs': result['secs'], 'mb_per_sec': result['mb_per_sec'],
+            'cpu_user_s': round(cpu_after[0] - cpu_before[0], 3),
+            'cpu_sys_s': round(cpu_after[1] - cpu_before[1], 3),
+            'rss_kb': rss, 'peak_rss_kb': peak, 'server_died': died,
+        }
+    finally:
+        if proc.poll() is None:
+            proc.terminate()
+        proc.wait()
+
+
+def print_replay(results):
+    print('{0:<24} {1:<12} {2:<20} {3:>6} {4:>6} {5:>8} {6:>8} {7:>8}'.format(
+        'server', 'profile', 'trace', 'conns', 'failed', 'secs', 'MB/s', 'cpu_s'))
+    for r in results:
+        print('{0:<24} {1:<12} {2:<20} {3:>6} {4:>6} {5:>8.2f} {6:>8.1f} {7:>8.2f}'.format(
+            r['server'], r['profile'], r['trace'], r['connections'], r['failed'],
+            r['secs'], r['mb_per_sec'], r['cpu_user_s'] + r['cpu_sys_s']))
+
+
+def compare_replay(results, baseline):
+    """Regressions of replay throughput against baseline."""
+    key = lambda r: (r['server'], r['profile'], r['trace'])
+    base = {key(r): r for r in baseline}
+    regressions = []
+    for r in results:
+        b = base.get(key(r))
+        if b is None:
+            continue
+        name = '{0} ({1}) trace {2}'.format(*key(r))
+        if r['server_died'] and not b['server_died']:
+            regressions.append('{0}: server died'.format(name))
+        if b['mb_per_sec'] > 0 and \
+                r['mb_per_sec'] < b['mb_per_sec'] * (1 - THROUGHPUT_TOLERANCE):
+            regressions.append('{0}: throughput {1:.1f} -> {2:.1f} MB/s'.format(
+                name, b['mb_per_sec'], r['mb_per_sec']))
+    return regressions
+
+
+def cell_key(r):
+    return (r['server'], r.get('profile', 'default'), r['connections'],
+            r['msg_size'], r['depth'])
+
+
+def compare(results, baseline):
+    """Returns a list of human-readable regressions against baseline."""
+    base = {cell_key(r): r for r in baseline}
+    regressions = []
+    for r in results:
+        b = base.get(cell_key(r))
+        if b is None:
+            continue
+        name = '{0} ({1}) c={2} s={3} P={4}'.format(*cell_key(r))
+        if r['server_died'] and not b['server_died']:
+            regressions.append('{0}: server died'.format(name))
+        if b['msgs_per_sec'] > 0 and \
+                r['msgs_per_sec'] < b['msgs_per_sec'] * (1 - THROUGHPUT_TOLERANCE):
+            regressions.append('{0}: throughput {1:.0f} -> {2:.0f} msgs/s'.format(
+                name, b['msgs_per_sec'], r['msgs_per_sec']))
+        if b['p99_us'] > 0 and r['messages'] and \
+                r['p99_us'] > b['p99_us'] * (1 + LATENCY_TOLERANCE):
+            regressions.append('{0}: p99 {1:.1f} -> {2:.1f} us'.format(
+                name, b['p99_us'], r['p99_us']))
+    return regressions
+
+
+def print_profile_latency(results, profiles):
+    """Prints p50/p99 of every cell side by side for each socket profile."""
+    cells = {}
+    for r in results:
+        key = (r['server'], r['connections'], r['msg_size'], r['depth'])
+        cells.setdefault(key, {})[r['profile']] = r
+    print('{0:<24} {1:>5} {2:>6} {3:>3}'.format('latency p50/p99 us', 'conns',
+                                               'size', 'P') +
+          ''.join(' {0:>18}'.format(p) for p in profiles))
+    for key in sorted(cells):
+        if len(cells[key]) < 2:
+            continue
+        row = '{0:<24} {1:>5} {2:>6} {3:>3}'.format(*key)
+        for p in profiles:
+            r = cells[key].get(p)
+            row += ' {0:>18}'.format('{0:.0f}/{1:.0f}'.format(
+                r['p50_us'], r['p99_us']) if r else '-')
+        print(row)
+
+
+def main():
+    argparser = argparse.ArgumentParser('Server benchmark suite')
+    argparser.add_argument('--bin-dir', default='bin')
+    argparser.add_argument('--out-dir', default='bench-results')
+    argparser.add_argument('--servers', nargs='+', default=SERVERS)
+    argparser.add_argument('--duration', type=int, default=5,
+                           help='Seconds per matrix cell')
+    argparser.add_argument('--threads', type=int, default=2,
+                           help='Load generator threads')
+    argparser.add_argument('--quick', action='store_true',
+                           help='Small matrix and 2 second cells')
+    argparser.add_argument('--server-arg', action='append', default=[],
+                           help='Extra argument passed to every server')
+    argparser.add_argument('--profiles', nargs='+', default=['default'],
+                           help='Socket profiles to run the servers with')
+    argparser.add_argument('--trace', action='append', default=[],
+                           help='Replay this captured trace instead of running the matrix')
+    argparser.add_argument('--baseline', help='Compare against this result file')
+    argparser.add_argument('--save-baseline', help='Also write results here')
+    args = argparser.parse_args()
+
+    logging.basicConfig(level=logging.INFO,
+                        format='%(levelname)s:%(asctime)s:%(message)s')
+
+    matrix = QUICK_MATRIX if args.quick else MATRIX
+    if args.quick:
+        args.duration = min(args.duration, 2)
+
+    results = []
+    replays = []
+    for server, profile in itertools.product(args.servers, args.profiles):
+        if profile != 'default' and \
+                server.partition(':')[0] not in PROFILE_SERVERS:
+            continue
+        for trace in args.trace:
+            logging.info('%s (%s): replaying %s', server, profile, trace)
+            r = run_replay(args, server, profile, trace)
+            if r is not None:
+                logging.info('  %.2fs, %.1f MB/s, %d failed, cpu %.2fs%s',
+                             r['secs'], r['mb_per_sec'], r['failed'],
+                             r['cpu_user_s'] + r['cpu_sys_s'],
+                             ' (server died)' if r['server_died'] else '')
+                replays.append(r)
+        if args.trace:
+            continue
+        for conns, msg_size, depth in itertools.product(
+                matrix['connections'], matrix['msg_size'], matrix['depth']):
+            logging.info('%s (%s): %d connections, %d byte messages, depth %d',
+                         server, profile, conns, msg_size, depth)
+            r = run_cell(args, server, profile, conns, msg_size, depth)
+            if r is not None:
+                logging.info('  %.0f msgs/s, p99 %.1f us, cpu %.2fs, rss %d kB%s',
+                             r['msgs_per_sec'], r['p99_us'],
+                             r['cpu_user_s'] + r['cpu_sys_s'], r['peak_rss_kb'],
+                             ' (server died)' if r['server_died'] else '')
+                results.append(r)
+
+    os.makedirs(args.out_dir, exist_ok=True)
+    stamp = time.strftime('%Y%m%d-%H%M%S')
+    report = {'timestamp': stamp, 'duration_s': args.duration,
+              'host': socket.gethostname(), 'results': results}
+    if replays:
+        report['replay'] = replays
+    json_path = os.path.join(args.out_dir, 'bench-{0}.json'.format(stamp))
+    with open(json_path, 'w') as f:
+        json.dump(report, f, indent=2)
+    csv_path = os.path.join(args.out_dir, 'bench-{0}.csv'.format(stamp))
+    with open(csv_path, 'w', newline='') as f:
+        writer = csv.DictWriter(f, fieldnames=CSV_FIELDS)
+        writer.writeheader()
+        writer.writerows(results)
+    print('Results: {0}, {1}'.format(json_path, csv_path))
+    if len(args.profiles) > 1:
+        print_profile_latency(results, args.profiles)
+    if replays:
+        print_replay(replays)
+
+    if args.save_baseline:
+        with open(args.save_baseline, 'w') as f:
+            json.dump(report, f, indent=2)
+        print('Baseline saved to {0}'.format(args.save_baseline))
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            base = json.load(f)
+        regressions = compare(results, base['results']) + \
+            compare_replay(replays, base.get('replay', []))
+        for r in regressions:
+            print('REGRESSION: {0}'.format(r))
+        if regressions:
+            sys.exit(1)
+        print('No regressions against {0}'.format(args.baseline))
+
+
+if __name__ == '__main__':
+    main()
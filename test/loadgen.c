@@ -0,0 +1,619 @@
+// Load generator for the ^...$ protocol.
+//
+// Opens many connections from a few threads, each running its own epoll loop,
+// and drives them either closed-loop (every connection keeps -P messages in
+// flight) or open-loop at a fixed total rate (-r). Every reply byte is checked
+// against the expected transformation.
+//
+// In open-loop mode latency is measured from the time a message was *due*,
+// not from when it was actually written, so a stalled server cannot hide its
+// queueing delay by slowing the generator down (coordinated omission). In
+// closed-loop mode -e gives the expected interval between messages on a
+// connection and missing samples are back-filled HDR-style. -B switches the
+// connections to binary framing (framing.h) instead of ^...$ messages.
+// The host may be an IPv6 address, or unix:PATH / unix:@NAME for a Unix
+// socket (the port is ignored then).
+//
+//   loadgen [-h host] [-p port] [-c conns] [-t threads] [-d secs]
+//           [-s msg_size] [-P depth] [-r msgs_per_sec] [-e expected_us] [-B] [-j]
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "framing.h"
+#include "histogram.h"
+
+#define MAX_EVENTS          256
+#define DRAIN_TIMEOUT_NS    2000000000ull
+#define MAX_READS_PER_EVENT 16
+
+typedef enum { CONN_CONNECTING, CONN_WAIT_ACK, CONN_RUNNING, CONN_DEAD } conn_state_t;
+
+typedef struct {
+    uint64_t intended_ns;                   /* when the message was due */
+    uint64_t sent_ns;                       /* when it was written to the socket */
+} inflight_t;
+
+typedef struct {
+    int fd;
+    conn_state_t state;
+    uint64_t seq_sent;                      /* messages written */
+    uint64_t seq_done;                      /* replies fully received */
+    int reply_off;                          /* bytes of the oldest reply seen so far */
+    inflight_t* inflight;                   /* ring of depth entries, indexed by seq */
+    uint8_t* outbuf;                        /* framed messages not yet accepted by send */
+    int out_start;
+    int out_end;
+    bool want_out;                          /* registered for EPOLLOUT */
+} conn_t;
+
+typedef struct {
+    int id;
+    int epollfd;
+    int timerfd;                            /* open loop: fires when the next message is due */
+    conn_t* conns;
+    int nconns;
+    int next_conn;                          /* open loop: round-robin cursor */
+    double rate;                            /* open loop: messages/sec for this thread */
+    uint64_t interval_ns;                   /* ... as time between messages, at least 1 */
+    uint64_t due_seq;                       /* open loop: messages made due so far */
+    uint64_t start_ns;
+    uint64_t messages;
+    uint64_t errors;
+    uint64_t connected;
+    histogram_t corrected;
+    histogram_t uncorrected;
+    pthread_t thread;
+} worker_t;
+
+static struct {
+    const char* host;
+    const char* port;
+    int conns;
+    int threads;
+    int duration;
+    int msg_size;
+    int depth;
+    double rate;
+    uint64_t expected_ns;
+    bool binary;
+    bool json;
+} opt = {"127.0.0.1", "9090", 100, 2, 10, 16, 1, 0, 0, false, false};
+
+// -B: every message and reply starts with this header
+static frame_header_t frame_header;
+
+static struct addrinfo* server_addr;
+static volatile int stop_sending;
+
+
+static void die(const char* msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+
+// Payload byte k of message seq; chosen so neither it nor its reply is a
+// framing character.
+static inline uint8_t payload_byte(uint64_t seq, int k) {
+    return 'a' + (uint8_t)((seq + k) % 25);
+}
+
+
+static void raise_fd_limit(int needed) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)needed) {
+        rl.rlim_cur = rl.rlim_max < (rlim_t)needed ? rl.rlim_max : (rlim_t)needed;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+
+static void update_events(worker_t* w, conn_t* c) {
+    bool want_out = c->state == CONN_CONNECTING || c->out_start < c->out_end;
+    if (want_out == c->want_out) {
+        return;
+    }
+    struct epoll_event ev = {.events = EPOLLIN | (want_out ? EPOLLOUT : 0), .data.ptr = c};
+    epoll_ctl(w->epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->want_out = want_out;
+}
+
+
+static void conn_fail(worker_t* w, conn_t* c) {
+    if (c->state == CONN_DEAD) {
+        return;
+    }
+    w->errors++;
+    epoll_ctl(w->epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->state = CONN_DEAD;
+}
+
+
+static void flush_out(worker_t* w, conn_t* c) {
+    while (c->out_start < c->out_end) {
+        ssize_t n = send(c->fd, c->outbuf + c->out_start, c->out_end - c->out_start, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn_fail(w, c);
+                return;
+            }
+            break;
+        }
+        c->out_start += n;
+    }
+    if (c->out_start == c->out_end) {
+        c->out_start = c->out_end = 0;
+    }
+    update_events(w, c);
+}
+
+
+// Frames the next message of c into its output buffer.
+static void queue_message(conn_t* c, uint64_t intended_ns, uint64_t now) {
+    uint64_t seq = c->seq_sent++;
+    inflight_t* slot = &c->inflight[seq % opt.depth];
+    slot->intended_ns = intended_ns;
+    slot->sent_ns = now;
+
+    if (c->out_start > 0) {
+        memmove(c->outbuf, c->outbuf + c->out_start, c->out_end - c->out_start);
+        c->out_end -= c->out_start;
+        c->out_start = 0;
+    }
+    uint8_t* p = c->outbuf + c->out_end;
+    if (opt.binary) {
+        memcpy(p, &frame_header, sizeof(frame_header));
+        p += sizeof(frame_header);
+    } else {
+        *p++ = '^';
+    }
+    for (int k = 0; k < opt.msg_size; k++) {
+        *p++ = payload_byte(seq, k);
+    }
+    if (!opt.binary) {
+        *p++ = '$';
+    }
+    c->out_end = p - c->outbuf;
+}
+
+
+static void record_latency(worker_t* w, const inflight_t* m, uint64_t now) {
+    uint64_t corrected = now - m->intended_ns;
+    histogram_record(&w->corrected, corrected);
+    histogram_record(&w->uncorrected, now - m->sent_ns);
+    if (opt.rate == 0 && opt.expected_ns) {
+        // closed loop: back-fill the samples a stalled request kept us from
+        // taking
+        for (uint64_t v = corrected; v > opt.expected_ns; ) {
+            v -= opt.expected_ns;
+            histogram_record(&w->corrected, v);
+        }
+    }
+}
+
+
+static void on_readable(worker_t* w, conn_t* c, uint64_t now) {
+    uint8_t buf[16 * 1024];
+    // a bounded number of reads: a reply stream that never runs dry must not
+    // keep the other connections, and the end of the run, waiting
+    for (int reads = 0; reads < MAX_READS_PER_EVENT; reads++) {
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n == 0) {
+            conn_fail(w, c);
+            return;
+        } else if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn_fail(w, c);
+            }
+            return;
+        }
+
+        ssize_t i = 0;
+        if (c->state == CONN_WAIT_ACK) {
+            if (buf[0] != '*') {
+                conn_fail(w, c);
+                return;
+            }
+            c->state = CONN_RUNNING;
+            w->connected++;
+            i = 1;
+            if (opt.binary) {
+                // picks the framing; goes out ahead of the first message
+                c->outbuf[c->out_end++] = FRAME_MAGIC;
+            }
+            if (opt.rate == 0 && !stop_sending) {
+                for (int d = 0; d < opt.depth; d++) {
+                    queue_message(c, now, now);
+                }
+                flush_out(w, c);
+            }
+        }
+
+        int header_size = opt.binary ? sizeof(frame_header) : 0;
+        for (; i < n; i++) {
+            uint8_t expected = c->reply_off < header_size
+                ? ((const uint8_t*)&frame_header)[c->reply_off]
+                : payload_byte(c->seq_done, c->reply_off - header_size) + 1;
+            if (c->seq_done >= c->seq_sent || buf[i] != expected) {
+                conn_fail(w, c);
+                return;
+            }
+            if (++c->reply_off == header_size + opt.msg_size) {
+                record_latency(w, &c->inflight[c->seq_done % opt.depth], now);
+                c->seq_done++;
+                c->reply_off = 0;
+                w->messages++;
+                if (opt.rate == 0 && !stop_sending) {
+                    queue_message(c, now, now);
+                }
+            }
+        }
+        if (c->out_end > c->out_start) {
+            flush_out(w, c);
+        }
+        if ((size_t)n < sizeof(buf)) {
+            return;
+        }
+    }
+}
+
+
+static void on_writable(worker_t* w, conn_t* c) {
+    if (c->state == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+            conn_fail(w, c);
+            return;
+        }
+        c->state = CONN_WAIT_ACK;
+    }
+    flush_out(w, c);
+}
+
+
+// Open loop: hand every message that is due by now to a connection with room
+// for it. Messages that find no room stay due and keep their original
+// timestamp.
+static void send_due(worker_t* w, uint64_t now) {
+    uint64_t target = (now - w->start_ns) / w->interval_ns + 1;
+    while (w->due_seq < target) {
+        conn_t* c = NULL;
+        for (int tries = 0; tries < w->nconns; tries++) {
+            conn_t* cand = &w->conns[w->next_conn];
+            w->next_conn = (w->next_conn + 1) % w->nconns;
+            if (cand->state == CONN_RUNNING && cand->seq_sent - cand->seq_done < (uint64_t)opt.depth) {
+                c = cand;
+                break;
+            }
+        }
+        if (c == NULL) {
+            return;
+        }
+        queue_message(c, w->start_ns + w->due_seq * w->interval_ns, now);
+        w->due_seq++;
+        flush_out(w, c);
+    }
+}
+
+
+static void* worker_main(void* arg) {
+    worker_t* w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    // the larger of both framings per message, and the FRAME_MAGIC byte
+    size_t outbuf_size = (size_t)opt.depth * (opt.msg_size + sizeof(frame_header)) + 1;
+
+    for (int i = 0; i < w->nconns; i++) {
+        conn_t* c = &w->conns[i];
+        c->inflight = calloc(opt.depth, sizeof(inflight_t));
+        c->outbuf = malloc(outbuf_size);
+        if (c->inflight == NULL || c->outbuf == NULL) {
+            die("malloc");
+        }
+        c->fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (c->fd < 0) {
+            die("socket");
+        }
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c->state = CONN_CONNECTING;
+        if (connect(c->fd, server_addr->ai_addr, server_addr->ai_addrlen) < 0 && errno != EINPROGRESS) {
+            c->state = CONN_DEAD;
+            close(c->fd);
+            w->errors++;
+            continue;
+        }
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT, .data.ptr = c};
+        c->want_out = true;
+        epoll_ctl(w->epollfd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+
+    if (w->rate > 0) {
+        w->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (w->timerfd < 0) {
+            die("timerfd_create");
+        }
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+        epoll_ctl(w->epollfd, EPOLL_CTL_ADD, w->timerfd, &ev);
+    }
+
+    w->start_ns = hist_now_ns();
+    uint64_t end_ns = w->start_ns + (uint64_t)opt.duration * 1000000000ull;
+    uint64_t drain_end = 0;
+
+    for (;;) {
+        uint64_t now = hist_now_ns();
+        if (!stop_sending && now >= end_ns) {
+            stop_sending = 1;
+        }
+        if (stop_sending) {
+            if (drain_end == 0) {
+                drain_end = now + DRAIN_TIMEOUT_NS;
+            }
+            bool idle = true;
+            for (int i = 0; i < w->nconns; i++) {
+                conn_t* c = &w->conns[i];
+                if (c->state == CONN_RUNNING && c->seq_done < c->seq_sent) {
+                    idle = false;
+                    break;
+                }
+            }
+            if (idle || now >= drain_end) {
+                break;
+            }
+        } else if (w->rate > 0) {
+            send_due(w, now);
+        }
+
+        int timeout = 100;
+        if (!stop_sending && w->rate > 0) {
+            // epoll_wait only has millisecond resolution, which would add up
+            // to a millisecond of generator-side delay to every message
+            uint64_t next = w->start_ns + w->due_seq * w->interval_ns;
+            if (next <= now) {
+                timeout = 0;
+            } else {
+                struct itimerspec its = {.it_value = {.tv_sec = (next - now) / 1000000000ull,
+                                                      .tv_nsec = (next - now) % 1000000000ull}};
+                timerfd_settime(w->timerfd, 0, &its, NULL);
+                timeout = -1;
+            }
+        }
+        int n = epoll_wait(w->epollfd, events, MAX_EVENTS, timeout);
+        now = hist_now_ns();
+        for (int i = 0; i < n; i++) {
+            conn_t* c = events[i].data.ptr;
+            if (c == NULL) {
+                uint64_t expirations;
+                if (read(w->timerfd, &expirations, sizeof(expirations)) < 0) {
+                    // spurious wakeup, nothing to clear
+                }
+                continue;
+            }
+            if (c->state == CONN_DEAD) {
+                continue;
+            }
+            if (events[i].events & (EPOLLOUT | EPOLLERR)) {
+                on_writable(w, c);
+            }
+            if (c->state != CONN_DEAD && events[i].events & (EPOLLIN | EPOLLHUP)) {
+                on_readable(w, c, now);
+            }
+        }
+    }
+
+    for (int i = 0; i < w->nconns; i++) {
+        if (w->conns[i].state != CONN_DEAD) {
+            close(w->conns[i].fd);
+        }
+        free(w->conns[i].inflight);
+        free(w->conns[i].outbuf);
+    }
+    if (w->rate > 0) {
+        close(w->timerfd);
+    }
+    return NULL;
+}
+
+
+static void print_report(histogram_t* corrected, histogram_t* uncorrected, uint64_t messages,
+                         uint64_t errors, uint64_t connected, double secs) {
+    double msgs_per_sec = messages / secs;
+    double mb_per_sec = msgs_per_sec * opt.msg_size / (1024.0 * 1024.0);
+    const double qs[] = {0.50, 0.90, 0.99, 0.999};
+    const char* qnames[] = {"p50", "p90", "p99", "p999"};
+
+    if (opt.json) {
+        printf("{\"mode\": \"%s\", \"framing\": \"%s\", \"connections\": %d, \"connected\": %lu, "
+               "\"threads\": %d, \"msg_size\": %d, \"depth\": %d, \"rate\": %.0f, \"duration_s\": %.3f, "
+               "\"messages\": %lu, \"errors\": %lu, \"msgs_per_sec\": %.1f, \"mb_per_sec\": %.3f",
+               opt.rate > 0 ? "open" : "closed", opt.binary ? "binary" : "text", opt.conns,
+               (unsigned long)connected, opt.threads, opt.msg_size, opt.depth, opt.rate, secs,
+               (unsigned long)messages, (unsigned long)errors, msgs_per_sec, mb_per_sec);
+        histogram_t* hs[] = {corrected, uncorrected};
+        const char* names[] = {"latency_us", "uncorrected_latency_us"};
+        for (int h = 0; h < 2; h++) {
+            printf(", \"%s\": {", names[h]);
+            for (int q = 0; q < 4; q++) {
+                printf("\"%s\": %.1f, ", qnames[q], histogram_percentile(hs[h], qs[q]) / 1e3);
+            }
+            printf("\"max\": %.1f, \"mean\": %.1f}", hs[h]->max_ns / 1e3,
+                   hs[h]->count ? hs[h]->sum_ns / 1e3 / hs[h]->count : 0.0);
+        }
+        printf("}\n");
+        return;
+    }
+
+    printf("%s loop, %d connections (%lu connected), %d threads, %d byte %s messages, depth %d\n",
+           opt.rate > 0 ? "open" : "closed", opt.conns, (unsigned long)connected, opt.threads,
+           opt.msg_size, opt.binary ? "binary" : "text", opt.depth);
+    printf("%lu messages in %.2fs: %.0f msgs/s, %.2f MB/s payload, %lu errors\n",
+           (unsigned long)messages, secs, msgs_per_sec, mb_per_sec, (unsigned long)errors);
+    printf("%-12s %10s %10s\n", "latency(us)", "corrected", "raw");
+    for (int q = 0; q < 4; q++) {
+        printf("%-12s %10.1f %10.1f\n", qnames[q], histogram_percentile(corrected, qs[q]) / 1e3,
+               histogram_percentile(uncorrected, qs[q]) / 1e3);
+    }
+    printf("%-12s %10.1f %10.1f\n", "max", corrected->max_ns / 1e3, uncorrected->max_ns / 1e3);
+}
+
+
+// An addrinfo for a Unix socket path, @NAME for the abstract namespace.
+static struct addrinfo* unix_addr(const char* path) {
+    static struct sockaddr_un addr;
+    static struct addrinfo ai;
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "bad unix socket path '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, len);
+    if (path[0] == '@') {
+        addr.sun_path[0] = '\0';
+    }
+    ai.ai_family = AF_UNIX;
+    ai.ai_socktype = SOCK_STREAM;
+    ai.ai_addr = (struct sockaddr*)&addr;
+    ai.ai_addrlen = offsetof(struct sockaddr_un, sun_path) + len + (path[0] != '@');
+    return &ai;
+}
+
+
+int main(int argc, char** argv) {
+    int c;
+    while ((c = getopt(argc, argv, "h:p:c:t:d:s:P:r:e:Bj")) != -1) {
+        switch (c) {
+        case 'h': opt.host = optarg; break;
+        case 'p': opt.port = optarg; break;
+        case 'c': opt.conns = atoi(optarg); break;
+        case 't': opt.threads = atoi(optarg); break;
+        case 'd': opt.duration = atoi(optarg); break;
+        case 's': opt.msg_size = atoi(optarg); break;
+        case 'P': opt.depth = atoi(optarg); break;
+        case 'r':
+            opt.rate = atof(optarg);
+            if (!isfinite(opt.rate) || opt.rate <= 0) {
+                fprintf(stderr, "rate must be a positive number of messages per second\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'e': opt.expected_ns = (uint64_t)(atof(optarg) * 1000); break;
+        case 'B': opt.binary = true; break;
+        case 'j': opt.json = true; break;
+        default:
+            fprintf(stderr, "usage: %s [-h host] [-p port] [-c conns] [-t threads] [-d secs] "
+                            "[-s msg_size] [-P depth] [-r msgs_per_sec] [-e expected_us] [-B] [-j]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (opt.conns < 1 || opt.msg_size < 1 || opt.depth < 1 || opt.duration < 1) {
+        fprintf(stderr, "connections, message size, depth and duration must be positive\n");
+        return EXIT_FAILURE;
+    }
+    if (opt.threads < 1) {
+        opt.threads = 1;
+    }
+    frame_header.len = htonl(opt.msg_size);
+    frame_header.type = FRAME_DATA;
+    if (opt.threads > opt.conns) {
+        opt.threads = opt.conns;
+    }
+    if (opt.rate > 1e9 * opt.threads) {
+        // messages are scheduled on a nanosecond grid per thread
+        fprintf(stderr, "rate must be at most %.0f messages per second with %d threads\n",
+                1e9 * opt.threads, opt.threads);
+        return EXIT_FAILURE;
+    }
+
+    if (strncmp(opt.host, "unix:", 5) == 0) {
+        server_addr = unix_addr(opt.host + 5);
+    } else {
+        struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+        int rc = getaddrinfo(opt.host, opt.port, &hints, &server_addr);
+        if (rc != 0) {
+            fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+            return EXIT_FAILURE;
+        }
+    }
+    raise_fd_limit(opt.conns + opt.threads + 16);
+
+    worker_t* workers = calloc(opt.threads, sizeof(worker_t));
+    conn_t* conns = calloc(opt.conns, sizeof(conn_t));
+    if (workers == NULL || conns == NULL) {
+        die("calloc");
+    }
+    int assigned = 0;
+    for (int i = 0; i < opt.threads; i++) {
+        worker_t* w = &workers[i];
+        w->id = i;
+        w->nconns = opt.conns / opt.threads + (i < opt.conns % opt.threads);
+        w->conns = conns + assigned;
+        assigned += w->nconns;
+        w->rate = opt.rate / opt.threads;
+        if (w->rate > 0) {
+            w->interval_ns = (uint64_t)(1e9 / w->rate);
+            if (w->interval_ns < 1) {
+                w->interval_ns = 1;
+            }
+        }
+        w->epollfd = epoll_create1(0);
+        if (w->epollfd < 0) {
+            die("epoll_create1");
+        }
+    }
+
+    uint64_t start = hist_now_ns();
+    for (int i = 0; i < opt.threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            die("pthread_create");
+        }
+    }
+
+    static histogram_t corrected, uncorrected;
+    uint64_t messages = 0, errors = 0, connected = 0;
+    for (int i = 0; i < opt.threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        histogram_merge(&corrected, &workers[i].corrected);
+        histogram_merge(&uncorrected, &workers[i].uncorrected);
+        messages += workers[i].messages;
+        errors += workers[i].errors;
+        connected += workers[i].connected;
+        close(workers[i].epollfd);
+    }
+    double secs = (hist_now_ns() - start) / 1e9;
+    if (secs > opt.duration) {
+        // don't let the drain phase dilute throughput
+        secs = opt.duration;
+    }
+
+    print_report(&corrected, &uncorrected, messages, errors, connected, secs);
+    if (server_addr->ai_family != AF_UNIX) {
+        freeaddrinfo(server_addr);
+    }
+    free(conns);
+    free(workers);
+    return errors && !messages ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,258 @@
+// Connection state layout benchmark.
+//
+// Simulates event dispatch over N connections: for a random ready fd, read
+// the peer's state and send offsets, update them and its activity stamp, as
+// on_peer_ready does. Compares
+//   inline      the previous peer_state_t, send buffer embedded (~1.1 KB/fd)
+//   hot/cold    the current 64-byte peer_state_t, buffers and address apart
+// and reports ns per event plus, where the kernel exposes them, cache and
+// dTLB miss counts per event from perf_event_open.
+//
+//   peer-layout-bench [-n connections,...] [-e events]
+
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "server.h"
+
+#define MAX_SIZES           16
+#define DEFAULT_EVENTS      (4 * 1000 * 1000)
+#define OLD_SENDBUF_SIZE    1024
+
+// peer_state_t before the hot/cold split
+typedef struct {
+    ProcessingState state;
+    uint8_t sendbuf[OLD_SENDBUF_SIZE];
+    int sendbuf_end;
+    int sendptr;
+    uint64_t msg_start_ns;
+    uint64_t last_activity_ns;
+    uint64_t last_send_ns;
+    tw_timer_t timer;
+    bool open;
+    struct sockaddr_in addr;
+} old_peer_state_t;
+
+enum { CTR_CACHE_MISSES, CTR_L1D_MISSES, CTR_DTLB_MISSES, NUM_CTRS };
+
+static const char* ctr_names[NUM_CTRS] = {"cache-miss/ev", "L1d-miss/ev", "dTLB-miss/ev"};
+
+typedef struct {
+    int fd[NUM_CTRS];
+    uint64_t count[NUM_CTRS];
+} counters_t;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+static int open_counter(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+static uint64_t cache_config(uint64_t cache, uint64_t result) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (result << 16);
+}
+
+
+// Counters the kernel or the hardware does not offer stay at fd -1.
+static void counters_open(counters_t* c) {
+    c->fd[CTR_CACHE_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    c->fd[CTR_L1D_MISSES] = open_counter(PERF_TYPE_HW_CACHE,
+        cache_config(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS));
+    c->fd[CTR_DTLB_MISSES] = open_counter(PERF_TYPE_HW_CACHE,
+        cache_config(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_RESULT_MISS));
+}
+
+
+static void counters_start(counters_t* c) {
+    for (int i = 0; i < NUM_CTRS; i++) {
+        if (c->fd[i] >= 0) {
+            ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+
+static void counters_stop(counters_t* c) {
+    for (int i = 0; i < NUM_CTRS; i++) {
+        c->count[i] = 0;
+        if (c->fd[i] >= 0) {
+            ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(c->fd[i], &c->count[i], sizeof(uint64_t)) != sizeof(uint64_t)) {
+                c->count[i] = 0;
+            }
+        }
+    }
+}
+
+
+static void counters_close(counters_t* c) {
+    for (int i = 0; i < NUM_CTRS; i++) {
+        if (c->fd[i] >= 0) {
+            close(c->fd[i]);
+        }
+    }
+}
+
+
+// Random ready fds, drawn once so both layouts see the same sequence.
+static int* make_schedule(int nconns, long events) {
+    int* order = malloc(events * sizeof(int));
+    uint64_t x = 0x9e3779b97f4a7c15ull;
+    for (long i = 0; i < events; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        order[i] = (int)(x % (uint64_t)nconns);
+    }
+    return order;
+}
+
+
+static uint64_t run_inline(const int* order, int nconns, long events) {
+    old_peer_state_t* table = calloc(nconns, sizeof(*table));
+    for (int i = 0; i < nconns; i++) {
+        table[i].open = true;
+    }
+    uint64_t sum = 0;
+    for (long i = 0; i < events; i++) {
+        old_peer_state_t* peer = &table[order[i]];
+        if (peer->sendptr < peer->sendbuf_end) {
+            peer->sendptr++;
+        } else {
+            peer->state = peer->state == IN_MSG ? WAIT_FOR_MSG : IN_MSG;
+            peer->sendptr = peer->sendbuf_end = 0;
+        }
+        peer->last_activity_ns = i;
+        sum += peer->state + peer->open;
+    }
+    free(table);
+    return sum;
+}
+
+
+static uint64_t run_hot(const int* order, int nconns, long events) {
+    peer_state_t* table = aligned_alloc(64, nconns * sizeof(*table));
+    peer_info_t* info = calloc(nconns, sizeof(*info));
+    memset(table, 0, nconns * sizeof(*table));
+    for (int i = 0; i < nconns; i++) {
+        table[i].open = true;
+    }
+    uint64_t sum = 0;
+    for (long i = 0; i < events; i++) {
+        peer_state_t* peer = &table[order[i]];
+        // a queued reply lives in the pool, off the dispatch path
+        if (peer->sendbuf) {
+            peer->sendbuf = NULL;
+        } else {
+            peer->state = peer->state == IN_MSG ? WAIT_FOR_MSG : IN_MSG;
+        }
+        peer->last_activity_ns = i;
+        sum += peer->state + peer->open;
+    }
+    free(info);
+    free(table);
+    return sum;
+}
+
+
+static void run_layout(const char* name, uint64_t (*run)(const int*, int, long),
+                       const int* order, int nconns, long events, counters_t* c) {
+    // warm up page tables and caches at this size first
+    volatile uint64_t sink = run(order, nconns, events / 10);
+    counters_start(c);
+    uint64_t start = now_ns();
+    sink += run(order, nconns, events);
+    uint64_t elapsed = now_ns() - start;
+    counters_stop(c);
+    (void)sink;
+
+    printf("%8d  %-9s %9.2f", nconns, name, (double)elapsed / events);
+    for (int i = 0; i < NUM_CTRS; i++) {
+        if (c->fd[i] >= 0) {
+            printf("  %13.3f", (double)c->count[i] / events);
+        } else {
+            printf("  %13s", "n/a");
+        }
+    }
+    printf("\n");
+}
+
+
+static int parse_list(const char* arg, int* out) {
+    int n = 0;
+    char* copy = strdup(arg);
+    for (char* tok = strtok(copy, ","); tok && n < MAX_SIZES; tok = strtok(NULL, ",")) {
+        out[n++] = atoi(tok);
+    }
+    free(copy);
+    return n;
+}
+
+
+int main(int argc, char** argv) {
+    int sizes[MAX_SIZES] = {1000, 10000, 100000, 1000000};
+    int nsizes = 4;
+    long events = DEFAULT_EVENTS;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:e:")) != -1) {
+        switch (opt) {
+        case 'n':
+            nsizes = parse_list(optarg, sizes);
+            break;
+        case 'e':
+            events = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n connections,...] [-e events]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    counters_t c;
+    counters_open(&c);
+    printf("peer_state_t: inline %zu bytes, hot %zu bytes + cold %zu bytes\n",
+           sizeof(old_peer_state_t), sizeof(peer_state_t), sizeof(peer_info_t));
+    if (c.fd[CTR_CACHE_MISSES] < 0 && c.fd[CTR_L1D_MISSES] < 0 && c.fd[CTR_DTLB_MISSES] < 0) {
+        printf("hardware counters unavailable here, timing only\n");
+    }
+    printf("%8s  %-9s %9s", "conns", "layout", "ns/event");
+    for (int i = 0; i < NUM_CTRS; i++) {
+        printf("  %13s", ctr_names[i]);
+    }
+    printf("\n");
+
+    int* order = NULL;
+    for (int s = 0; s < nsizes; s++) {
+        order = make_schedule(sizes[s], events);
+        run_layout("inline", run_inline, order, sizes[s], events, &c);
+        run_layout("hot/cold", run_hot, order, sizes[s], events, &c);
+        free(order);
+    }
+    counters_close(&c);
+    return 0;
+}
@@ -0,0 +1,444 @@
+// Replays a captured trace (trace.h, servers' --capture) against a server.
+//
+// Every connection of the trace is opened, sent the bytes it sent then and
+// closed again, at the original pacing (scaled by -x) or, with -f, as fast as
+// the server takes them. Sends point straight into the read-only mapping of
+// the trace; replies are read and counted but not checked. In paced mode the
+// report includes how late records went out against their schedule.
+// The host may be an IPv6 address, or unix:PATH / unix:@NAME for a Unix
+// socket (the port is ignored then).
+//
+//   replay [-h host] [-p port] [-f] [-x speed] [-t drain_secs] [-j] trace
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "histogram.h"
+#include "trace.h"
+
+#define MAX_EVENTS          256
+#define MAX_IOV             64
+#define RECV_BUF_SIZE       (64 * 1024)
+#define FAST_POLL_RECORDS   64              /* -f: look for replies every this many records */
+
+typedef struct {
+    const uint8_t* data;                    /* in the trace mapping */
+    uint32_t len;
+} seg_t;
+
+typedef struct {
+    int fd;                                 /* -1 unless open */
+    bool connecting;
+    bool closing;                           /* CLOSE seen: shut down writes once drained */
+    bool write_shut;
+    uint32_t events;                        /* registered with epoll */
+    seg_t* segs;                            /* queued output, segs[head..nsegs) */
+    int head;
+    int nsegs;
+    int cap;
+    uint32_t seg_off;                       /* sent of segs[head] */
+} conn_t;
+
+static struct {
+    const char* host;
+    const char* port;
+    bool fast;
+    double speed;
+    int drain_secs;
+    bool json;
+} opt = {"localhost", "9090", false, 1.0, 10, false};
+
+static struct {
+    uint64_t opened;
+    uint64_t failed;                        /* connect or I/O errors */
+    uint64_t records;
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+} stats;
+
+static struct addrinfo* server_addr;
+static int epollfd;
+static conn_t* conns;
+static uint32_t nconns;
+static int open_conns;
+static histogram_t lag;                     /* paced mode: sent after its due time */
+
+
+static conn_t* get_conn(uint32_t id) {
+    if (id >= nconns) {
+        uint32_t n = nconns ? nconns : 1024;
+        while (n <= id) {
+            n *= 2;
+        }
+        conns = realloc(conns, n * sizeof(conn_t));
+        if (conns == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        for (uint32_t i = nconns; i < n; i++) {
+            memset(&conns[i], 0, sizeof(conn_t));
+            conns[i].fd = -1;
+        }
+        nconns = n;
+    }
+    return &conns[id];
+}
+
+
+static void watch(conn_t* c, uint32_t events) {
+    if (events == c->events) {
+        return;
+    }
+    struct epoll_event ev = {.events = events, .data.u32 = (uint32_t)(c - conns)};
+    if (epoll_ctl(epollfd, c->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    c->events = events;
+}
+
+
+static void conn_close(conn_t* c, bool failed) {
+    if (c->fd < 0) {
+        return;
+    }
+    close(c->fd);
+    c->fd = -1;
+    c->events = 0;
+    free(c->segs);
+    c->segs = NULL;
+    c->head = c->nsegs = c->cap = 0;
+    open_conns--;
+    if (failed) {
+        stats.failed++;
+    }
+}
+
+
+static void conn_open(conn_t* c) {
+    if (c->fd >= 0) {
+        conn_close(c, false);
+    }
+    c->connecting = c->closing = c->write_shut = false;
+    c->fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    open_conns++;
+    stats.opened++;
+    if (connect(c->fd, server_addr->ai_addr, server_addr->ai_addrlen) < 0) {
+        if (errno != EINPROGRESS) {
+            conn_close(c, true);
+            return;
+        }
+        c->connecting = true;
+    }
+    watch(c, EPOLLIN | (c->connecting ? EPOLLOUT : 0));
+}
+
+
+// Sends as much of the queue as the socket takes, then shuts down writing if
+// the trace closed the connection.
+static void conn_flush(conn_t* c) {
+    while (c->head < c->nsegs) {
+        struct iovec iov[MAX_IOV];
+        int n = 0;
+        for (int i = c->head; i < c->nsegs && n < MAX_IOV; i++, n++) {
+            uint32_t skip = i == c->head ? c->seg_off : 0;
+            iov[n].iov_base = (void*)(c->segs[i].data + skip);
+            iov[n].iov_len = c->segs[i].len - skip;
+        }
+        struct msghdr mh = {.msg_iov = iov, .msg_iovlen = n};
+        ssize_t sent = sendmsg(c->fd, &mh, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(c, EPOLLIN | EPOLLOUT);
+                return;
+            }
+            conn_close(c, true);
+            return;
+        }
+        stats.bytes_out += sent;
+        while (sent > 0) {
+            uint32_t left = c->segs[c->head].len - c->seg_off;
+            if ((size_t)sent < left) {
+                c->seg_off += sent;
+                break;
+            }
+            sent -= left;
+            c->seg_off = 0;
+            c->head++;
+        }
+    }
+    c->head = c->nsegs = 0;
+    watch(c, EPOLLIN);
+    if (c->closing && !c->write_shut) {
+        // the server closes its side on EOF; its last replies arrive first
+        shutdown(c->fd, SHUT_WR);
+        c->write_shut = true;
+    }
+}
+
+
+static void conn_send(conn_t* c, const uint8_t* data, uint32_t len) {
+    if (c->nsegs == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 16;
+        c->segs = realloc(c->segs, c->cap * sizeof(seg_t));
+        if (c->segs == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    c->segs[c->nsegs++] = (seg_t){data, len};
+    if (!c->connecting && c->nsegs - c->head == 1) {
+        conn_flush(c);
+    }
+}
+
+
+static void conn_event(conn_t* c, uint32_t events) {
+    if (c->fd < 0) {
+        return;
+    }
+    if (c->connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            conn_close(c, true);
+            return;
+        }
+        c->connecting = false;
+        conn_flush(c);
+        if (c->fd < 0) {
+            return;
+        }
+    } else if (events & EPOLLOUT) {
+        conn_flush(c);
+        if (c->fd < 0) {
+            return;
+        }
+    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        static uint8_t buf[RECV_BUF_SIZE];
+        while (1) {
+            ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                stats.bytes_in += n;
+                continue;
+            }
+            if (n == 0) {
+                // a close before the trace's own means the server gave up on it
+                conn_close(c, !c->closing);
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn_close(c, true);
+            }
+            return;
+        }
+    }
+}
+
+
+static int poll_events(int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epollfd, events, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        conn_event(&conns[events[i].data.u32], events[i].events);
+    }
+    return n;
+}
+
+
+static void apply(const trace_record_t* rec) {
+    conn_t* c = get_conn(rec->conn);
+    switch (rec->type) {
+    case TRACE_OPEN:
+        conn_open(c);
+        break;
+    case TRACE_DATA:
+        if (c->fd >= 0 && !c->closing && rec->len) {
+            conn_send(c, trace_payload(rec), rec->len);
+        }
+        break;
+    case TRACE_CLOSE:
+        if (c->fd >= 0 && !c->closing) {
+            c->closing = true;
+            if (!c->connecting && c->head == c->nsegs) {
+                conn_flush(c);
+            }
+        }
+        break;
+    default:
+        // a newer writer's record: skip it
+        break;
+    }
+    stats.records++;
+}
+
+
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+
+// An addrinfo for a Unix socket path, @NAME for the abstract namespace.
+static struct addrinfo* unix_addr(const char* path) {
+    static struct sockaddr_un addr;
+    static struct addrinfo ai;
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "bad unix socket path '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, len);
+    if (path[0] == '@') {
+        addr.sun_path[0] = '\0';
+    }
+    ai.ai_family = AF_UNIX;
+    ai.ai_socktype = SOCK_STREAM;
+    ai.ai_addr = (struct sockaddr*)&addr;
+    ai.ai_addrlen = offsetof(struct sockaddr_un, sun_path) + len + (path[0] != '@');
+    return &ai;
+}
+
+
+static void print_report(double secs, double trace_secs, bool drained) {
+    if (opt.json) {
+        printf("{\"mode\": \"%s\", \"speed\": %.3f, \"connections\": %lu, \"failed\": %lu, "
+               "\"records\": %lu, \"bytes_out\": %lu, \"bytes_in\": %lu, \"secs\": %.3f, "
+               "\"trace_secs\": %.3f, \"mb_per_sec\": %.3f, \"drained\": %s, "
+               "\"lag_us\": {\"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f}}\n",
+               opt.fast ? "fast" : "paced", opt.speed, (unsigned long)stats.opened,
+               (unsigned long)stats.failed, (unsigned long)stats.records,
+               (unsigned long)stats.bytes_out, (unsigned long)stats.bytes_in, secs, trace_secs,
+               stats.bytes_out / secs / 1e6, drained ? "true" : "false",
+               histogram_percentile(&lag, 0.50) / 1e3, histogram_percentile(&lag, 0.99) / 1e3,
+               lag.max_ns / 1e3);
+        return;
+    }
+    printf("replayed %lu records of a %.2fs trace in %.2fs (%s)\n", (unsigned long)stats.records,
+           trace_secs, secs, opt.fast ? "as fast as possible" : "paced");
+    printf("%lu connections, %lu failed%s\n", (unsigned long)stats.opened,
+           (unsigned long)stats.failed, drained ? "" : ", some still open at the drain timeout");
+    printf("sent %lu bytes (%.2f MB/s), received %lu bytes\n", (unsigned long)stats.bytes_out,
+           stats.bytes_out / secs / 1e6, (unsigned long)stats.bytes_in);
+    if (!opt.fast) {
+        printf("lag behind schedule: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+               histogram_percentile(&lag, 0.50) / 1e3, histogram_percentile(&lag, 0.99) / 1e3,
+               lag.max_ns / 1e3);
+    }
+}
+
+
+int main(int argc, char** argv) {
+    int c;
+    while ((c = getopt(argc, argv, "h:p:fx:t:j")) != -1) {
+        switch (c) {
+        case 'h': opt.host = optarg; break;
+        case 'p': opt.port = optarg; break;
+        case 'f': opt.fast = true; break;
+        case 'x': opt.speed = atof(optarg); break;
+        case 't': opt.drain_secs = atoi(optarg); break;
+        case 'j': opt.json = true; break;
+        default:
+            fprintf(stderr, "usage: %s [-h host] [-p port] [-f] [-x speed] [-t drain_secs] [-j] "
+                            "trace\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1 || opt.speed <= 0) {
+        fprintf(stderr, "usage: %s [-h host] [-p port] [-f] [-x speed] [-t drain_secs] [-j] "
+                        "trace\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    trace_reader_t trace;
+    if (trace_reader_open(&trace, argv[optind]) < 0) {
+        return EXIT_FAILURE;
+    }
+    if (strncmp(opt.host, "unix:", 5) == 0) {
+        server_addr = unix_addr(opt.host + 5);
+    } else {
+        struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+        int rc = getaddrinfo(opt.host, opt.port, &hints, &server_addr);
+        if (rc != 0) {
+            fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+            return EXIT_FAILURE;
+        }
+    }
+    raise_fd_limit();
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd < 0) {
+        perror("epoll_create1");
+        return EXIT_FAILURE;
+    }
+
+    uint64_t start = hist_now_ns();
+    uint64_t first_t = 0;
+    uint64_t last_t = 0;
+    bool first = true;
+    const trace_record_t* rec;
+    while ((rec = trace_next(&trace)) != NULL) {
+        if (first) {
+            first_t = rec->t_ns;
+            first = false;
+        }
+        last_t = rec->t_ns;
+        if (opt.fast) {
+            if (stats.records % FAST_POLL_RECORDS == 0) {
+                poll_events(0);
+            }
+        } else {
+            uint64_t due = start + (uint64_t)((rec->t_ns - first_t) / opt.speed);
+            uint64_t now;
+            while ((now = hist_now_ns()) < due) {
+                poll_events((int)((due - now) / 1000000));
+            }
+            histogram_record(&lag, now - due);
+        }
+        apply(rec);
+    }
+
+    // connections the capture left open end with the trace
+    for (uint32_t i = 0; i < nconns; i++) {
+        if (conns[i].fd >= 0 && !conns[i].closing) {
+            conns[i].closing = true;
+            if (!conns[i].connecting && conns[i].head == conns[i].nsegs) {
+                conn_flush(&conns[i]);
+            }
+        }
+    }
+    uint64_t drain_deadline = hist_now_ns() + (uint64_t)opt.drain_secs * 1000000000ull;
+    while (open_conns > 0 && hist_now_ns() < drain_deadline) {
+        poll_events(100);
+    }
+
+    double secs = (hist_now_ns() - start) / 1e9;
+    print_report(secs, (last_t - first_t) / 1e9, open_conns == 0);
+
+    trace_reader_close(&trace);
+    if (server_addr->ai_family != AF_UNIX) {
+        freeaddrinfo(server_addr);
+    }
+    return stats.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
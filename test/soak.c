@@ -0,0 +1,412 @@
+// Idle-connection soak test.
+//
+// Starts a server binary, opens -c mostly idle connections to it plus -a
+// active ones that each send -r small messages per second, and samples every
+// -i seconds: server RSS and memory per connection, thread count, event-loop
+// wakeups (from the server's metrics segment), connections the server has
+// closed, and latency of the active connections.
+//
+//   soak -b bin/epoll-server [-p port] [-c idle] [-a active] [-r msgs/s]
+//        [-d secs] [-i secs] [-j] [-- server args...]
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histogram.h"
+#include "metrics.h"
+
+#define ACTIVE_MSG          "^soak$"
+#define ACTIVE_REPLY        "tpbl"
+#define REPLY_TIMEOUT_MS    1000
+
+static struct {
+    const char* binary;
+    int port;
+    int idle;
+    int active;
+    double rate;
+    int duration;
+    int interval;
+    bool json;
+    char** server_args;
+    int nserver_args;
+} opt = {NULL, 9090, 1000, 10, 10, 30, 5, false, NULL, 0};
+
+typedef struct {
+    double t;
+    int open;
+    long rss_kb;
+    int threads;
+    double wakeups_per_sec;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t messages;
+    uint64_t errors;
+} sample_t;
+
+
+static void die(const char* msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+
+static double now_sec(void) {
+    return hist_now_ns() / 1e9;
+}
+
+
+static void raise_fd_limit(int needed) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        die("getrlimit");
+    }
+    if (rl.rlim_cur >= (rlim_t)needed) {
+        return;
+    }
+    if (rl.rlim_max < (rlim_t)needed) {
+        // Only root can raise the hard limit; try, then settle for the max.
+        struct rlimit want = {needed, needed};
+        if (setrlimit(RLIMIT_NOFILE, &want) == 0) {
+            return;
+        }
+        fprintf(stderr, "RLIMIT_NOFILE hard limit %lu < %d, capping\n",
+                (unsigned long)rl.rlim_max, needed);
+        rl.rlim_cur = rl.rlim_max;
+    } else {
+        rl.rlim_cur = needed;
+    }
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        die("setrlimit");
+    }
+}
+
+
+// Reads a "Key:   value" line from /proc/<pid>/status.
+static long proc_status(pid_t pid, const char* key) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    long value = -1;
+    size_t keylen = strlen(key);
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, key, keylen) == 0 && line[keylen] == ':') {
+            value = atol(line + keylen + 1);
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+
+static pid_t start_server(void) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        die("fork");
+    }
+    if (pid == 0) {
+        char port[16];
+        snprintf(port, sizeof(port), "%d", opt.port);
+        char** argv = calloc(opt.nserver_args + 3, sizeof(char*));
+        argv[0] = (char*)opt.binary;
+        argv[1] = port;
+        for (int i = 0; i < opt.nserver_args; i++) {
+            argv[i + 2] = opt.server_args[i];
+        }
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        execv(opt.binary, argv);
+        perror("execv");
+        _exit(127);
+    }
+    return pid;
+}
+
+
+static int connect_once(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(opt.port)};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+// The first connection doubles as the readiness probe, so the server never
+// sees a connection that is opened and immediately dropped.
+static int connect_first(pid_t server) {
+    for (int tries = 0; tries < 100; tries++) {
+        int fd = connect_once();
+        if (fd >= 0) {
+            return fd;
+        }
+        if (waitpid(server, NULL, WNOHANG) == server) {
+            fprintf(stderr, "server exited during startup\n");
+            exit(EXIT_FAILURE);
+        }
+        usleep(50 * 1000);
+    }
+    fprintf(stderr, "server did not start listening on port %d\n", opt.port);
+    exit(EXIT_FAILURE);
+}
+
+
+static bool wait_readable(int fd, int timeout_ms) {
+    struct pollfd p = {.fd = fd, .events = POLLIN};
+    return poll(&p, 1, timeout_ms) == 1;
+}
+
+
+// One request/response on an active connection. Returns false if the
+// connection is unusable.
+static bool active_roundtrip(int fd, histogram_t* h) {
+    uint64_t start = hist_now_ns();
+    if (send(fd, ACTIVE_MSG, strlen(ACTIVE_MSG), MSG_NOSIGNAL) < 0) {
+        return false;
+    }
+    char buf[16];
+    size_t got = 0;
+    while (got < strlen(ACTIVE_REPLY)) {
+        if (!wait_readable(fd, REPLY_TIMEOUT_MS)) {
+            return false;
+        }
+        ssize_t n = recv(fd, buf + got, sizeof(buf) - got, 0);
+        if (n <= 0) {
+            return false;
+        }
+        got += n;
+    }
+    histogram_record(h, hist_now_ns() - start);
+    return memcmp(buf, ACTIVE_REPLY, strlen(ACTIVE_REPLY)) == 0;
+}
+
+
+// Drains anything the server sent on idle connections (its '*' ack) and
+// counts the ones it has closed.
+static int reap_idle(int* fds, int n) {
+    static struct pollfd* pfds;
+    static int npfds;
+    if (npfds < n) {
+        pfds = realloc(pfds, n * sizeof(*pfds));
+        npfds = n;
+    }
+    for (int i = 0; i < n; i++) {
+        pfds[i] = (struct pollfd){.fd = fds[i], .events = POLLIN};
+    }
+    int closed = 0;
+    if (poll(pfds, n, 0) > 0) {
+        for (int i = 0; i < n; i++) {
+            if (fds[i] < 0 || !(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            char buf[64];
+            ssize_t r = recv(fds[i], buf, sizeof(buf), MSG_DONTWAIT);
+            if (r == 0 || (r < 0 && errno != EAGAIN)) {
+                close(fds[i]);
+                fds[i] = -1;
+                closed++;
+            }
+        }
+    }
+    return closed;
+}
+
+
+static void print_sample(const sample_t* s, long base_rss_kb, int conns) {
+    double per_conn = conns ? (double)(s->rss_kb - base_rss_kb) * 1024 / conns : 0;
+    if (opt.json) {
+        printf("{\"t\": %.1f, \"open\": %d, \"rss_kb\": %ld, \"bytes_per_conn\": %.0f, "
+               "\"threads\": %d, \"wakeups_per_sec\": %.1f, \"active_p50_us\": %.1f, "
+               "\"active_p99_us\": %.1f, \"active_messages\": %lu, \"active_errors\": %lu}\n",
+               s->t, s->open, s->rss_kb, per_conn, s->threads, s->wakeups_per_sec,
+               s->p50_ns / 1e3, s->p99_ns / 1e3, (unsigned long)s->messages,
+               (unsigned long)s->errors);
+    } else {
+        printf("%7.1f %7d %9ld %10.0f %7d %9.1f %9.1f %9.1f %8lu %6lu\n",
+               s->t, s->open, s->rss_kb, per_conn, s->threads, s->wakeups_per_sec,
+               s->p50_ns / 1e3, s->p99_ns / 1e3, (unsigned long)s->messages,
+               (unsigned long)s->errors);
+    }
+    fflush(stdout);
+}
+
+
+int main(int argc, char** argv) {
+    int c;
+    while ((c = getopt(argc, argv, "b:p:c:a:r:d:i:j")) != -1) {
+        switch (c) {
+        case 'b': opt.binary = optarg; break;
+        case 'p': opt.port = atoi(optarg); break;
+        case 'c': opt.idle = atoi(optarg); break;
+        case 'a': opt.active = atoi(optarg); break;
+        case 'r': opt.rate = atof(optarg); break;
+        case 'd': opt.duration = atoi(optarg); break;
+        case 'i': opt.interval = atoi(optarg); break;
+        case 'j': opt.json = true; break;
+        default:
+            fprintf(stderr, "usage: %s -b server [-p port] [-c idle] [-a active] [-r msgs/s] "
+                            "[-d secs] [-i secs] [-j] [-- server args]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (opt.binary == NULL) {
+        fprintf(stderr, "-b <server binary> is required\n");
+        return EXIT_FAILURE;
+    }
+    opt.server_args = argv + optind;
+    opt.nserver_args = argc - optind;
+    if (opt.interval < 1) {
+        opt.interval = 1;
+    }
+    if (opt.rate <= 0) {
+        opt.rate = 1;
+    }
+
+    // Both ends need a descriptor per connection; the server inherits this.
+    int total = opt.idle + opt.active;
+    raise_fd_limit(total + 64);
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t server = start_server();
+    int* idle_fds = calloc(opt.idle + 1, sizeof(int));
+    int* active_fds = calloc(opt.active + 1, sizeof(int));
+    if (idle_fds == NULL || active_fds == NULL) {
+        die("calloc");
+    }
+    int first = connect_first(server);
+    usleep(200 * 1000);
+    long base_rss = proc_status(server, "VmRSS");
+
+    // Active connections first so they are accepted even by servers that
+    // stop accepting once they run out of threads or slots.
+    int nactive = 0;
+    active_fds[nactive++] = first;
+    while (nactive < opt.active) {
+        int fd = connect_once();
+        if (fd < 0) {
+            break;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        active_fds[nactive++] = fd;
+    }
+    for (int i = 0; i < nactive; i++) {
+        char ack;
+        if (!wait_readable(active_fds[i], REPLY_TIMEOUT_MS) || recv(active_fds[i], &ack, 1, 0) != 1) {
+            close(active_fds[i]);
+            active_fds[i] = -1;
+        }
+    }
+
+    double t0 = now_sec();
+    int nidle = 0;
+    for (; nidle < opt.idle; nidle++) {
+        idle_fds[nidle] = connect_once();
+        if (idle_fds[nidle] < 0) {
+            fprintf(stderr, "connect failed after %d idle connections: %s\n", nidle, strerror(errno));
+            break;
+        }
+    }
+    fprintf(stderr, "opened %d idle and %d active connections in %.2fs (server RSS before: %ld kB)\n",
+            nidle, nactive, now_sec() - t0, base_rss);
+
+    if (!opt.json) {
+        printf("%7s %7s %9s %10s %7s %9s %9s %9s %8s %6s\n", "t(s)", "open", "rss(kB)",
+               "B/conn", "threads", "wake/s", "p50(us)", "p99(us)", "msgs", "errs");
+    }
+
+    const metrics_shm_t* shm = metrics_attach(server);
+    metrics_counters_t prev_counters = {0}, counters;
+    if (shm) {
+        metrics_sum(shm, &prev_counters);
+    }
+
+    static histogram_t interval_hist;
+    uint64_t messages = 0, errors = 0;
+    int open_idle = nidle;
+    double start = now_sec(), next_sample = start + opt.interval, next_send = start;
+    double prev_sample = start;
+
+    while (now_sec() - start < opt.duration) {
+        if (waitpid(server, NULL, WNOHANG) == server) {
+            fprintf(stderr, "server exited\n");
+            break;
+        }
+
+        double now = now_sec();
+        if (now >= next_send) {
+            for (int i = 0; i < nactive; i++) {
+                if (active_fds[i] < 0) {
+                    continue;
+                }
+                if (active_roundtrip(active_fds[i], &interval_hist)) {
+                    messages++;
+                } else {
+                    errors++;
+                    close(active_fds[i]);
+                    active_fds[i] = -1;
+                }
+            }
+            next_send += 1.0 / opt.rate;
+        }
+
+        now = now_sec();
+        if (now >= next_sample) {
+            open_idle -= reap_idle(idle_fds, nidle);
+            sample_t s = {.t = now - start, .open = open_idle};
+            for (int i = 0; i < nactive; i++) {
+                s.open += active_fds[i] >= 0;
+            }
+            s.rss_kb = proc_status(server, "VmRSS");
+            s.threads = (int)proc_status(server, "Threads");
+            if (shm) {
+                metrics_sum(shm, &counters);
+                s.wakeups_per_sec = (counters.loop_wakeups - prev_counters.loop_wakeups) / (now - prev_sample);
+                prev_counters = counters;
+            }
+            s.p50_ns = histogram_percentile(&interval_hist, 0.50);
+            s.p99_ns = histogram_percentile(&interval_hist, 0.99);
+            s.messages = messages;
+            s.errors = errors;
+            print_sample(&s, base_rss, nidle + nactive);
+            memset(&interval_hist, 0, sizeof(interval_hist));
+            prev_sample = now;
+            next_sample += opt.interval;
+        }
+
+        double wake = next_send < next_sample ? next_send : next_sample;
+        double sleep_s = wake - now_sec();
+        if (sleep_s > 0) {
+            usleep((useconds_t)(sleep_s * 1e6));
+        }
+    }
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    return 0;
+}
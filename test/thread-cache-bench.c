@@ -0,0 +1,217 @@
+// Connection thread setup benchmark.
+//
+// Compares the ways thread-server can start a connection's thread:
+//   create-8M    pthread_create + detach with default attributes, a malloc'ed
+//                argument per connection: the previous thread-server
+//   create-256K  the same with a bounded stack and guard
+//   cache        thread_cache_run, reusing parked threads
+// Each handler touches as much stack as serve_connection does. Runs
+//   serial      one connection at a time: dispatch-to-handler-start latency
+//               and connections per second including thread teardown
+//   burst       rounds of B connections open at once, then all closed:
+//               dispatch latency with B threads alive
+//
+//   thread-cache-bench [-n connections] [-b burst] [-r rounds]
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "histogram.h"
+#include "thread-cache.h"
+
+#define HANDLER_STACK_BYTES     (16 * 1024)
+#define BOUNDED_STACK           (256 * 1024)
+#define BOUNDED_GUARD           (16 * 1024)
+
+typedef struct {
+    uint64_t dispatch_ns;
+    sem_t* release;                         /* NULL: return at once */
+} conn_t;
+
+typedef struct {
+    const char* name;
+    int (*dispatch)(conn_t* conn);
+} mode_t_;
+
+static histogram_t start_hist;
+static pthread_mutex_t hist_lock = PTHREAD_MUTEX_INITIALIZER;
+static sem_t done;
+static pthread_attr_t bounded_attr;
+static thread_cache_t* cache;
+
+
+static void handler(void* arg) {
+    conn_t* conn = arg;
+    uint64_t started = hist_now_ns();
+    pthread_mutex_lock(&hist_lock);
+    histogram_record(&start_hist, started - conn->dispatch_ns);
+    pthread_mutex_unlock(&hist_lock);
+
+    volatile char frame[HANDLER_STACK_BYTES];
+    memset((char*)frame, 1, sizeof(frame));
+
+    if (conn->release) {
+        sem_wait(conn->release);
+    }
+    sem_post(&done);
+}
+
+
+typedef struct { conn_t* conn; } thread_config_t;
+
+
+static void* raw_thread(void* arg) {
+    thread_config_t* config = arg;
+    conn_t* conn = config->conn;
+    free(config);
+    handler(conn);
+    return NULL;
+}
+
+
+static int spawn(conn_t* conn, const pthread_attr_t* attr) {
+    thread_config_t* config = malloc(sizeof(*config));
+    config->conn = conn;
+    pthread_t thread;
+    if (pthread_create(&thread, attr, raw_thread, config) != 0) {
+        free(config);
+        return -1;
+    }
+    if (attr == NULL) {
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+
+static int dispatch_default(conn_t* conn) {
+    return spawn(conn, NULL);
+}
+
+
+static int dispatch_bounded(conn_t* conn) {
+    return spawn(conn, &bounded_attr);
+}
+
+
+static int dispatch_cache(conn_t* conn) {
+    return thread_cache_run(cache, handler, conn);
+}
+
+
+static void report(const char* mode, const char* test, double per_sec) {
+    printf("%-12s %-7s %10.0f %9.1f %9.1f %9.1f\n", mode, test, per_sec,
+           histogram_percentile(&start_hist, 0.50) / 1e3,
+           histogram_percentile(&start_hist, 0.99) / 1e3,
+           histogram_percentile(&start_hist, 0.999) / 1e3);
+}
+
+
+static void bench_serial(const mode_t_* mode, int connections) {
+    memset(&start_hist, 0, sizeof(start_hist));
+    conn_t conn = {0, NULL};
+    uint64_t start = hist_now_ns();
+    for (int i = 0; i < connections; i++) {
+        conn.dispatch_ns = hist_now_ns();
+        if (mode->dispatch(&conn) < 0) {
+            fprintf(stderr, "%s: dispatch failed\n", mode->name);
+            exit(EXIT_FAILURE);
+        }
+        sem_wait(&done);
+    }
+    report(mode->name, "serial", connections / ((hist_now_ns() - start) / 1e9));
+}
+
+
+static void bench_burst(const mode_t_* mode, int burst, int rounds) {
+    memset(&start_hist, 0, sizeof(start_hist));
+    conn_t* conns = calloc(burst, sizeof(conn_t));
+    sem_t release;
+    sem_init(&release, 0, 0);
+    uint64_t start = hist_now_ns();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < burst; i++) {
+            conns[i].release = &release;
+            conns[i].dispatch_ns = hist_now_ns();
+            if (mode->dispatch(&conns[i]) < 0) {
+                fprintf(stderr, "%s: dispatch failed\n", mode->name);
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (int i = 0; i < burst; i++) {
+            sem_post(&release);
+        }
+        for (int i = 0; i < burst; i++) {
+            sem_wait(&done);
+        }
+    }
+    report(mode->name, "burst", (double)burst * rounds / ((hist_now_ns() - start) / 1e9));
+    sem_destroy(&release);
+    free(conns);
+}
+
+
+int main(int argc, char** argv) {
+    int connections = 20000;
+    int burst = 256;
+    int rounds = 20;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:b:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            connections = atoi(optarg);
+            break;
+        case 'b':
+            burst = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n connections] [-b burst] [-r rounds]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    sem_init(&done, 0, 0);
+    pthread_attr_init(&bounded_attr);
+    pthread_attr_setdetachstate(&bounded_attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&bounded_attr, BOUNDED_STACK);
+    pthread_attr_setguardsize(&bounded_attr, BOUNDED_GUARD);
+    thread_cache_config_t config = {
+        .stack_size = BOUNDED_STACK,
+        .guard_size = BOUNDED_GUARD,
+        .max_threads = 0,
+        .max_idle = burst,
+    };
+    cache = thread_cache_create(&config);
+    if (cache == NULL) {
+        fprintf(stderr, "thread_cache_create failed\n");
+        return 1;
+    }
+
+    const mode_t_ modes[] = {
+        {"create-8M", dispatch_default},
+        {"create-256K", dispatch_bounded},
+        {"cache", dispatch_cache},
+    };
+
+    printf("%-12s %-7s %10s %9s %9s %9s\n", "mode", "test", "conns/s",
+           "p50us", "p99us", "p999us");
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        bench_serial(&modes[m], connections);
+        bench_burst(&modes[m], burst, rounds);
+    }
+
+    thread_cache_stats_t stats;
+    thread_cache_stats(cache, &stats);
+    printf("cache: %lu threads created, %lu connections on reused threads\n",
+           stats.created, stats.reused);
+    return 0;
+}
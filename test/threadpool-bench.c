@@ -0,0 +1,303 @@
+// Thread-pool microbenchmarks.
+//
+// For each pool size runs:
+//   submit      N empty jobs from one thread: submission and completion rate
+//   latency     submit-to-start latency of jobs submitted at a steady pace
+//   fanout      rounds of K jobs followed by threadpool_wait
+//   producers   N empty jobs submitted concurrently from P threads
+//   tiny/long   CPU-bound jobs of ~1us and ~200us: efficiency vs ideal
+// and, from threadpool_stats over all of them, worker utilization, the queue's
+// high-water mark and how often a worker found the queue empty.
+//
+//   threadpool-bench [-t 1,2,4,8] [-n jobs] [-p producers] [-j]
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "histogram.h"
+#include "thread-pool.h"
+
+#define MAX_POOL_SIZES      16
+#define FANOUT_JOBS         64
+#define FANOUT_ROUNDS       200
+#define LATENCY_JOBS        20000
+#define TINY_JOB_NS         1000
+#define LONG_JOB_NS         200000
+
+typedef struct {
+    int threads;
+    double submit_per_sec;                  /* single producer, enqueue only */
+    double complete_per_sec;                /* single producer, until all done */
+    uint64_t start_p50_ns;
+    uint64_t start_p99_ns;
+    uint64_t start_p999_ns;
+    double fanout_round_us;
+    double producers_per_sec;
+    double tiny_efficiency;
+    double long_efficiency;
+    double utilization;                     /* busy / (busy + idle), all workers */
+    int queue_high_water;
+    double parks_per_job;
+} result_t;
+
+static struct {
+    int sizes[MAX_POOL_SIZES];
+    int nsizes;
+    int jobs;
+    int producers;
+    bool json;
+} opt = {{1, 2, 4, 8}, 4, 200000, 4, false};
+
+static uint64_t* start_latency;             /* per job, filled by workers */
+
+
+static void empty_job(void* arg) {
+    (void)arg;
+}
+
+
+static void spin_ns(uint64_t ns) {
+    uint64_t end = hist_now_ns() + ns;
+    while (hist_now_ns() < end) {
+    }
+}
+
+
+static void tiny_job(void* arg) {
+    (void)arg;
+    spin_ns(TINY_JOB_NS);
+}
+
+
+static void long_job(void* arg) {
+    (void)arg;
+    spin_ns(LONG_JOB_NS);
+}
+
+
+typedef struct {
+    uint64_t submit_ns;
+    int index;
+} timed_job_t;
+
+
+static void timed_job(void* arg) {
+    timed_job_t* job = arg;
+    start_latency[job->index] = hist_now_ns() - job->submit_ns;
+}
+
+
+static void bench_submit(threadpool_* pool, result_t* r) {
+    uint64_t start = hist_now_ns();
+    for (int i = 0; i < opt.jobs; i++) {
+        threadpool_add_work(pool, empty_job, NULL);
+    }
+    uint64_t submitted = hist_now_ns();
+    threadpool_wait(pool);
+    uint64_t done = hist_now_ns();
+    r->submit_per_sec = opt.jobs / ((submitted - start) / 1e9);
+    r->complete_per_sec = opt.jobs / ((done - start) / 1e9);
+}
+
+
+static void bench_latency(threadpool_* pool, result_t* r) {
+    timed_job_t* jobs = calloc(LATENCY_JOBS, sizeof(timed_job_t));
+    start_latency = calloc(LATENCY_JOBS, sizeof(uint64_t));
+    if (jobs == NULL || start_latency == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    // Pace submissions so the queue stays short and we measure wakeup cost
+    // rather than queueing.
+    for (int i = 0; i < LATENCY_JOBS; i++) {
+        jobs[i].index = i;
+        jobs[i].submit_ns = hist_now_ns();
+        threadpool_add_work(pool, timed_job, &jobs[i]);
+        spin_ns(2000);
+    }
+    threadpool_wait(pool);
+
+    static histogram_t h;
+    memset(&h, 0, sizeof(h));
+    for (int i = 0; i < LATENCY_JOBS; i++) {
+        histogram_record(&h, start_latency[i]);
+    }
+    r->start_p50_ns = histogram_percentile(&h, 0.50);
+    r->start_p99_ns = histogram_percentile(&h, 0.99);
+    r->start_p999_ns = histogram_percentile(&h, 0.999);
+    free(start_latency);
+    free(jobs);
+}
+
+
+static void bench_fanout(threadpool_* pool, result_t* r) {
+    uint64_t start = hist_now_ns();
+    for (int round = 0; round < FANOUT_ROUNDS; round++) {
+        for (int i = 0; i < FANOUT_JOBS; i++) {
+            threadpool_add_work(pool, empty_job, NULL);
+        }
+        threadpool_wait(pool);
+    }
+    r->fanout_round_us = (hist_now_ns() - start) / 1e3 / FANOUT_ROUNDS;
+}
+
+
+typedef struct {
+    threadpool_* pool;
+    int jobs;
+    pthread_barrier_t* barrier;
+} producer_arg_t;
+
+
+static void* producer_main(void* arg) {
+    producer_arg_t* p = arg;
+    pthread_barrier_wait(p->barrier);
+    for (int i = 0; i < p->jobs; i++) {
+        threadpool_add_work(p->pool, empty_job, NULL);
+    }
+    return NULL;
+}
+
+
+static void bench_producers(threadpool_* pool, result_t* r) {
+    pthread_t threads[opt.producers];
+    producer_arg_t args[opt.producers];
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, opt.producers + 1);
+
+    for (int i = 0; i < opt.producers; i++) {
+        args[i] = (producer_arg_t){pool, opt.jobs / opt.producers, &barrier};
+        pthread_create(&threads[i], NULL, producer_main, &args[i]);
+    }
+    pthread_barrier_wait(&barrier);
+    uint64_t start = hist_now_ns();
+    for (int i = 0; i < opt.producers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    threadpool_wait(pool);
+    uint64_t done = hist_now_ns();
+    pthread_barrier_destroy(&barrier);
+    r->producers_per_sec = (opt.jobs / opt.producers) * opt.producers / ((done - start) / 1e9);
+}
+
+
+// Fraction of the ideal speedup achieved: 1.0 means the pool added no
+// overhead on top of the jobs' own work spread over min(threads, cpus).
+static double bench_cpu_jobs(threadpool_* pool, int threads, void (*fn)(void*),
+                             uint64_t job_ns, int njobs) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int parallel = threads < cpus ? threads : (int)cpus;
+    uint64_t start = hist_now_ns();
+    for (int i = 0; i < njobs; i++) {
+        threadpool_add_work(pool, fn, NULL);
+    }
+    threadpool_wait(pool);
+    double elapsed = (double)(hist_now_ns() - start);
+    double ideal = (double)job_ns * njobs / parallel;
+    return ideal / elapsed;
+}
+
+
+static void run_size(int threads, result_t* r) {
+    memset(r, 0, sizeof(*r));
+    r->threads = threads;
+    threadpool_* pool = threadpool_init(threads);
+    if (pool == NULL) {
+        fprintf(stderr, "threadpool_init(%d) failed\n", threads);
+        exit(EXIT_FAILURE);
+    }
+    bench_submit(pool, r);
+    bench_latency(pool, r);
+    bench_fanout(pool, r);
+    bench_producers(pool, r);
+    r->tiny_efficiency = bench_cpu_jobs(pool, threads, tiny_job, TINY_JOB_NS, 20000);
+    r->long_efficiency = bench_cpu_jobs(pool, threads, long_job, LONG_JOB_NS, 500);
+
+    threadpool_stats_t stats;
+    threadpool_stats(pool, &stats, NULL, 0);
+    uint64_t busy = stats.total.busy_ns;
+    uint64_t total = busy + stats.total.idle_ns;
+    r->utilization = total ? (double)busy / total : 0;
+    r->queue_high_water = stats.queue_high_water;
+    r->parks_per_job = stats.total.jobs ? (double)stats.total.parks / stats.total.jobs : 0;
+    threadpool_destroy(pool);
+}
+
+
+static void print_results(const result_t* results, int n) {
+    if (opt.json) {
+        printf("[");
+        for (int i = 0; i < n; i++) {
+            const result_t* r = &results[i];
+            printf("%s{\"threads\": %d, \"submit_per_sec\": %.0f, \"complete_per_sec\": %.0f, "
+                   "\"start_latency_us\": {\"p50\": %.2f, \"p99\": %.2f, \"p999\": %.2f}, "
+                   "\"fanout_round_us\": %.1f, \"producers\": %d, \"producers_per_sec\": %.0f, "
+                   "\"tiny_efficiency\": %.3f, \"long_efficiency\": %.3f, "
+                   "\"utilization\": %.3f, \"queue_high_water\": %d, \"parks_per_job\": %.3f}",
+                   i ? ", " : "", r->threads, r->submit_per_sec, r->complete_per_sec,
+                   r->start_p50_ns / 1e3, r->start_p99_ns / 1e3, r->start_p999_ns / 1e3,
+                   r->fanout_round_us, opt.producers, r->producers_per_sec,
+                   r->tiny_efficiency, r->long_efficiency,
+                   r->utilization, r->queue_high_water, r->parks_per_job);
+        }
+        printf("]\n");
+        return;
+    }
+
+    printf("%7s %11s %11s %9s %9s %9s %10s %11s %6s %6s %6s %8s %9s\n",
+           "threads", "submit/s", "complete/s", "start50us", "start99us", "start999us",
+           "fanout_us", "producers/s", "tiny", "long", "util", "queuehwm", "parks/job");
+    for (int i = 0; i < n; i++) {
+        const result_t* r = &results[i];
+        printf("%7d %11.0f %11.0f %9.2f %9.2f %9.2f %10.1f %11.0f %6.2f %6.2f %6.2f %8d %9.3f\n",
+               r->threads, r->submit_per_sec, r->complete_per_sec,
+               r->start_p50_ns / 1e3, r->start_p99_ns / 1e3, r->start_p999_ns / 1e3,
+               r->fanout_round_us, r->producers_per_sec, r->tiny_efficiency, r->long_efficiency,
+               r->utilization, r->queue_high_water, r->parks_per_job);
+    }
+    printf("fanout: %d jobs per round; producers: %d threads; tiny/long: efficiency vs ideal "
+           "for %dus/%dus jobs\n", FANOUT_JOBS, opt.producers, TINY_JOB_NS / 1000, LONG_JOB_NS / 1000);
+}
+
+
+static void parse_sizes(char* list) {
+    opt.nsizes = 0;
+    for (char* tok = strtok(list, ","); tok && opt.nsizes < MAX_POOL_SIZES; tok = strtok(NULL, ",")) {
+        int n = atoi(tok);
+        if (n > 0) {
+            opt.sizes[opt.nsizes++] = n;
+        }
+    }
+}
+
+
+int main(int argc, char** argv) {
+    int c;
+    while ((c = getopt(argc, argv, "t:n:p:j")) != -1) {
+        switch (c) {
+        case 't': parse_sizes(optarg); break;
+        case 'n': opt.jobs = atoi(optarg); break;
+        case 'p': opt.producers = atoi(optarg); break;
+        case 'j': opt.json = true; break;
+        default:
+            fprintf(stderr, "usage: %s [-t 1,2,4,8] [-n jobs] [-p producers] [-j]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (opt.nsizes == 0 || opt.jobs < 1 || opt.producers < 1) {
+        fprintf(stderr, "need at least one pool size, one job and one producer\n");
+        return EXIT_FAILURE;
+    }
+
+    result_t results[MAX_POOL_SIZES];
+    for (int i = 0; i < opt.nsizes; i++) {
+        run_size(opt.sizes[i], &results[i]);
+    }
+    print_results(results, opt.nsizes);
+    return 0;
+}